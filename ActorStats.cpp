@@ -0,0 +1,162 @@
+/*! \file ActorStats.cpp
+\brief  Performance stats and checks for Actor and ActorScheduler.
+
+Sender threads send numbered messages to every actor of a first stage,
+which forwards each message to an actor of a second stage. Each actor
+checks that the messages of each sender, thread or actor, arrive in the
+order they were sent, and the run checks that every message sent was
+delivered.
+*/
+#include "MActor.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// default number of actors, senders, scheduler threads
+static const auto g_NumActors = 64;
+static const auto g_NumSenders = 4;
+static const auto g_NumThreads = 2;
+// messages sent by each sender to each actor
+static const uint64_t g_MsgsPerActor = 20'000;
+// mailbox rows; messages in flight are kept below, so that no Send from
+// Receive waits for a full mailbox with every scheduler thread busy
+static const size_t g_MailboxRows = 1024;
+
+//! a message: sender and its sequence number for the receiving actor
+struct Msg {
+	uint32_t	m_sender;
+	uint64_t	m_seq;
+};
+
+typedef Messenger::MBuffer<g_MailboxRows, 1, Msg> MailboxType;
+
+//! actor counting messages, checking per sender order and forwarding
+class CountingActor : public Messenger::Actor<MailboxType>
+{
+	//! id as a sender to the actors it forwards to
+	uint32_t	m_id;
+	//! next sequence number expected from each sender
+	std::vector<uint64_t>	m_next;
+	//! actors messages are forwarded to, in turn; none for the last stage
+	std::vector<CountingActor*>	m_targets;
+	//! next sequence number sent to each target
+	std::vector<uint64_t>	m_sent;
+	size_t	m_turn = 0;
+	std::atomic<size_t>&	m_delivered;
+	std::atomic<size_t>&	m_outOfOrder;
+	std::atomic<size_t>&	m_inFlight;
+public:
+	CountingActor(Messenger::ActorSchedulerBase& scheduler_, uint32_t id_, size_t numSenders_,
+		std::atomic<size_t>& delivered_, std::atomic<size_t>& outOfOrder_, std::atomic<size_t>& inFlight_) :
+		Messenger::Actor<MailboxType>(scheduler_), m_id(id_), m_next(numSenders_, 0),
+		m_delivered(delivered_), m_outOfOrder(outOfOrder_), m_inFlight(inFlight_)
+	{
+	}
+	void SetTargets(const std::vector<CountingActor*>& targets_)
+	{
+		m_targets = targets_;
+		m_sent.assign(targets_.size(), 0);
+	}
+protected:
+	void Receive(Msg* row_, size_t columns_) override
+	{
+		for (auto i = 0u; i < columns_; ++i)
+		{
+			auto& next = m_next[row_[i].m_sender];
+			if (row_[i].m_seq != next) m_outOfOrder.fetch_add(1, std::memory_order_relaxed);
+			next = row_[i].m_seq + 1;
+			if (m_targets.empty())
+			{
+				m_inFlight.fetch_sub(1, std::memory_order_relaxed);
+				continue;
+			}
+			const auto t = m_turn++ % m_targets.size();
+			m_targets[t]->Send(Msg{ m_id, m_sent[t]++ });
+		}
+		m_delivered.fetch_add(columns_, std::memory_order_relaxed);
+	}
+};
+
+int main(int argc, char** argv)
+{
+	int numActors = g_NumActors, numSenders = g_NumSenders, numThreads = g_NumThreads;
+	if (argc == 4)
+	{
+		sscanf(argv[1], "%d", &numActors);
+		sscanf(argv[2], "%d", &numSenders);
+		sscanf(argv[3], "%d", &numThreads);
+	}
+	else
+	{
+		std::cout << "Usage: ActorStats <num actors> <num senders> <num scheduler threads>\n";
+		std::cout << "No args provided. Taking defaults: " << numActors << " actor(s), "
+			<< numSenders << " sender(s), " << numThreads << " thread(s)\n" << std::endl;
+	}
+	if (numActors < 1 || numSenders < 1 || numThreads < 1 || 2*numActors > 4096)
+	{
+		std::cout << "ERROR: 1 to 2048 actors, at least 1 sender and 1 thread\n";
+		return 1;
+	}
+	std::atomic<size_t> delivered{ 0 }, outOfOrder{ 0 }, inFlight{ 0 };
+	// the run queue holds each actor of both stages at most once
+	Messenger::ActorScheduler<4096> scheduler(numThreads, 16);
+	std::vector<std::unique_ptr<CountingActor>> actors, last;
+	std::vector<CountingActor*> targets;
+	for (auto i = 0; i < numActors; ++i)
+	{
+		last.push_back(std::make_unique<CountingActor>(scheduler, i, numActors, delivered, outOfOrder, inFlight));
+		targets.push_back(last.back().get());
+	}
+	for (auto i = 0; i < numActors; ++i)
+	{
+		actors.push_back(std::make_unique<CountingActor>(scheduler, i, numSenders, delivered, outOfOrder, inFlight));
+		// each first stage actor starts on a different target
+		std::rotate(targets.begin(), targets.begin() + 1, targets.end());
+		actors.back()->SetTargets(targets);
+	}
+	const auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> senders;
+	for (auto s = 0; s < numSenders; ++s)
+	{
+		senders.emplace_back([&, s]() {
+			for (uint64_t seq = 0; seq < g_MsgsPerActor; ++seq)
+			{
+				for (auto& actor : actors)
+				{
+					while (inFlight.load(std::memory_order_relaxed) >= g_MailboxRows - 1)
+						std::this_thread::yield();
+					inFlight.fetch_add(1, std::memory_order_relaxed);
+					actor->Send(Msg{ (uint32_t) s, seq });
+				}
+			}
+		});
+	}
+	for (auto& t : senders)
+		t.join();
+	// each message is delivered once per stage
+	const auto total = (size_t) 2*numActors*numSenders*g_MsgsPerActor;
+	// no new message can arrive: wait until the scheduler has run them all
+	for (auto idle = 0; delivered.load() < total && idle < 5000; )
+	{
+		const auto before = delivered.load();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		idle = delivered.load() == before ? idle + 1 : 0;
+	}
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	scheduler.Stop();
+	std::cout << "------" << numActors << " actors, " << numSenders << " senders, " << numThreads
+		<< " threads : " << delivered.load() << " of " << total << " messages delivered in "
+		<< secs.count() << "s (" << 1e6*secs.count()/total << " usec/msg)" << std::endl;
+	if (delivered.load() != total)
+		std::cout << "ERROR: " << total - delivered.load() << " messages not delivered\n";
+	if (outOfOrder.load())
+		std::cout << "ERROR: " << outOfOrder.load() << " messages out of order\n";
+	for (auto& actor : actors)
+		actor->Stop();
+	for (auto& actor : last)
+		actor->Stop();
+	return delivered.load() == total && !outOfOrder.load() ? 0 : 1;
+}
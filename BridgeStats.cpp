@@ -0,0 +1,180 @@
+/*! \file BridgeStats.cpp
+\brief  Performance stats for BridgeSender/BridgeReceiver.
+
+A producer process forwards rows through a BridgeSender to a consumer
+process on the same host. Throughput is measured at full speed, latency
+(producer publish to remote consumer read) at a fixed rate.
+*/
+#include "MBridge.h"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <sys/wait.h>
+
+// seconds per run
+static const auto g_NumSecs = 3;
+
+//! nanoseconds on the system wide monotonic clock
+inline int64_t NowNsec()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//! producer side: fill rows for g_NumSecs, at rowsPerSec_ if not 0.
+//! Column 0 holds the publish time, the others the row sequence number.
+template<typename TBuffer, typename TCodec>
+void ProducerProcess(int fd_, double rowsPerSec_)
+{
+	auto buffer = std::make_unique<TBuffer>();
+	Messenger::BridgeSender<TBuffer, TCodec> sender(*buffer, fd_);
+	std::thread thread([&sender]() { sender.Run(); });
+	std::unique_ptr<Messenger::TokenBucket> bucket;
+	if (rowsPerSec_ > 0)
+		bucket = std::make_unique<Messenger::TokenBucket>(rowsPerSec_*buffer->BufElemSize(),
+			buffer->BufElemSize(), Messenger::WaitPolicy::SPIN);
+	const auto end = std::chrono::steady_clock::now() + std::chrono::seconds(g_NumSecs);
+	while (std::chrono::steady_clock::now() < end)
+	{
+		size_t absLoc;
+		auto loc = buffer->GetNextLocForProd(absLoc, bucket.get());
+		if (loc >= buffer->BufSize()) break;
+		auto* row = (*buffer)[loc];
+		for (auto col = 1u; col < buffer->BufElemSize(); ++col)
+			row[col] = (int64_t) absLoc;
+		row[0] = NowNsec();
+		buffer->SetLocReadyForCons(absLoc);
+	}
+	// let the sender forward what is left
+	while (buffer->Occupancy())
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	sender.Stop();
+	thread.join();
+}
+
+//! consumer side: read rows until the stream ends; print stats
+template<typename TBuffer, typename TCodec>
+void ConsumerProcess(int fd_, const std::string& name_)
+{
+	auto buffer = std::make_unique<TBuffer>();
+	Messenger::BridgeReceiver<TBuffer, TCodec> receiver(*buffer, fd_);
+	std::vector<int64_t> latencies;
+	latencies.reserve(1 << 20);
+	size_t rows = 0;
+	auto errors = 0;
+	std::thread consumer([&]() {
+		while (true)
+		{
+			size_t absLoc;
+			auto loc = buffer->GetNextLocForCons(absLoc);
+			if (loc >= buffer->BufSize()) break;
+			const auto* row = (*buffer)[loc];
+			const auto now = NowNsec();
+			if (row[buffer->BufElemSize() - 1] != (int64_t) rows) ++errors;
+			if (latencies.size() < latencies.capacity()) latencies.push_back(now - row[0]);
+			buffer->SetLocReadyForProd(absLoc);
+			++rows;
+		}
+	});
+	const auto start = std::chrono::steady_clock::now();
+	const auto received = receiver.Run();
+	while (rows < received)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	buffer->Stop();
+	consumer.join();
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&latencies](double p_) {
+		return latencies.empty() ? 0.0 : latencies[size_t(p_*(latencies.size() - 1))]/1000.0;
+	};
+	const auto bytes = double(rows)*buffer->BufElemSize()*sizeof(int64_t);
+	std::cout << "------" << name_ << " : " << rows << " rows of "
+		<< buffer->BufElemSize()*sizeof(int64_t) << " bytes, "
+		<< rows/secs.count() << " rows/s (" << bytes/secs.count()/(1024*1024) << " MB/s), latency usec p50 "
+		<< percentile(0.5) << " p99 " << percentile(0.99) << " p99.9 " << percentile(0.999)
+		<< (errors || receiver.Error() ? ", SEQUENCE ERRORS" : "") << std::endl;
+}
+
+//! run producer and consumer in two processes connected by a socket pair
+template<typename TBuffer, typename TCodec = void>
+void RunBridge(const std::string& name_, double rowsPerSec_)
+{
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) != 0)
+	{
+		throw std::runtime_error("socketpair failed");
+	}
+	std::cout.flush();
+	const auto pid = fork();
+	if (pid == 0)
+	{
+		::close(fds[0]);
+		ConsumerProcess<TBuffer, TCodec>(fds[1], name_);
+		std::cout.flush();
+		_exit(0);
+	}
+	::close(fds[1]);
+	ProducerProcess<TBuffer, TCodec>(fds[0], rowsPerSec_);
+	waitpid(pid, nullptr, 0);
+}
+
+//! stop a sender waiting for credit from a receiver whose buffer is full
+void RunStopWithoutCredit()
+{
+	typedef Messenger::MBuffer<64, 8, int64_t> SmallBufType;
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) != 0)
+	{
+		throw std::runtime_error("socketpair failed");
+	}
+	auto local = std::make_unique<SmallBufType>();
+	auto remote = std::make_unique<SmallBufType>();
+	Messenger::BridgeSender<SmallBufType> sender(*local, fds[0]);
+	Messenger::BridgeReceiver<SmallBufType> receiver(*remote, fds[1]);
+	std::thread producer([&]() {
+		size_t absLoc;
+		for (auto loc = local->GetNextLocForProd(absLoc); loc < local->BufSize(); loc = local->GetNextLocForProd(absLoc))
+		{
+			std::fill((*local)[loc], (*local)[loc] + local->BufElemSize(), (int64_t) absLoc);
+			local->SetLocReadyForCons(absLoc);
+		}
+	});
+	std::thread senderThread([&sender]() { sender.Run(); });
+	std::thread receiverThread([&receiver]() { receiver.Run(); });
+	// nothing consumes the remote buffer: once full, the sender has no credit
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	const auto start = std::chrono::steady_clock::now();
+	sender.Stop();
+	senderThread.join();
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	receiverThread.join();
+	producer.join();
+	auto errors = 0;
+	size_t absLoc;
+	for (auto loc = remote->TryGetNextLocForCons(absLoc); loc < remote->BufSize(); loc = remote->TryGetNextLocForCons(absLoc))
+	{
+		errors += (*remote)[loc][0] != (int64_t) absLoc;
+		remote->SetLocReadyForProd(absLoc);
+	}
+	std::cout << "------stop while waiting for credit : sender returned in " << 1e3*secs.count() << " msec, "
+		<< receiver.NumRows() << " of " << sender.NumRows() << " rows received"
+		<< (errors || receiver.Error() || sender.Error() || receiver.NumRows() != sender.NumRows() ? ", SEQUENCE ERRORS" : "")
+		<< std::endl;
+}
+
+int main()
+{
+	typedef Messenger::MBuffer<4096, 64, int64_t> NarrowBufType;
+	typedef Messenger::MBuffer<256, 2048, int64_t> WideBufType;
+	RunBridge<NarrowBufType>("512 byte rows, full speed", 0);
+	RunBridge<WideBufType>("16 KB rows, full speed", 0);
+	RunBridge<NarrowBufType>("512 byte rows, 10000 rows/s", 10000);
+	RunBridge<WideBufType>("16 KB rows, 10000 rows/s", 10000);
+	// column 0 changes little from row to row, the others not at all within a row
+	typedef Messenger::RowCodec<int64_t, Messenger::Whole<int64_t, Messenger::Encoding::DELTA_VARINT>> DeltaCodec;
+	RunBridge<NarrowBufType, DeltaCodec>("512 byte rows, delta varint codec, full speed", 0);
+	RunBridge<WideBufType, DeltaCodec>("16 KB rows, delta varint codec, full speed", 0);
+	RunStopWithoutCredit();
+}
@@ -0,0 +1,92 @@
+/*! \file CodecStats.cpp
+\brief  Performance stats for RowCodec.
+
+Encodes and decodes rows of typical messages, reporting the encoded size
+against the raw row size and the encode/decode rates.
+*/
+#include "MCodec.h"
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// rows encoded and decoded per run
+static const auto g_NumRows = 200000;
+
+//! market data like message: monotonic sequence and time, small quantity
+struct Trade {
+	int64_t		m_seq;
+	int64_t		m_time;
+	double		m_price;
+	int32_t		m_qty;
+	int32_t		m_venue;
+	bool operator!=(const Trade& t_) const
+	{
+		return m_seq != t_.m_seq || m_time != t_.m_time || m_price != t_.m_price ||
+			m_qty != t_.m_qty || m_venue != t_.m_venue;
+	}
+};
+
+typedef Messenger::RawCodec<Trade> TradeRawCodec;
+typedef Messenger::RowCodec<Trade,
+	Messenger::Field<&Trade::m_seq, Messenger::Encoding::DELTA_VARINT>,
+	Messenger::Field<&Trade::m_time, Messenger::Encoding::DELTA_VARINT>,
+	Messenger::Field<&Trade::m_price>,
+	Messenger::Field<&Trade::m_qty, Messenger::Encoding::DELTA_VARINT>,
+	Messenger::Field<&Trade::m_venue, Messenger::Encoding::DELTA_VARINT>> TradeCodec;
+typedef Messenger::RawCodec<int64_t> SeqRawCodec;
+typedef Messenger::RowCodec<int64_t, Messenger::Whole<int64_t, Messenger::Encoding::DELTA_VARINT>> SeqCodec;
+
+//! encode and decode g_NumRows rows of columns_ messages; print stats
+template<typename TCodec, typename TMsg>
+void Run(const std::string& name_, const std::vector<TMsg>& msgs_, size_t columns_)
+{
+	const auto numRows = msgs_.size()/columns_;
+	std::vector<char> encoded(TCodec::MaxEncodedSize(columns_)*numRows);
+	std::vector<size_t> offsets(numRows + 1, 0);
+	auto start = std::chrono::steady_clock::now();
+	for (size_t r = 0; r < numRows; ++r)
+		offsets[r + 1] = offsets[r] + TCodec::Encode(&msgs_[r*columns_], columns_, encoded.data() + offsets[r]);
+	std::chrono::duration<double> encodeSecs = std::chrono::steady_clock::now() - start;
+	std::vector<TMsg> decoded(msgs_.size());
+	auto errors = 0;
+	start = std::chrono::steady_clock::now();
+	for (size_t r = 0; r < numRows; ++r)
+	{
+		const auto size = offsets[r + 1] - offsets[r];
+		if (TCodec::Decode(encoded.data() + offsets[r], size, &decoded[r*columns_], columns_) != size) ++errors;
+	}
+	std::chrono::duration<double> decodeSecs = std::chrono::steady_clock::now() - start;
+	for (size_t i = 0; i < msgs_.size(); ++i)
+		if (decoded[i] != msgs_[i]) ++errors;
+	const auto rawBytes = double(msgs_.size()*sizeof(TMsg));
+	std::cout << "------" << name_ << " : " << double(offsets[numRows])/numRows << " bytes per row ("
+		<< 100.0*offsets[numRows]/rawBytes << "% of raw), encode "
+		<< rawBytes/encodeSecs.count()/(1024*1024) << " MB/s, decode "
+		<< rawBytes/decodeSecs.count()/(1024*1024) << " MB/s"
+		<< (errors ? ", DECODE ERRORS" : "") << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	size_t columns = 64;
+	if (argc > 1) sscanf(argv[1], "%zu", &columns);
+	if (!columns) columns = 64;
+	std::mt19937_64 rng(42);
+	std::vector<Trade> trades(g_NumRows*columns);
+	int64_t time = 1700000000000000000ll;
+	for (size_t i = 0; i < trades.size(); ++i)
+	{
+		time += (int64_t) (rng() % 5000);
+		trades[i] = Trade{ (int64_t) i, time, 100.0 + (rng() % 10000)/100.0,
+			(int32_t) (rng() % 1000), (int32_t) (rng() % 8) };
+	}
+	Run<TradeRawCodec>("trades, raw", trades, columns);
+	Run<TradeCodec>("trades, delta varint seq/time/qty/venue", trades, columns);
+	std::vector<int64_t> seqs(g_NumRows*columns);
+	for (size_t i = 0; i < seqs.size(); ++i)
+		seqs[i] = (int64_t) i;
+	Run<SeqRawCodec>("sequence numbers, raw", seqs, columns);
+	Run<SeqCodec>("sequence numbers, delta varint", seqs, columns);
+}
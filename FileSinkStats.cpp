@@ -0,0 +1,167 @@
+/*! \file FileSinkStats.cpp
+\brief  Write rates and file checks for FileSink.
+
+Producers fill rows with values derived from their absolute location and
+sinks write them to a shared file, through io_uring and through the
+pwrite() fallback. The file is read back and every row checked, for a
+run that writes a fixed number of rows and for one stopped while
+producers are still producing and writes are in flight. Sinks after the
+first open the file once rows are in it, which they must leave there.
+*/
+#include "MFileSink.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// rows written per complete run
+static const size_t g_NumRows = 16384;
+// default number of producers and sinks
+static const auto g_NumProd = 2;
+static const auto g_NumSinks = 2;
+// time before the stop of a stopped run
+static const auto g_StopAfter = std::chrono::milliseconds(50);
+
+// 4 KB rows
+static const size_t g_Columns = 512;
+typedef Messenger::MBuffer<1024, g_Columns, uint64_t> BufType;
+typedef Messenger::FileSink<BufType> SinkType;
+
+//! value of column col_ of the row at absLoc_; never 0, so that holes show
+inline uint64_t RowValue(size_t absLoc_, size_t col_)
+{
+	return (uint64_t) absLoc_*1'000'003 + col_ + 1;
+}
+
+//! check the rows of path_: rows with a non zero first value must hold
+//! their values; return the number of such rows, counting bad ones in bad_
+size_t CheckFile(const std::string& path_, size_t columns_, size_t& bad_)
+{
+	std::vector<uint64_t> row(columns_);
+	size_t rows = 0;
+	bad_ = 0;
+	auto* file = fopen(path_.c_str(), "rb");
+	if (!file) return 0;
+	for (size_t absLoc = 0; fread(row.data(), sizeof(uint64_t), columns_, file) == columns_; ++absLoc)
+	{
+		if (!row[0]) continue;
+		++rows;
+		for (auto col = 0u; col < columns_; ++col)
+		{
+			if (row[col] != RowValue(absLoc, col))
+			{
+				++bad_;
+				break;
+			}
+		}
+	}
+	fclose(file);
+	return rows;
+}
+
+//! write g_NumRows rows, or as many as written until stopped if stop_
+void Run(const std::string& path_, bool useIoUring_, bool stop_, size_t numProd_, size_t numSinks_)
+{
+	auto buffer = std::make_unique<BufType>();
+	// the sinks share the file: a row is written at absLoc x row bytes
+	std::vector<std::unique_ptr<SinkType>> sinks;
+	sinks.push_back(std::make_unique<SinkType>(*buffer, path_, 32, false, useIoUring_));
+	std::atomic<long> toProduce{ stop_ ? LONG_MAX : (long) g_NumRows };
+	std::vector<std::thread> threads;
+	for (auto p = 0u; p < numProd_; ++p)
+	{
+		threads.emplace_back([&]() {
+			while (toProduce.fetch_sub(1) > 0)
+			{
+				size_t absLoc;
+				const auto loc = buffer->GetNextLocForProd(absLoc);
+				if (loc >= buffer->BufSize()) break;
+				auto* row = (*buffer)[loc];
+				for (auto col = 0u; col < buffer->BufElemSize(); ++col)
+					row[col] = RowValue(absLoc, col);
+				buffer->SetLocReadyForCons(absLoc);
+			}
+		});
+	}
+	const auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> sinkThreads;
+	sinkThreads.emplace_back([sink = sinks[0].get()]() { sink->Run(); });
+	// the other sinks join once rows are in the file, and must keep them
+	while (!sinks[0]->NumRows())
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	for (auto s = 1u; s < numSinks_; ++s)
+	{
+		sinks.push_back(std::make_unique<SinkType>(*buffer, path_, 32, false, useIoUring_, false));
+		sinkThreads.emplace_back([sink = sinks.back().get()]() { sink->Run(); });
+	}
+	auto written = [&]() {
+		size_t n = 0;
+		for (auto& sink : sinks)
+			n += sink->NumRows();
+		return n;
+	};
+	if (stop_)
+		std::this_thread::sleep_for(g_StopAfter);
+	else
+	{
+		while (written() < g_NumRows)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	for (auto& sink : sinks)
+		sink->Stop();
+	for (auto& t : sinkThreads)
+		t.join();
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	// rows are handed back to producers only now that no write is in flight
+	buffer->Stop();
+	for (auto& t : threads)
+		t.join();
+	const auto numRows = written();
+	int error = 0;
+	for (auto& sink : sinks)
+		error = error ? error : sink->Error();
+	const auto usesIoUring = sinks[0]->UsesIoUring();
+	sinks.clear();
+	size_t bad = 0;
+	const auto rowsInFile = CheckFile(path_, buffer->BufElemSize(), bad);
+	::unlink(path_.c_str());
+	const auto rowBytes = buffer->BufElemSize()*sizeof(uint64_t);
+	std::cout << "------" << (usesIoUring ? "io_uring" : "pwrite") << (stop_ ? ", stopped" : "") << " : "
+		<< numRows << " rows written, " << numRows*rowBytes/secs.count()/(1 << 20) << " MB/s; "
+		<< rowsInFile << " rows in file, " << bad << " bad" << std::endl;
+	if (useIoUring_ && !usesIoUring)
+		std::cout << "       io_uring not available, pwrite used\n";
+	if (error || bad || rowsInFile != numRows || (!stop_ && numRows != g_NumRows))
+		std::cout << "ERROR: rows written or file contents do not match, error " << error << "\n";
+}
+
+int main(int argc, char** argv)
+{
+	std::string dir = "/tmp";
+	int numProd = g_NumProd, numSinks = g_NumSinks;
+	if (argc == 4)
+	{
+		dir = argv[1];
+		sscanf(argv[2], "%d", &numProd);
+		sscanf(argv[3], "%d", &numSinks);
+	}
+	else
+	{
+		std::cout << "Usage: FileSinkStats <dir> <num producers> <num sinks>\n";
+		std::cout << "No args provided. Taking defaults: " << dir << ", " << numProd << " producer(s), "
+			<< numSinks << " sink(s)\n" << std::endl;
+	}
+	const auto path = dir + "/mbuffer_file_sink_stats";
+	std::cout << "File sink, " << g_NumRows << " rows of " << g_Columns*sizeof(uint64_t) << " bytes\n";
+	std::cout << "------------------------------------------------------\n";
+	for (auto useIoUring : { true, false })
+	{
+		Run(path, useIoUring, false, (size_t) numProd, (size_t) std::max(numSinks, 1));
+		Run(path, useIoUring, true, (size_t) numProd, (size_t) std::max(numSinks, 1));
+	}
+}
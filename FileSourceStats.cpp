@@ -0,0 +1,171 @@
+/*! \file FileSourceStats.cpp
+\brief  Performance stats for FileSource.
+
+Replays a file of records through an MBuffer, once as zero-copy views
+into an mmap of the file and once by read() into a staging buffer and
+copying every record into the row.
+*/
+#include "MFileSource.h"
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// record size for fixed size framing
+static const size_t g_RecordSize = 64;
+// default file size in MB
+static const auto g_FileSizeMB = 256;
+// rows x columns of the buffers
+static const size_t g_Rows = 4096;
+static const size_t g_Columns = 64;
+
+//! record copied into a row by the read() based producer
+struct RecordCopy {
+	size_t	m_length;
+	char	m_data[g_RecordSize];
+};
+
+//! byte checksum, so that consumers touch every record byte
+inline uint64_t Checksum(const char* data_, size_t length_)
+{
+	uint64_t sum = 0;
+	for (auto i = 0u; i < length_; ++i)
+		sum += (unsigned char) data_[i];
+	return sum;
+}
+inline uint64_t Checksum(const Messenger::RecordView& r_) { return Checksum(r_.m_data, r_.m_length); }
+inline uint64_t Checksum(const RecordCopy& r_) { return Checksum(r_.m_data, r_.m_length); }
+inline bool IsRecord(const Messenger::RecordView& r_) { return bool(r_); }
+inline bool IsRecord(const RecordCopy& r_) { return r_.m_length != 0; }
+
+//! write a file of numRecords_ records with fixed or length prefixed framing
+void WriteFile(const std::string& path_, size_t numRecords_, Messenger::Framing framing_)
+{
+	auto* f = fopen(path_.c_str(), "wb");
+	if (!f) throw std::runtime_error("cannot create " + path_);
+	std::vector<char> rec(g_RecordSize);
+	for (size_t i = 0; i < numRecords_; ++i)
+	{
+		auto length = uint32_t(g_RecordSize);
+		if (framing_ == Messenger::Framing::LENGTH_PREFIXED)
+		{
+			length = uint32_t(16 + i % (g_RecordSize - 16));
+			fwrite(&length, sizeof(length), 1, f); // little endian hosts
+		}
+		for (auto j = 0u; j < length; ++j)
+			rec[j] = char(i + j);
+		fwrite(rec.data(), 1, length, f);
+	}
+	fclose(f);
+}
+
+//! consume rows until all published_ records are read; return number of records
+template<typename TBuffer>
+size_t Consume(TBuffer& buffer_, const std::atomic<size_t>& published_, uint64_t& sum_)
+{
+	size_t numRecords = 0;
+	while (numRecords < published_.load())
+	{
+		size_t absLoc;
+		auto loc = buffer_.TryGetNextLocForCons(absLoc);
+		if (loc >= buffer_.BufSize()) continue;
+		const auto* row = buffer_[loc];
+		for (auto col = 0u; col < buffer_.BufElemSize(); ++col)
+		{
+			if (!IsRecord(row[col])) break;
+			sum_ += Checksum(row[col]);
+			++numRecords;
+		}
+		buffer_.SetLocReadyForProd(absLoc);
+	}
+	return numRecords;
+}
+
+//! run producer_ and one consumer over buffer_; print throughput
+template<typename TBuffer, typename TProducer>
+void Run(const std::string& name_, size_t fileSize_, TBuffer& buffer_, TProducer producer_)
+{
+	buffer_.Reset();
+	std::atomic<size_t> published;
+	published.store(size_t(-1));
+	uint64_t sum = 0;
+	size_t consumed = 0;
+	auto start = std::chrono::steady_clock::now();
+	std::thread consumer([&]() { consumed = Consume(buffer_, published, sum); });
+	published.store(producer_(buffer_));
+	consumer.join();
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	std::cout << "------" << name_ << " : " << consumed << " records, "
+		<< secs.count() << "s (" << fileSize_/secs.count()/(1024*1024) << " MB/s, "
+		<< 1e9*secs.count()/consumed << " nsec/record), checksum " << sum << std::endl;
+}
+
+//! read() file in chunks and copy each fixed size record into a row
+template<typename TBuffer>
+size_t ReadCopy(const std::string& path_, TBuffer& buffer_)
+{
+	const auto fd = ::open(path_.c_str(), O_RDONLY);
+	if (fd < 0) throw std::runtime_error("cannot open " + path_);
+	std::vector<char> chunk(g_Columns*g_RecordSize);
+	size_t numRecords = 0;
+	ssize_t n;
+	while ((n = ::read(fd, chunk.data(), chunk.size())) > 0)
+	{
+		size_t absLoc;
+		auto loc = buffer_.GetNextLocForProd(absLoc);
+		if (loc >= buffer_.BufSize()) break;
+		auto* row = buffer_[loc];
+		const auto count = size_t(n)/g_RecordSize;
+		for (auto col = 0u; col < buffer_.BufElemSize(); ++col)
+		{
+			row[col].m_length = col < count ? g_RecordSize : 0;
+			if (col < count)
+				memcpy(row[col].m_data, &chunk[col*g_RecordSize], g_RecordSize);
+		}
+		numRecords += count;
+		buffer_.SetLocReadyForCons(absLoc);
+	}
+	::close(fd);
+	return numRecords;
+}
+
+int main(int argc, char** argv)
+{
+	int sizeMB = g_FileSizeMB;
+	std::string dir = "/tmp";
+	if (argc == 3)
+	{
+		sscanf(argv[1], "%d", &sizeMB);
+		dir = argv[2];
+	}
+	else
+	{
+		std::cout << "Usage: FileSourceStats <file size MB> <directory>\n";
+		std::cout << "No args provided. Taking defaults: "
+			<< sizeMB << " MB in " << dir << "\n" << std::endl;
+	}
+	const auto numRecords = size_t(sizeMB)*1024*1024/g_RecordSize;
+	const auto fixedPath = dir + "/FileSourceStats.fixed";
+	const auto prefixedPath = dir + "/FileSourceStats.prefixed";
+	WriteFile(fixedPath, numRecords, Messenger::Framing::FIXED_SIZE);
+	WriteFile(prefixedPath, numRecords, Messenger::Framing::LENGTH_PREFIXED);
+
+	typedef Messenger::MBuffer<g_Rows, g_Columns, Messenger::RecordView> ViewBufType;
+	typedef Messenger::MBuffer<g_Rows, g_Columns, RecordCopy> CopyBufType;
+	auto viewBuf = std::make_unique<ViewBufType>();
+	auto copyBuf = std::make_unique<CopyBufType>();
+	{
+		Messenger::FileSource<ViewBufType> source(fixedPath, Messenger::Framing::FIXED_SIZE, g_RecordSize);
+		Run("mmap views, fixed size", source.Size(), *viewBuf,
+			[&source](ViewBufType& b_) { return source.Run(b_); });
+	}
+	{
+		Messenger::FileSource<ViewBufType> source(prefixedPath, Messenger::Framing::LENGTH_PREFIXED, 4);
+		Run("mmap views, length prefixed", source.Size(), *viewBuf,
+			[&source](ViewBufType& b_) { return source.Run(b_); });
+	}
+	Run("read() + copy into rows, fixed size", numRecords*g_RecordSize, *copyBuf,
+		[&fixedPath](CopyBufType& b_) { return ReadCopy(fixedPath, b_); });
+	remove(fixedPath.c_str());
+	remove(prefixedPath.c_str());
+}
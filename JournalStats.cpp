@@ -0,0 +1,165 @@
+/*! \file JournalStats.cpp
+\brief  Performance stats for JournalWriter and JournalCursor.
+
+Journals the same stream of rows with and without compression and
+reports the journal rate, the bytes on disk, the rate of reading the
+journal back with a JournalCursor and of random JournalReader lookups,
+and checks that a cursor reports damaged compressed segments.
+*/
+#include "MJournal.h"
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+
+// rows journaled per run
+static const size_t g_NumRows = 200000;
+
+typedef Messenger::MBuffer<1024, 64, int64_t> BufType;
+
+//! remove the segment files of dir_ and dir_ itself
+void RemoveJournal(const std::string& dir_)
+{
+	for (auto first : Messenger::JournalLayout::Segments(dir_))
+	{
+		::unlink(Messenger::JournalLayout::SegmentPath(dir_, first, false).c_str());
+		::unlink(Messenger::JournalLayout::SegmentPath(dir_, first, true).c_str());
+	}
+	::rmdir(dir_.c_str());
+}
+
+//! journal a row with a new writer on the journal in dir_, as after a
+//! restart: return true if the writer failed with -EEXIST, leaving row 0
+bool RestartRefused(const std::string& dir_, bool compress_)
+{
+	auto buffer = std::make_unique<BufType>();
+	Messenger::JournalWriter<BufType> writer(*buffer, dir_, 4096, compress_);
+	std::thread thread([&writer]() { writer.Run(); });
+	size_t absLoc;
+	auto loc = buffer->GetNextLocForProd(absLoc);
+	std::fill((*buffer)[loc], (*buffer)[loc] + buffer->BufElemSize(), -1);
+	buffer->SetLocReadyForCons(absLoc);
+	while (buffer->Occupancy())
+		std::this_thread::yield();
+	writer.Stop();
+	thread.join();
+	Messenger::JournalReader<int64_t> reader(dir_, buffer->BufElemSize());
+	const auto* row = reader.ReadAt(0);
+	return writer.Error() == -EEXIST && row && row[1] == 0;
+}
+
+//! journal g_NumRows rows into dir_, read them back; print stats
+//! overwrite the 8 bytes at offset_ of file path_ with value_
+void PatchFile(const std::string& path_, long offset_, uint64_t value_)
+{
+	auto* file = fopen(path_.c_str(), "r+b");
+	if (!file) return;
+	fseek(file, offset_, SEEK_SET);
+	fwrite(&value_, sizeof(value_), 1, file);
+	fclose(file);
+}
+
+//! damage block 0 of the first compressed segment of dir_ and the header
+//! of the second: a cursor must stop at each with Error() -EIO, not skip it
+bool CorruptionReported(const std::string& dir_, size_t columns_)
+{
+	const auto segments = Messenger::JournalLayout::Segments(dir_);
+	if (segments.size() < 2) return false;
+	// block 0 is 1 byte long: it no longer decompresses to its rows
+	const auto offsets = (long) sizeof(Messenger::JournalSegmentHeader);
+	uint64_t offset0 = 0;
+	auto* file = fopen(Messenger::JournalLayout::SegmentPath(dir_, segments[0], true).c_str(), "rb");
+	if (!file) return false;
+	fseek(file, offsets, SEEK_SET);
+	const auto read = fread(&offset0, sizeof(offset0), 1, file) == 1;
+	fclose(file);
+	if (!read) return false;
+	PatchFile(Messenger::JournalLayout::SegmentPath(dir_, segments[0], true), offsets + 8, offset0 + 1);
+	PatchFile(Messenger::JournalLayout::SegmentPath(dir_, segments[1], true), 0, 0);
+	Messenger::JournalCursor<int64_t> blockCursor(dir_, columns_);
+	uint64_t absLoc;
+	const auto badBlock = !blockCursor.Next(absLoc) && blockCursor.Error() == -EIO && blockCursor.Position() == 0;
+	Messenger::JournalCursor<int64_t> segmentCursor(dir_, columns_, segments[1]);
+	const auto badSegment = !segmentCursor.Next(absLoc) && segmentCursor.Error() == -EIO &&
+		segmentCursor.Position() == segments[1];
+	return badBlock && badSegment;
+}
+
+void Run(const std::string& name_, const std::string& dir_, bool compress_)
+{
+	RemoveJournal(dir_);
+	auto buffer = std::make_unique<BufType>();
+	const auto rowBytes = buffer->BufElemSize()*sizeof(int64_t);
+	auto writer = std::make_unique<Messenger::JournalWriter<BufType>>(*buffer, dir_, 4096, compress_);
+	std::thread thread([&writer]() { writer->Run(); });
+	const auto start = std::chrono::steady_clock::now();
+	// column 0 holds a time stamp, the others a slowly changing sequence
+	for (size_t r = 0; r < g_NumRows; ++r)
+	{
+		size_t absLoc;
+		auto loc = buffer->GetNextLocForProd(absLoc);
+		if (loc >= buffer->BufSize()) break;
+		auto* row = (*buffer)[loc];
+		row[0] = std::chrono::steady_clock::now().time_since_epoch().count();
+		for (auto col = 1u; col < buffer->BufElemSize(); ++col)
+			row[col] = (int64_t) (absLoc*buffer->BufElemSize() + col)/16;
+		buffer->SetLocReadyForCons(absLoc);
+	}
+	while (buffer->Occupancy())
+		std::this_thread::yield();
+	std::chrono::duration<double> writeSecs = std::chrono::steady_clock::now() - start;
+	writer->Stop();
+	thread.join();
+	writer->Flush();
+	uint64_t diskBytes = 0;
+	for (auto first : Messenger::JournalLayout::Segments(dir_))
+	{
+		struct stat st;
+		if (::stat(Messenger::JournalLayout::SegmentPath(dir_, first, compress_).c_str(), &st) == 0)
+			diskBytes += (uint64_t) st.st_size;
+	}
+	const auto readStart = std::chrono::steady_clock::now();
+	Messenger::JournalCursor<int64_t> cursor(dir_, buffer->BufElemSize());
+	uint64_t absLoc, rows = 0, errors = 0;
+	while (const auto* row = cursor.Next(absLoc))
+	{
+		if (absLoc != rows || row[buffer->BufElemSize() - 1] !=
+			(int64_t) (absLoc*buffer->BufElemSize() + buffer->BufElemSize() - 1)/16)
+		{
+			++errors;
+		}
+		++rows;
+	}
+	std::chrono::duration<double> readSecs = std::chrono::steady_clock::now() - readStart;
+	// random reads through the segment index
+	Messenger::JournalReader<int64_t> reader(dir_, buffer->BufElemSize());
+	std::mt19937_64 rng(42);
+	const auto lookups = g_NumRows/2;
+	const auto lookupStart = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < lookups; ++i)
+	{
+		const auto at = rng() % g_NumRows;
+		const auto* row = reader.ReadAt(at);
+		if (!row || row[1] != (int64_t) (at*buffer->BufElemSize() + 1)/16) ++errors;
+	}
+	std::chrono::duration<double> lookupSecs = std::chrono::steady_clock::now() - lookupStart;
+	const auto rawMB = double(g_NumRows)*rowBytes/(1024*1024);
+	std::cout << "------" << name_ << " : journal " << rawMB/writeSecs.count() << " MB/s, "
+		<< diskBytes/(1024.0*1024) << " MB on disk for " << rawMB << " MB of rows, read back "
+		<< rows << " rows at " << double(rows)*rowBytes/(1024*1024)/readSecs.count() << " MB/s, "
+		<< lookups/lookupSecs.count() << " random ReadAt/s"
+		<< (errors || rows != g_NumRows || writer->Error() ? ", READ ERRORS" : "")
+		<< (RestartRefused(dir_, compress_) ? "" : ", RESTART OVERWROTE SEGMENT")
+		<< (!compress_ || CorruptionReported(dir_, buffer->BufElemSize()) ? "" : ", CORRUPTION NOT REPORTED") << std::endl;
+	writer.reset();
+	RemoveJournal(dir_);
+}
+
+int main(int argc, char** argv)
+{
+	std::string dir = "/tmp";
+	if (argc > 1) dir = argv[1];
+	Run("raw segments", dir + "/mbuffer_journal_stats", false);
+	Run("compressed segments", dir + "/mbuffer_journal_stats", true);
+}
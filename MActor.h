@@ -0,0 +1,211 @@
+/*! \file MActor.h
+    \brief  Lightweight actors with MBuffer mailboxes.
+
+	Many actors are multiplexed over a small pool of scheduler threads.
+*/
+#pragma once
+
+#include "MBuffer.h"
+#include <memory>
+#include <vector>
+
+namespace Messenger {
+
+class ActorBase;
+
+//! Interface an actor uses to hand itself to its scheduler.
+class ActorSchedulerBase {
+public:
+	virtual ~ActorSchedulerBase() {}
+	//! queue actor_ for an activation on one of the scheduler threads.
+	virtual void Schedule(ActorBase* actor_) = 0;
+};
+
+//! Part of an actor seen by the scheduler.
+
+//! An actor is runnable while m_pending > 0, i.e. while rows have been
+// published to its mailbox but not yet processed.
+// Only the sender that moves m_pending from 0 to 1 schedules the actor,
+// and the scheduler only reschedules it after an activation has finished,
+// so an actor is never queued or run by two threads at the same time.
+// This gives per-actor serial execution without any lock.
+class ActorBase {
+	template<size_t> friend class ActorScheduler;
+	//! number of rows published to the mailbox and not yet processed.
+	std::atomic<long>	m_pending;
+	//! scheduler this actor runs on
+	ActorSchedulerBase&	m_scheduler;
+protected:
+	ActorBase(ActorSchedulerBase& scheduler_) : m_scheduler(scheduler_)
+	{
+		m_pending.store(0);
+	}
+	//! called by a sender once a row is ready for consumption.
+	void Notify()
+	{
+		if (m_pending.fetch_add(1) == 0)
+			m_scheduler.Schedule(this);
+	}
+	//! process up to maxRows_ mailbox rows; return number of rows processed.
+	/*! Called by exactly one scheduler thread at a time. */
+	virtual size_t Activate(size_t maxRows_) = 0;
+public:
+	virtual ~ActorBase() {}
+};
+
+//! Actor whose mailbox is an MBuffer of type TMailbox.
+
+//! Senders on any thread Post/Send rows into the mailbox (multiple producers);
+// the scheduler is the only consumer, so rows reach Receive in mailbox order
+// and one at a time. A row is the unit of delivery: a sender that fills all
+// columns of a row delivers a batch of messages for the price of one claim.
+// Posting to a full mailbox waits in GetNextLocForProd, so an actor must not
+// fill its own mailbox from within Receive; nor another actor's, unless a
+// scheduler thread is left to drain it.
+template<typename TMailbox>
+class Actor : public ActorBase {
+public:
+	typedef TMailbox MailboxType;
+	typedef typename TMailbox::ValueType ValueType;
+private:
+	//! mailbox: allocated on heap as an MBuffer holds its rows inline.
+	std::unique_ptr<TMailbox>	m_mailbox;
+public:
+	Actor(ActorSchedulerBase& scheduler_) :
+		ActorBase(scheduler_),
+		m_mailbox(std::make_unique<TMailbox>())
+	{
+	}
+	//! claim a mailbox row, fill it with fill_ and deliver it.
+	/*!
+	    fill_ is called as fill_(ValueType* row, size_t columns).
+
+		\return false if the mailbox has been stopped.
+	*/
+	template<typename TFill>
+	bool Post(TFill&& fill_)
+	{
+		size_t absLoc;
+		auto loc = m_mailbox->GetNextLocForProd(absLoc);
+		if (loc >= m_mailbox->BufSize()) return false;
+		fill_((*m_mailbox)[loc], m_mailbox->BufElemSize());
+		m_mailbox->SetLocReadyForCons(absLoc);
+		Notify();
+		return true;
+	}
+	//! deliver a single message. Intended for single column mailboxes.
+	bool Send(const ValueType& msg_)
+	{
+		assert(m_mailbox->BufElemSize() == 1);
+		return Post([&msg_](ValueType* row_, size_t) { row_[0] = msg_; });
+	}
+	//! stop the mailbox, releasing senders waiting for a free row.
+	void Stop() { m_mailbox->Stop(); }
+	//! access to mailbox, e.g. to call SetRowsColumns before first use.
+	TMailbox&	Mailbox() { return *m_mailbox; }
+protected:
+	//! handle one mailbox row of columns_ messages.
+	virtual void Receive(ValueType* row_, size_t columns_) = 0;
+private:
+	size_t Activate(size_t maxRows_) override
+	{
+		auto numRows = 0u;
+		for (; numRows < maxRows_; ++numRows)
+		{
+			size_t absLoc;
+			// a row counted in m_pending may still be behind a row another
+			// sender is writing; in that case give up this activation
+			// rather than hold a scheduler thread.
+			auto loc = m_mailbox->TryGetNextLocForCons(absLoc);
+			if (loc >= m_mailbox->BufSize()) break;
+			Receive((*m_mailbox)[loc], m_mailbox->BufElemSize());
+			m_mailbox->SetLocReadyForProd(absLoc);
+		}
+		return numRows;
+	}
+};
+
+//! Runs actors with a non-empty mailbox on a fixed pool of threads.
+
+//! Runnable actors wait in a run queue which is itself an MBuffer of
+// TMaxActors x 1 actor pointers. Since an actor is queued at most once,
+// TMaxActors must be at least the number of actors using this scheduler.
+template<size_t TMaxActors>
+class ActorScheduler : public ActorSchedulerBase {
+	typedef MBuffer<TMaxActors, 1, ActorBase*> RunQueueType;
+	//! actors ready to run
+	std::unique_ptr<RunQueueType>	m_runQueue;
+	//! max mailbox rows processed per activation
+	size_t	m_rowsPerActivation;
+	//! if 'true', scheduler threads are expected to stop.
+	std::atomic<bool>	m_stop;
+	//! scheduler threads
+	std::vector<std::thread>	m_threads;
+public:
+	//! ctor: starts numThreads_ scheduler threads.
+	/*!
+	    \param numThreads_          number of scheduler threads
+		\param rowsPerActivation_   max mailbox rows processed per activation
+		                            before the actor goes to the back of the queue
+	*/
+	ActorScheduler(size_t numThreads_, size_t rowsPerActivation_ = 1) :
+		m_runQueue(std::make_unique<RunQueueType>()),
+		m_rowsPerActivation(rowsPerActivation_)
+	{
+		m_stop.store(false);
+		for (auto i = 0u; i < numThreads_; ++i)
+			m_threads.push_back(std::thread(ThreadFuncForScheduler, this));
+	}
+	~ActorScheduler()
+	{
+		Stop();
+	}
+	void Schedule(ActorBase* actor_) override
+	{
+		size_t absLoc;
+		auto loc = m_runQueue->GetNextLocForProd(absLoc);
+		if (loc >= m_runQueue->BufSize()) return; // stopped
+		(*m_runQueue)[loc][0] = actor_;
+		m_runQueue->SetLocReadyForCons(absLoc);
+	}
+	//! stop and join scheduler threads. Pending mailbox rows are not processed.
+	void Stop()
+	{
+		if (m_stop.exchange(true)) return;
+		m_runQueue->Stop();
+		for (auto& t : m_threads)
+			t.join();
+	}
+	// scheduler thread: take next runnable actor and activate it
+	void Run()
+	{
+		while (!m_stop)
+		{
+			size_t absLoc;
+			auto loc = m_runQueue->GetNextLocForCons(absLoc);
+			if (m_stop || loc >= m_runQueue->BufSize()) break;
+			auto* actor = (*m_runQueue)[loc][0];
+			m_runQueue->SetLocReadyForProd(absLoc);
+			// no more rows than counted in m_pending: a row published but not
+			// yet notified would take m_pending below 0, and its Notify back to
+			// 0, so that the next Notify would queue the actor a second time.
+			const auto pending = (size_t) actor->m_pending.load();
+			const long numRows = (long) actor->Activate(
+				pending < m_rowsPerActivation ? pending : m_rowsPerActivation);
+			// rows published meanwhile (or not yet visible) keep the actor runnable
+			if (actor->m_pending.fetch_sub(numRows) != numRows)
+			{
+				if (numRows == 0) std::this_thread::yield();
+				Schedule(actor);
+			}
+		}
+	}
+
+	// thread function: transfers control back to ActorScheduler by calling Run method
+	static void ThreadFuncForScheduler(ActorScheduler* s)
+	{
+		s->Run();
+	}
+};
+
+}
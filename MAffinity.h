@@ -0,0 +1,73 @@
+/*! \file MAffinity.h
+    \brief  Cache affinity aware consumer claims for MBuffer.
+
+	A row written on one core is in that core's caches; a consumer on a core
+	sharing them (same L2 or L3) reads it from there, one on another socket
+	pulls every line across. With affinity claims, producers tag each row
+	with their cache domain, and consumers prefer published rows of their
+	own domain, looking a few rows beyond the consumer cursor for one.
+	FIFO order is then kept only within that window: a row may be consumed
+	up to window - 1 positions early.
+*/
+#pragma once
+
+#include "MTopology.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace Messenger {
+
+//! Per row cache domain tags of a buffer, and claims preferring own domain rows.
+
+//! Producers call Tag before SetLocReadyForCons. Consumers call
+// GetNextLocForCons here instead of the buffer's, and release rows with the
+// buffer's SetLocConsumed. A tag is a hint: a stale or missing one only
+// makes a row look far, so untagged rows are still consumed in turn.
+template<typename TBuffer>
+class RowAffinity {
+	TBuffer&	m_buffer;
+	//! cache level domains are taken at, 2 or 3
+	size_t		m_cacheLevel;
+	//! cache domain of the producer of each row
+	std::unique_ptr<std::atomic<uint32_t>[]>	m_tags;
+public:
+	//! ctor: tag rows of buffer_ by the domains of cache level cacheLevel_
+	RowAffinity(TBuffer& buffer_, size_t cacheLevel_ = 3) :
+		m_buffer(buffer_),
+		m_cacheLevel(cacheLevel_),
+		m_tags(new std::atomic<uint32_t>[TBuffer::m_rawBufSize])
+	{
+		for (size_t i = 0; i < TBuffer::m_rawBufSize; ++i)
+			m_tags[i].store(uint32_t(-1), std::memory_order_relaxed);
+	}
+	RowAffinity(const RowAffinity&) = delete;
+	RowAffinity& operator=(const RowAffinity&) = delete;
+
+	//! cache domain of the CPU the calling thread runs on
+	size_t Domain() const
+	{
+		return Topology::Get().CacheDomainOf(Topology::CurrentCpu(), m_cacheLevel);
+	}
+	//! tag row absLoc_ as written in domain_; call before publishing it
+	void Tag(size_t absLoc_, size_t domain_)
+	{
+		m_tags[absLoc_ % m_buffer.BufSize()].store((uint32_t) domain_, std::memory_order_relaxed);
+	}
+	//! 'true' if row absLoc_ was tagged with domain_
+	bool Near(size_t absLoc_, size_t domain_) const
+	{
+		return m_tags[absLoc_ % m_buffer.BufSize()].load(std::memory_order_relaxed) == (uint32_t) domain_;
+	}
+
+	//! get next loc to consume, preferring rows of domain_ among window_ rows.
+	/*! See MBuffer::GetNextLocForConsNear. Release the row with MBuffer::SetLocConsumed. */
+	size_t GetNextLocForCons(size_t& absLoc_, size_t domain_, size_t window_ = 8)
+	{
+		return m_buffer.GetNextLocForConsNear(absLoc_, window_,
+			[this, domain_](size_t absLoc) { return Near(absLoc, domain_); });
+	}
+};
+
+}
@@ -0,0 +1,460 @@
+/*! \file MBridge.h
+    \brief  Unix domain socket bridge between MBuffers in different processes.
+
+	A BridgeSender consumes rows of a local MBuffer and forwards them over
+	an AF_UNIX SOCK_SEQPACKET socket to a BridgeReceiver, which produces
+	them into an MBuffer in another process. Linux only (sendmmsg/recvmmsg).
+*/
+#pragma once
+
+#include "MBuffer.h"
+#include "MCodec.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace Messenger {
+
+//! bytes per row encoded with TCodec; 0 for void, i.e. rows sent as they are
+template<typename TCodec, typename TBuffer>
+size_t MaxEncodedRow(const TBuffer& buffer_)
+{
+	if constexpr (std::is_void<TCodec>::value) return 0;
+	else return TCodec::MaxEncodedSize(buffer_.BufElemSize());
+}
+
+//! listen on AF_UNIX SOCK_SEQPACKET socket path_ and accept one bridge connection.
+/*! \return connected socket */
+inline int AcceptBridge(const std::string& path_)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path_.size() >= sizeof(addr.sun_path))
+	{
+		throw std::runtime_error("socket path too long: " + path_);
+	}
+	strcpy(addr.sun_path, path_.c_str());
+	const auto fd = ::socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	::unlink(path_.c_str());
+	if (fd < 0 || ::bind(fd, (sockaddr*) &addr, sizeof(addr)) != 0 || ::listen(fd, 1) != 0)
+	{
+		if (fd >= 0) ::close(fd);
+		throw std::runtime_error("cannot listen on " + path_);
+	}
+	const auto conn = ::accept(fd, nullptr, nullptr);
+	::close(fd);
+	::unlink(path_.c_str());
+	if (conn < 0)
+	{
+		throw std::runtime_error("cannot accept on " + path_);
+	}
+	return conn;
+}
+
+//! connect to a bridge listening on AF_UNIX SOCK_SEQPACKET socket path_.
+/*! \return connected socket */
+inline int ConnectBridge(const std::string& path_)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path_.size() >= sizeof(addr.sun_path))
+	{
+		throw std::runtime_error("socket path too long: " + path_);
+	}
+	strcpy(addr.sun_path, path_.c_str());
+	const auto fd = ::socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0 || ::connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0)
+	{
+		if (fd >= 0) ::close(fd);
+		throw std::runtime_error("cannot connect to " + path_);
+	}
+	return fd;
+}
+
+//! Protocol shared by BridgeSender and BridgeReceiver.
+
+//! Sender to receiver: a batch header message holding the number of rows
+// k, followed by k messages of one row each. A header of 0 bytes (socket
+// shut down) ends the stream.
+// Receiver to sender: credit messages, each the number of further rows
+// the sender may send. A row is one message, so it must fit the socket
+// buffers (SO_SNDBUF/SO_RCVBUF). The receiver grants credit only for rows that are
+// free in its buffer, so it never waits for a row and the sender never
+// has more rows in flight than the remote buffer can take.
+// With a codec (see MCodec.h) a row message holds the encoded row instead
+// of the row bytes; both sides must use the same codec.
+struct BridgeProtocol {
+	typedef uint64_t CountType;
+	//! max rows per batch, i.e. per sendmmsg/recvmmsg call
+	static const size_t m_maxBatch = 64;
+};
+
+//! Consumes rows of a local buffer and sends them to a BridgeReceiver.
+
+//! Up to batch_ ready rows are sent with a single sendmmsg call, straight
+// from row memory, and released once the call returns.
+// Linux does not implement MSG_ZEROCOPY for AF_UNIX sockets, so the
+// kernel copies each row once into the socket.
+// If TCodec is not void, e.g. RowCodec<Msg, Field<...>...>, each row is
+// encoded into a staging area instead and the encoded bytes are sent.
+template<typename TBuffer, typename TCodec = void>
+class BridgeSender {
+	typedef typename TBuffer::ValueType ValueType;
+	static_assert(!std::is_void<TCodec>::value || std::is_trivially_copyable<ValueType>::value,
+		"rows without codec are sent as bytes");
+	TBuffer&	m_buffer;
+	int			m_fd;
+	//! max rows per batch
+	size_t		m_batch;
+	//! bytes per encoded row in m_staging; 0 without codec
+	size_t		m_maxEncoded;
+	//! encoded rows of a batch
+	std::vector<char>	m_staging;
+	//! rows the receiver can still take
+	uint64_t	m_credits;
+	//! rows sent
+	std::atomic<size_t>	m_numRows;
+	//! first error (negative errno) or 0
+	int			m_error;
+	//! if 'true', Run stops consuming.
+	std::atomic<bool>	m_stop;
+	//! period at which a wait for credit checks m_stop
+	static const int m_pollMsec = 10;
+public:
+	//! ctor
+	/*!
+	    \param buffer_   local buffer to consume from
+		\param fd_       connected AF_UNIX SOCK_SEQPACKET socket; owned by the sender
+		\param batch_    max rows per sendmmsg call
+	*/
+	BridgeSender(TBuffer& buffer_, int fd_, size_t batch_ = BridgeProtocol::m_maxBatch) :
+		m_buffer(buffer_),
+		m_fd(fd_),
+		m_batch(batch_ && batch_ <= BridgeProtocol::m_maxBatch ? batch_ : BridgeProtocol::m_maxBatch),
+		m_maxEncoded(MaxEncodedRow<TCodec>(buffer_)),
+		m_credits(0),
+		m_error(0)
+	{
+		m_numRows.store(0);
+		m_stop.store(false);
+		m_staging.resize(m_maxEncoded*m_batch);
+	}
+	~BridgeSender()
+	{
+		::close(m_fd);
+	}
+	BridgeSender(const BridgeSender&) = delete;
+	BridgeSender& operator=(const BridgeSender&) = delete;
+
+	//! forward rows until stopped, then end the stream
+	/*!
+	    Returns once the receiver has ended its side of the stream too.
+	    \return number of rows sent
+	*/
+	size_t Run()
+	{
+		const auto rowBytes = m_buffer.BufElemSize()*sizeof(ValueType);
+		size_t absLocs[BridgeProtocol::m_maxBatch];
+		iovec iovs[BridgeProtocol::m_maxBatch + 1];
+		mmsghdr msgs[BridgeProtocol::m_maxBatch + 1];
+		BridgeProtocol::CountType header;
+		while (!m_stop && !m_error)
+		{
+			// wait for credit only when there is none
+			if (!ReadCredits(m_credits == 0)) break;
+			// first row: wait for it; further rows: only those ready now
+			size_t n = 0;
+			const auto maxRows = m_credits < m_batch ? (size_t) m_credits : m_batch;
+			while (n < maxRows)
+			{
+				size_t absLoc;
+				auto loc = n ? m_buffer.TryGetNextLocForCons(absLoc)
+					: m_buffer.GetNextLocForCons(absLoc);
+				if (loc >= m_buffer.BufSize()) break;
+				absLocs[n] = absLoc;
+				if constexpr (std::is_void<TCodec>::value)
+				{
+					iovs[n + 1].iov_base = m_buffer[loc];
+					iovs[n + 1].iov_len = rowBytes;
+				}
+				else
+				{
+					auto* out = m_staging.data() + n*m_maxEncoded;
+					iovs[n + 1].iov_base = out;
+					iovs[n + 1].iov_len = TCodec::Encode(m_buffer[loc], m_buffer.BufElemSize(), out);
+				}
+				++n;
+			}
+			if (!n) break; // buffer stopped
+			header = n;
+			iovs[0].iov_base = &header;
+			iovs[0].iov_len = sizeof(header);
+			memset(msgs, 0, sizeof(mmsghdr)*(n + 1));
+			for (auto i = 0u; i <= n; ++i)
+			{
+				msgs[i].msg_hdr.msg_iov = &iovs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			for (size_t sent = 0; sent <= n; )
+			{
+				const auto res = ::sendmmsg(m_fd, msgs + sent, (unsigned) (n + 1 - sent), MSG_NOSIGNAL);
+				if (res < 0 && errno == EINTR) continue;
+				if (res <= 0)
+				{
+					m_error = res < 0 ? -errno : -EIO;
+					break;
+				}
+				sent += (size_t) res;
+			}
+			for (auto i = 0u; i < n; ++i)
+				m_buffer.SetLocReadyForProd(absLocs[i]);
+			if (m_error) break;
+			m_credits -= n;
+			m_numRows += n;
+		}
+		::shutdown(m_fd, SHUT_WR);
+		// read credit until the receiver ends the stream: closing the socket
+		// with credit messages unread would reset the connection, and the
+		// receiver would lose the rows it has yet to read
+		BridgeProtocol::CountType credit;
+		while (true)
+		{
+			const auto n = ::recv(m_fd, &credit, sizeof(credit), 0);
+			if (n > 0 || (n < 0 && errno == EINTR)) continue;
+			break;
+		}
+		return m_numRows;
+	}
+	//! stop Run: called from some other thread. Run also stops waiting for credit.
+	void Stop()
+	{
+		m_stop = true;
+		m_buffer.Stop();
+	}
+	//! rows sent so far
+	size_t NumRows() const { return m_numRows.load(); }
+	//! first error as negative errno, or 0
+	int Error() const { return m_error; }
+private:
+	//! add credit messages received to m_credits.
+	/*! \return false if the receiver has gone, or if stopped while waiting for credit */
+	bool ReadCredits(bool wait_)
+	{
+		while (true)
+		{
+			// wait in poll rather than recv, so that Stop is seen
+			if (wait_ && !WaitReadable()) return false;
+			BridgeProtocol::CountType credit;
+			const auto n = ::recv(m_fd, &credit, sizeof(credit), MSG_DONTWAIT);
+			if (n == (ssize_t) sizeof(credit))
+			{
+				m_credits += credit;
+				wait_ = false;
+				continue;
+			}
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+			if (n < 0) m_error = -errno;
+			return false;
+		}
+	}
+	//! wait until a message can be read; false if stopped meanwhile
+	bool WaitReadable()
+	{
+		pollfd p;
+		p.fd = m_fd;
+		p.events = POLLIN;
+		while (!m_stop)
+		{
+			p.revents = 0;
+			const auto n = ::poll(&p, 1, m_pollMsec);
+			if (n > 0) return true;
+			if (n < 0 && errno != EINTR)
+			{
+				m_error = -errno;
+				return false;
+			}
+		}
+		return false;
+	}
+};
+
+//! Receives rows from a BridgeSender and produces them into a local buffer.
+
+//! For each batch it claims exactly the announced number of rows and
+// receives them with one recvmmsg call straight into row memory.
+// Credit follows occupancy of the local buffer: rows that are free and
+// not yet promised to the sender are granted once there are at least
+// grantRows_ of them, or as soon as the sender has no credit left.
+// With a codec, rows are received into a staging area and decoded into
+// the claimed rows.
+template<typename TBuffer, typename TCodec = void>
+class BridgeReceiver {
+	typedef typename TBuffer::ValueType ValueType;
+	static_assert(!std::is_void<TCodec>::value || std::is_trivially_copyable<ValueType>::value,
+		"rows without codec are received as bytes");
+	TBuffer&	m_buffer;
+	int			m_fd;
+	//! bytes per encoded row in m_staging; 0 without codec
+	size_t		m_maxEncoded;
+	//! encoded rows of a batch
+	std::vector<char>	m_staging;
+	//! min rows per credit message while the sender still has credit
+	size_t		m_grantRows;
+	//! rows granted to, but not yet received from the sender
+	uint64_t	m_outstanding;
+	//! rows received
+	std::atomic<size_t>	m_numRows;
+	//! first error (negative errno) or 0
+	int			m_error;
+public:
+	//! ctor
+	/*!
+	    \param buffer_      local buffer to produce into
+		\param fd_          connected AF_UNIX SOCK_SEQPACKET socket; owned by the receiver
+		\param grantRows_   min rows per credit message; 0 for a quarter of the buffer
+	*/
+	BridgeReceiver(TBuffer& buffer_, int fd_, size_t grantRows_ = 0) :
+		m_buffer(buffer_),
+		m_fd(fd_),
+		m_maxEncoded(MaxEncodedRow<TCodec>(buffer_)),
+		m_grantRows(grantRows_ ? grantRows_ : (buffer_.BufSize() + 3)/4),
+		m_outstanding(0),
+		m_error(0)
+	{
+		m_numRows.store(0);
+		m_staging.resize(m_maxEncoded*BridgeProtocol::m_maxBatch);
+	}
+	~BridgeReceiver()
+	{
+		::close(m_fd);
+	}
+	BridgeReceiver(const BridgeReceiver&) = delete;
+	BridgeReceiver& operator=(const BridgeReceiver&) = delete;
+
+	//! receive rows until the sender ends the stream or the buffer is stopped
+	/*! \return number of rows received */
+	size_t Run()
+	{
+		const auto rowBytes = m_buffer.BufElemSize()*sizeof(ValueType);
+		size_t absLocs[BridgeProtocol::m_maxBatch];
+		iovec iovs[BridgeProtocol::m_maxBatch];
+		mmsghdr msgs[BridgeProtocol::m_maxBatch];
+		while (!m_error && !m_buffer.Stopped())
+		{
+			// a sender without credit sends nothing but the end of the
+			// stream: wait for free rows, or for the end
+			while (!m_outstanding && !m_error && !m_buffer.Stopped() && !Grant() && !Ended())
+				std::this_thread::sleep_for(std::chrono::microseconds(10));
+			BridgeProtocol::CountType header;
+			const auto h = ::recv(m_fd, &header, sizeof(header), 0);
+			if (h < 0 && errno == EINTR) continue;
+			if (h == 0) break; // end of stream
+			if (h != (ssize_t) sizeof(header) || header > BridgeProtocol::m_maxBatch || header > m_outstanding)
+			{
+				m_error = h < 0 ? -errno : -EPROTO;
+				break;
+			}
+			const auto n = (size_t) header;
+			size_t claimed = 0;
+			for (; claimed < n; ++claimed)
+			{
+				size_t absLoc;
+				auto loc = m_buffer.GetNextLocForProd(absLoc);
+				if (loc >= m_buffer.BufSize()) break; // stopped
+				absLocs[claimed] = absLoc;
+				if constexpr (std::is_void<TCodec>::value)
+				{
+					iovs[claimed].iov_base = m_buffer[loc];
+					iovs[claimed].iov_len = rowBytes;
+				}
+				else
+				{
+					iovs[claimed].iov_base = m_staging.data() + claimed*m_maxEncoded;
+					iovs[claimed].iov_len = m_maxEncoded;
+				}
+			}
+			if (claimed < n) break;
+			memset(msgs, 0, sizeof(mmsghdr)*n);
+			for (auto i = 0u; i < n; ++i)
+			{
+				msgs[i].msg_hdr.msg_iov = &iovs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			for (size_t received = 0; received < n; )
+			{
+				const auto res = ::recvmmsg(m_fd, msgs + received, (unsigned) (n - received), 0, nullptr);
+				if (res < 0 && errno == EINTR) continue;
+				if (res <= 0)
+				{
+					m_error = res < 0 ? -errno : -EPROTO;
+					break;
+				}
+				for (auto i = received; i < received + (size_t) res; ++i)
+					if (!CheckRow(absLocs[i], (const char*) iovs[i].iov_base, msgs[i].msg_len, rowBytes))
+						m_error = -EPROTO;
+				received += (size_t) res;
+			}
+			// rows claimed are published even on error, so that the buffer keeps going
+			for (auto i = 0u; i < n; ++i)
+				m_buffer.SetLocReadyForCons(absLocs[i]);
+			m_outstanding -= n;
+			m_numRows += n;
+			if (!m_error && m_outstanding < m_grantRows) Grant();
+		}
+		::shutdown(m_fd, SHUT_WR);
+		return m_numRows;
+	}
+	//! rows received so far
+	size_t NumRows() const { return m_numRows.load(); }
+	//! first error as negative errno, or 0
+	int Error() const { return m_error; }
+private:
+	//! check the received row; decode it with a codec
+	bool CheckRow(size_t absLoc_, const char* data_, size_t size_, size_t rowBytes_)
+	{
+		if constexpr (std::is_void<TCodec>::value)
+		{
+			return size_ == rowBytes_;
+		}
+		else
+		{
+			const auto n = m_buffer.BufElemSize();
+			return TCodec::Decode(data_, size_, m_buffer[absLoc_ % m_buffer.BufSize()], n) == size_;
+		}
+	}
+	//! true if the sender has ended the stream, without reading anything
+	bool Ended()
+	{
+		char c;
+		return ::recv(m_fd, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT) == 0;
+	}
+	//! grant credit for free rows not yet promised; return true if any was granted
+	bool Grant()
+	{
+		const auto occupancy = m_buffer.Occupancy();
+		const auto free = (uint64_t) (occupancy < m_buffer.BufSize() ? m_buffer.BufSize() - occupancy : 0);
+		if (free <= m_outstanding) return false;
+		const BridgeProtocol::CountType credit = free - m_outstanding;
+		if (m_outstanding && credit < m_grantRows) return false;
+		const auto n = ::send(m_fd, &credit, sizeof(credit), MSG_NOSIGNAL);
+		if (n != (ssize_t) sizeof(credit))
+		{
+			m_error = n < 0 ? -errno : -EIO;
+			return false;
+		}
+		m_outstanding += credit;
+		return true;
+	}
+};
+
+}
@@ -3,10 +3,32 @@
 
 	Synchronised between multiple producer and consumer threads.
 */
+#pragma once
 
-
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#if __has_include(<span>)
+#include <span>
+#endif
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "MSlots.h"
+#include "MThreading.h"
+#include "MTokenBucket.h"
 
 namespace Messenger {
 
@@ -23,47 +45,60 @@ namespace Messenger {
 // the row in one go. A consumer in turn acquires an entire row synchronously and
 // reads all the values in one go. This reduces synchronization costs, significantly 
 // increasing throughput.
-template<size_t TRows, size_t TColumns, typename T>
+// TSlots is the layout of the per row status and absolute location,
+// see MSlots.h; the default keeps them in two arrays.
+// TThreading is MultiThreaded or SingleThreaded, see MThreading.h.
+template<size_t TRows, size_t TColumns, typename T, template<size_t> class TSlots = SplitSlots,
+	typename TThreading = MultiThreaded>
 class MBuffer {
 public:
 	//! raw buffer size
 	static const size_t m_rawBufSize = TRows*TColumns;
 	typedef T ValueType;
+	//! a thread's cached copy of the opposing cursor, for the claims that take one.
+	/*! One per thread and buffer; make new ones after Reset or Restore. */
+	struct CursorCache {
+		long	m_cursor = 0;
+	};
+	//! a thread's choice of segment for the relaxed claims (see SetRelaxedSegments).
+	/*! Round-robin from m_next if m_random is 0, else random with m_random as the
+	    xorshift state. Give each thread its own m_next or m_random. */
+	struct SegmentChoice {
+		size_t		m_next = 0;
+		uint64_t	m_random = 0;
+	};
 private:
+	//! raw buffer
+
+	//! First member, so that rows start at the address of the object:
+	// an MBuffer allocated on a page boundary has page aligned rows
+	// whenever the row size is a multiple of the page size (see FileSink).
+	T         m_buf[m_rawBufSize];
 	//! number of rows; invariant m_rows x m_columns = m_rawBufSize	
 	//! Number of rows also constitues ring buffer size. The synchronization
 	// is done for an entire row.
 	size_t    m_rows;
 	//! number of columns; invariant m_rows x m_columns = m_rawBufSize
 	size_t    m_columns;
+	//! rows per window of the relaxed claims; 0 until SetRelaxedSegments
+	size_t    m_segments;
 	//! if 'true', producers and consumers are expected to stop.
 	bool	  m_stop;
-	//! raw buffer
-	T         m_buf[m_rawBufSize];
 	//! Highest absolute consumer loc where a thread is attempting to read from.
 	// All the previous locations have been read.
-	std::atomic<long>	m_consLoc;
+	typename TThreading::template Atomic<long>	m_consLoc;
 	//! highest absolute producer loc where a thread is attempting to write into.
 	// All the previous locations have been written.
-	std::atomic<long>   m_prodLoc;
+	typename TThreading::template Atomic<long>	m_prodLoc;
 
-	/*! \enum location status
+	//! location status, see SlotStatus
+	typedef SlotStatus	Status;
 
-	    READY_FOR_WRITE: available to write
-	    WRITING:			being written
-	    READY_FOR_READ:	available to read
-	    READING:			being read
-	*/
-	enum class	Status: long {READY_FOR_WRITE = 0, WRITING=1, READY_FOR_READ=2, 
-		                      READING=3};
-	//! buffer to store per location status.
+	//! per location status and ring buffer location to abs location map.
 
-	//! strictly speaking the array need be no greater than m_rows,
+	//! strictly speaking the slots need be no more than m_rows,
 	// but unless we do dynamic allocation when m_rows, m_columns change
 	// we stick to static m_rows x m_columns size.
-	std::atomic<Status>	m_locStatus[m_rawBufSize];
-
-	//! Ring buffer location to abs location map.
 
 	// This is a ring buffer.
 	// A 'location' corresponds to an entire row of m_columns.
@@ -91,19 +126,65 @@ private:
 	// the buf loc it is seeking to consume refers to the same absolute
 	// location producer wrote, and did not change absolute location
 	// by the time they return the location to the caller. This map is used for that.
-	// Strictly speaking the array need be no greater than m_rows,
-	// but unless we do dynamic allocation, we stick to static m_rows x m_columns size.
-	std::atomic<int64_t> m_locToAbsLocMap[m_rawBufSize];
+	typename TThreading::template Slots<TSlots, m_rawBufSize>	m_slots;
+	//! 'false' for SingleThreaded: a claim that would wait for another thread fails instead
+	static const bool m_concurrent = TThreading::m_concurrent;
+
+	//! optional rate limiter shared by all producers; nullptr if none.
+	TokenBucket*	m_rateLimiter;
+
+	//! occupancy hooks; see SetWatermarks.
+	// Checked once per row claim, and only when m_watermarks is set.
+	bool	m_watermarks;
+	//! occupancy in rows at or above which m_onHigh is called
+	long	m_highWatermark;
+	//! occupancy in rows at or below which m_onLow is called
+	long	m_lowWatermark;
+	std::function<void(size_t)>	m_onHigh;
+	std::function<void(size_t)>	m_onLow;
+	//! 'true' after crossing high watermark, until crossing low watermark again.
+	// Makes each hook fire once per crossing.
+	typename TThreading::template Atomic<bool>	m_aboveHighWatermark;
+	//! 'true' once a row was claimed ahead of m_consLoc (see GetNextLocForConsNear);
+	// consumer claims then also pass CONSUMED rows at the cursor.
+	typename TThreading::template Atomic<bool>	m_outOfOrder;
+
+	//! file header written by Snapshot, followed by rows m_consLoc to m_prodLoc - 1
+	struct SnapshotHeader {
+		uint64_t	m_magic;
+		uint64_t	m_rawBufSize;
+		uint64_t	m_valueSize;
+		uint64_t	m_rows;
+		uint64_t	m_columns;
+		int64_t		m_consLoc;
+		int64_t		m_prodLoc;
+		//! rows per relaxed claim window; 0 for strict claims
+		uint64_t	m_segments;
+	};
+	//! per row flags of a relaxed snapshot, for [m_consLoc, m_prodLoc + m_segments)
+	enum SnapshotRow : uint8_t { SNAP_FREE, SNAP_UNCONSUMED, SNAP_CONSUMED };
+	static const uint64_t m_snapshotMagic = 0x31504e534655424dull; // "MBUFSNP1"
+	//! lookahead of Prefetch in bytes: enough to cover the latency of a
+	// remote cache miss, well within the L1 cache
+	static const size_t m_lookaheadBytes = 8*1024;
+	static const size_t m_maxLookaheadRows = 16;
 
 public:
 	//! ctor
 	MBuffer() : 
 		m_rows(TRows),
 		m_columns(TColumns),
-		m_stop(false)
+		m_segments(0),
+		m_stop(false),
+		m_rateLimiter(nullptr),
+		m_watermarks(false),
+		m_highWatermark(0),
+		m_lowWatermark(0)
 	{
 		m_consLoc.store(0);
 		m_prodLoc.store(0);
+		m_aboveHighWatermark.store(false);
+		m_outOfOrder.store(false);
 		ReleaseAllLocks();
 	}
 	//! set rows and columns.
@@ -126,6 +207,137 @@ public:
 		m_rows = rows_;
 		m_columns = columns_;
 	}
+	//! opt in to the k-relaxed FIFO claims, with k = segments_.
+	/*!
+	   For the relaxed claims, GetNextLocForProdRelaxed and
+	   GetNextLocForConsRelaxed, the ring is seen as segments_ interleaved
+	   segments: row absLoc is in segment absLoc % segments_. The cursors
+	   then move by windows of segments_ rows, one row of each segment,
+	   and a claim takes a row of the window at the cursor in the segment
+	   chosen by the thread, or the next one with a row free (or ready).
+	   A cursor is updated once per window rather than once per row, and
+	   claims of a window are spread over segments_ rows rather than all
+	   contending for one, so claims scale with threads; in exchange a row
+	   is consumed before at most segments_ - 1 rows claimed by producers
+	   before it.
+
+	   A buffer is claimed either strictly or relaxed, never both. Like
+	   SetRowsColumns, call it before use; it must divide the number of rows.
+	   Occupancy and Snapshot look at the slots of the open windows at the
+	   cursors, as rows there may be published or consumed in any order.
+	   \param  [in ]   segments_  rows per window, 1 to BufSize()
+	*/
+	void SetRelaxedSegments(size_t segments_)
+	{
+		if (segments_ == 0 || m_rows % segments_)
+		{
+			throw std::runtime_error("segments do not divide rows");
+		}
+		m_segments = segments_;
+	}
+
+	//! get next free loc in m_buf to produce, in k-relaxed FIFO order.
+	/*!
+	   Same as GetNextLocForProd, for a buffer set up with SetRelaxedSegments.
+	   Rows are free when consumed, as for strict claims. Rate limiters are
+	   not applied.
+
+	   \param  [out]   absLoc_  absolute location for the producer
+	   \param  [in,out] choice_ the calling thread's segment choice
+	   \return         ring buffer location = absLoc_ % m_rows.
+	                   size_t(-1) when the buffer is stopped.
+	*/
+	size_t GetNextLocForProdRelaxed(size_t& absLoc_, SegmentChoice& choice_)
+	{
+		if (!m_segments)
+		{
+			throw std::runtime_error("relaxed claim without segments");
+		}
+		while (!m_stop)
+		{
+			const auto window = m_prodLoc.load();
+			const auto first = ChooseSegment(choice_);
+			for (size_t i = 0; i < m_segments; ++i)
+			{
+				// a row is claimed once: a thread behind the window fails to
+				// claim a row already claimed for its absolute location
+				const auto absLoc = window + (long) ((first + i) % m_segments);
+				const auto loc = absLoc % m_rows;
+				if (!m_slots.ClaimForWriteOnce(loc, absLoc))
+					continue;
+				m_slots.Bind(loc, absLoc);
+				// rows freed by Stop may have been claimed while others still use them
+				if (m_stop)
+				{
+					m_slots.SetStatus(loc, Status::READY_FOR_WRITE);
+					break;
+				}
+				absLoc_ = absLoc;
+				return loc;
+			}
+			// all rows of the window are claimed: move to the next one
+			if (WindowPassed(window, Status::WRITING))
+			{
+				auto expected = window;
+				if (m_prodLoc.compare_exchange_strong(expected, window + (long) m_segments) && m_watermarks)
+					CheckHighWatermark(window + (long) m_segments);
+				continue;
+			}
+			// full, or claims of the window still in progress
+			if (!m_concurrent) break;
+			std::this_thread::sleep_for(std::chrono::microseconds(1));
+		}
+		return (size_t)(-1);
+	}
+
+	//! get next loc in m_buf to consume, in k-relaxed FIFO order.
+	/*!
+	   Same as GetNextLocForCons, for a buffer set up with SetRelaxedSegments.
+	   Rows are released with SetLocReadyForProd, as for strict claims.
+
+	   \param  [out]   absLoc_  absolute location for the consumer
+	   \param  [in,out] choice_ the calling thread's segment choice
+	   \return         ring buffer location = absLoc_ % m_rows.
+	                   size_t(-1) when the buffer is stopped.
+	*/
+	size_t GetNextLocForConsRelaxed(size_t& absLoc_, SegmentChoice& choice_)
+	{
+		if (!m_segments)
+		{
+			throw std::runtime_error("relaxed claim without segments");
+		}
+		while (!m_stop)
+		{
+			const auto window = m_consLoc.load();
+			const auto first = ChooseSegment(choice_);
+			for (size_t i = 0; i < m_segments; ++i)
+			{
+				const auto absLoc = window + (long) ((first + i) % m_segments);
+				const auto loc = absLoc % m_rows;
+				if (!m_slots.ClaimForRead(loc, absLoc))
+					continue;
+				if (m_stop)
+				{
+					m_slots.SetStatus(loc, Status::READY_FOR_READ);
+					break;
+				}
+				absLoc_ = absLoc;
+				return loc;
+			}
+			if (WindowPassed(window, Status::READING))
+			{
+				auto expected = window;
+				if (m_consLoc.compare_exchange_strong(expected, window + (long) m_segments) && m_watermarks)
+					CheckLowWatermark(window + (long) m_segments);
+				continue;
+			}
+			// empty, or rows of the window still being written
+			if (!m_concurrent) break;
+			std::this_thread::sleep_for(std::chrono::microseconds(1));
+		}
+		return (size_t)(-1);
+	}
+
 	//! get next free loc in m_buf to produce.
 	/*!
 	   This is m_prodLoc: one past the last produced location.
@@ -140,45 +352,140 @@ public:
 	   absLoc_ is the absolute location, without modulus, as if the buffer were 
 	   infinite.
 	  
+	   If a rate limiter is set (SetRateLimiter) or given (bucket_), m_columns
+	   tokens are taken from each before a loc is claimed, so a throttled
+	   producer never holds a loc in WRITING status while it waits; they are
+	   given back when no loc is claimed.
+	  
 	   \param  [out]   absLoc_  next absolute location for the prodcuer 
+	   \param  [in ]   bucket_  optional per-producer rate limiter
 	   \return         ring buffer location = absLoc_ % m_rows.
-	                   size_t(-1), illegal value, returned when buffer is stopped.
+	                   size_t(-1), illegal value, returned when buffer is stopped,
+	                   when a rate limiter with WaitPolicy::FAIL_FAST is out of tokens,
+	                   or, for a SingleThreaded buffer, when the buffer is full.
 	*/
-	size_t GetNextLocForProd(size_t& absLoc_)
+	size_t GetNextLocForProd(size_t& absLoc_, TokenBucket* bucket_ = nullptr)
 	{
+		return NextLocForProd(absLoc_, nullptr, bucket_);
+	}
 
-		// wait as long as m_prodLoc status is not READY_FOR_WRITE;
-		// and then set status to WRITING.
-		// When status is WRITING, no other producer can write, 
-		// and no consumer can read.
-		auto absLoc = m_prodLoc.load();
-		auto loc = absLoc % m_rows;
-		std::atomic<Status>* status{ &m_locStatus[loc] };
-		auto statusReadyForWrite = Status::READY_FOR_WRITE;
-		auto statusWriting = Status::WRITING;
-		while ( (!status->compare_exchange_strong (statusReadyForWrite, statusWriting))
-			&& (!m_stop) )
+	//! try to get next free loc in m_buf to produce, without waiting.
+	/*!
+	   Same as GetNextLocForProd, except that it returns at once when the
+	   ring is full at m_prodLoc, or a rate limiter set with SetRateLimiter
+	   is out of tokens, rather than waiting for a consumer. Useful for a
+	   producer that must not block, e.g. one that drops what does not fit
+	   or checks its own stop flag between attempts.
+
+	   \param  [out]   absLoc_  next absolute location for the producer
+	   \return         ring buffer location = absLoc_ % m_rows.
+	                   size_t(-1) when no row is free or buffer is stopped.
+	*/
+	size_t TryGetNextLocForProd(size_t& absLoc_)
+	{
+		absLoc_ = (size_t)(-1);
+		uint64_t waitTicks;
+		if (m_stop || (m_rateLimiter && !m_rateLimiter->TryAcquire(m_columns, waitTicks)))
+			return (size_t)(-1);
+		size_t absLoc;
+		const auto loc = ClaimForProd(absLoc, nullptr, false);
+		absLoc_ = absLoc;
+		if (loc >= m_rows)
 		{
-			std::this_thread::sleep_for(std::chrono::microseconds(1)); 
-			// restore statusReadyForWrite as this can be overwritten
-			// by compare_exchange_strong
-			statusReadyForWrite = Status::READY_FOR_WRITE;
-			// update status in case m_prodLoc is changed by another 
-			// thread meanwhile
-			absLoc = m_prodLoc.load();
-			loc = absLoc % m_rows;
-			status = &m_locStatus[loc];
+			ReleaseTokens(1, nullptr);
+			return loc;
 		}
+		m_prodLoc.store(absLoc + 1);
+		if (m_watermarks) CheckHighWatermark(absLoc + 1);
+		return loc;
+	}
+
+	//! get next free loc in m_buf to produce, with a cached copy of m_consLoc.
+	/*!
+	   Same as GetNextLocForProd. While cache_ shows the ring full at
+	   m_prodLoc, the producer waits without a CAS on the row status, whose
+	   cache line the consumer of the row is about to write, and refreshes
+	   cache_ from m_consLoc only then. So a producer ahead of its consumers
+	   reads consumer state once per ring, not once per retry.
+
+	   \param  [out]   absLoc_  next absolute location for the prodcuer
+	   \param  [in,out] cache_  the calling thread's copy of m_consLoc
+	   \param  [in ]   bucket_  optional per-producer rate limiter
+	*/
+	size_t GetNextLocForProd(size_t& absLoc_, CursorCache& cache_, TokenBucket* bucket_ = nullptr)
+	{
+		return NextLocForProd(absLoc_, &cache_.m_cursor, bucket_);
+	}
+
+	//! get next numRows_ free locs in m_buf to produce, in one go.
+	/*!
+	   Same as GetNextLocForProd for the contiguous absolute locations
+	   absLoc_ to absLoc_ + numRows_ - 1, with a single update of m_prodLoc
+	   for all of them; used to hand out rows to many producers at once
+	   (see CombiningClaim). Other producers claim only at m_prodLoc, so
+	   while the first row is held the following ones are claimed in order
+	   without competition, waiting for consumers to free them if need be.
+
+	   \param  [in ]   numRows_ number of rows, 1 to BufSize()
+	   \param  [out]   absLoc_  absolute location of the first row
+	   \return         ring buffer location of the first row = absLoc_ % m_rows;
+	                   row i is at (absLoc_ + i) % m_rows.
+	                   size_t(-1), illegal value, returned when buffer is stopped,
+	                   when a rate limiter with WaitPolicy::FAIL_FAST is out of tokens,
+	                   or, for a SingleThreaded buffer, when the buffer is full.
+	*/
+	size_t GetNextLocsForProd(size_t numRows_, size_t& absLoc_)
+	{
+		if (numRows_ == 0 || numRows_ > m_rows)
+		{
+			throw std::runtime_error("number of rows to claim not in 1..rows");
+		}
+		absLoc_ = (size_t)(-1);
+		for (size_t i = 0; i < numRows_ && m_rateLimiter; ++i)
+		{
+			if (!m_rateLimiter->Acquire(m_columns, m_stop))
+			{
+				// give back the tokens of the rows before
+				m_rateLimiter->Release(i*m_columns);
+				return (size_t)(-1);
+			}
+		}
+		size_t absLoc;
+		const auto loc = ClaimForProd(absLoc);
 		absLoc_ = absLoc;
-		// when stopped, return val is invalid for caller
-		if (m_stop) return (size_t)(-1); 
-		// loc is now assocaited with absLoc : loc = absLoc % m_rows 
-		m_locToAbsLocMap[loc].store(absLoc);
-		// before returning, increment m_prodLoc for next pos
-		++absLoc;
-		m_prodLoc.store(absLoc);
-		// all elements at this loc can be written to lock-free
-		return loc; 
+		if (loc >= m_rows)
+		{
+			ReleaseTokens(numRows_, nullptr);
+			return loc;
+		}
+		for (size_t i = 1; i < numRows_; ++i)
+		{
+			const auto next = (absLoc + i) % m_rows;
+			while (!m_slots.ClaimForWrite(next, (int64_t) (absLoc + i)))
+			{
+				if (m_stop || !m_concurrent)
+				{
+					// hand back the rows claimed so far
+					for (size_t j = 0; j < i; ++j)
+						m_slots.SetStatus((absLoc + j) % m_rows, Status::READY_FOR_WRITE);
+					ReleaseTokens(numRows_, nullptr);
+					return (size_t)(-1);
+				}
+				std::this_thread::sleep_for(std::chrono::microseconds(1));
+			}
+			m_slots.Bind(next, (int64_t) (absLoc + i));
+		}
+		// rows freed by Stop may have been claimed while others still use them
+		if (m_stop)
+		{
+			for (size_t j = 0; j < numRows_; ++j)
+				m_slots.SetStatus((absLoc + j) % m_rows, Status::READY_FOR_WRITE);
+			ReleaseTokens(numRows_, nullptr);
+			return (size_t)(-1);
+		}
+		m_prodLoc.store(absLoc + numRows_);
+		if (m_watermarks) CheckHighWatermark(absLoc + numRows_);
+		return loc;
 	}
 
 	//! get next free loc in m_buf to consume.
@@ -196,78 +503,233 @@ public:
 
 	\param  [out]   absLoc_  next absolute location for the consumer
 	\return         ring buffer location = absLoc_ % m_rows.
-	                size_t(-1), illegal value, returned when buffer is stopped.
+	                size_t(-1), illegal value, returned when buffer is stopped,
+	                or, for a SingleThreaded buffer, when the rows are not ready.
 	*/
 	size_t	GetNextLocForCons(size_t& absLoc_)
 	{
-		// wait as long as m_consLoc status is not READY_FOR_READ;
-		// and then set status to READING.
-		// When status is READING, no producer can write, and no other consumer can read.
-		auto absLoc = m_consLoc.load();
-		auto loc = absLoc % m_rows;
-		std::atomic<Status>* status{ &m_locStatus[loc] };
-		auto statusReadyForRead = Status::READY_FOR_READ;
-		auto statusReading = Status::READING;
-		while (!m_stop)
+		return NextLocForCons(absLoc_, nullptr);
+	}
+
+	//! get next loc in m_buf to consume, with a cached copy of m_prodLoc.
+	/*!
+	   Same as GetNextLocForCons. While cache_ shows the ring empty at
+	   m_consLoc, the consumer waits without a CAS on the row status, whose
+	   cache line the producer of the row is about to write, and refreshes
+	   cache_ from m_prodLoc only then. So a consumer behind its producers
+	   reads producer state once per batch of published rows, not per row.
+
+	   \param  [out]   absLoc_  next absolute location for the consumer
+	   \param  [in,out] cache_  the calling thread's copy of m_prodLoc
+	*/
+	size_t	GetNextLocForCons(size_t& absLoc_, CursorCache& cache_)
+	{
+		return NextLocForCons(absLoc_, &cache_.m_cursor);
+	}
+
+	//! get next numRows_ locs in m_buf to consume, in one go.
+	/*!
+	   Same as GetNextLocForCons for the contiguous absolute locations
+	   absLoc_ to absLoc_ + numRows_ - 1, with a single update of m_consLoc
+	   for all of them; the consumer counterpart of GetNextLocsForProd.
+	   While the first row is held, the following ones are claimed in order
+	   without competition, waiting for producers to publish them if need be.
+
+	   \param  [in ]   numRows_ number of rows, 1 to BufSize()
+	   \param  [out]   absLoc_  absolute location of the first row
+	   \return         ring buffer location of the first row = absLoc_ % m_rows;
+	                   row i is at (absLoc_ + i) % m_rows.
+	                   size_t(-1), illegal value, returned when buffer is stopped,
+	                   or, for a SingleThreaded buffer, when the rows are not ready.
+	*/
+	size_t	GetNextLocsForCons(size_t numRows_, size_t& absLoc_)
+	{
+		if (numRows_ == 0 || numRows_ > m_rows)
 		{
-			while ((!status->compare_exchange_strong(statusReadyForRead, statusReading))
-				&& (!m_stop))
-				// ------- (1)
+			throw std::runtime_error("number of rows to claim not in 1..rows");
+		}
+		size_t absLoc;
+		const auto loc = ClaimForCons(absLoc);
+		absLoc_ = absLoc;
+		if (loc >= m_rows)
+			return loc;
+		for (size_t i = 1; i < numRows_; ++i)
+		{
+			const auto next = (absLoc + i) % m_rows;
+			while (!m_slots.ClaimForRead(next, (int64_t) (absLoc + i)))
 			{
-				std::this_thread::sleep_for(std::chrono::microseconds(1)); 
-				// restore statusReadyForRead as this is overwritten
-				statusReadyForRead = Status::READY_FOR_READ;
-				// update status in case m_consLoc is changed by 
-				// another thread meanwhile
-				absLoc = m_consLoc.load(); // ------------- (2)
-				loc = absLoc % m_rows;
-				status = &m_locStatus[loc];
-				// --------- (3)
-				// In the sequence(2)--> (3)--- next iteration --->  (1) following may happen:
-				// Let this thread be A, another thread, say B, would be executing 
-				// the same code at (1).
-				// Thus, A and B are competing for the same m_consLoc.
-				// Let B wins and gets access to m_consLoc, sets status to READING
-				// comes out of loop, reaches (5), and returns. Afer it is consumed, its
-				// status is set to READY_FOR_WRITE for a producer to pick up.
-				// Let a producer thread C, meanwhile puts a value in this location
-				// and sets status to READY_FOR_READ.
-				// Note that when the producer writes here, it will be equivalent to
-				// absolute location m_consLoc + m_rows.
-				// m_consLoc  and m_consLoc + m_rows are mapped to the same ring buffer loc.
-				// m_consLoc % m_rows =  (m_consLoc + m_roww) % m_rows
-
-				// A then finally gets this loc and reads value from here.
-				// The problem here is, A consumed a value which was the latest produced
-				// by producer, and not the previous value (m_rows back) it expected to read.
-				// The original value in that loc was overwritten by producer
-				// after B read it. This happens because we use ring buffer.
-				// A location x in ring buffer can refer to all absolute values
-				// x + m_rows, x + 2*m_rows, ..x + n*m_rows.
-				// Thus while a consumer is waiting to read at x, a producer writing
-				// at x + m_rows might overwrite ring buffer status.
-				// Thus a consumer reading at absolute loc x + n*m_rows should get
-				// value written by producer at x + n*m_rows only. This
-				// sanity check is done at (4) using the
-				// ring buffer location to absolute location map.
+				if (m_stop || !m_concurrent)
+				{
+					// hand back the rows claimed so far, unread
+					for (size_t j = 0; j < i; ++j)
+						m_slots.SetStatus((absLoc + j) % m_rows, Status::READY_FOR_READ);
+					return (size_t)(-1);
+				}
+				std::this_thread::sleep_for(std::chrono::microseconds(1));
 			}
-			// check if loc has same absLoc mapping and no producer changed it meanwhile.
-			if (m_locToAbsLocMap[loc].load() == absLoc) // ------ (4)
-				break;
-			// the absLoc has changed by producer. This consumer is interested 
-			// in the old value which no longer exists as it was consumed allready.
-			// release from READING to READY_FOR_READ so that a consumer thread (this or
-			// another thread)
-			// that wants to read from new abs loc can take it.
-			status->store(statusReadyForRead); 
+		}
+		if (m_stop)
+		{
+			for (size_t j = 0; j < numRows_; ++j)
+				m_slots.SetStatus((absLoc + j) % m_rows, Status::READY_FOR_READ);
+			return (size_t)(-1);
+		}
+		m_consLoc.store(absLoc + numRows_);
+		if (m_watermarks) CheckLowWatermark(absLoc + numRows_);
+		return loc;
+	}
+
+	//! try to get next loc in m_buf to consume, without waiting.
+	/*!
+	Same as GetNextLocForCons, except that it returns at once when the location
+	at m_consLoc is not READY_FOR_READ rather than waiting for a producer.
+	Useful for a consumer that multiplexes many buffers on one thread.
+
+	\param  [out]   absLoc_  next absolute location for the consumer
+	\return         ring buffer location = absLoc_ % m_rows.
+	                size_t(-1) when nothing is ready or buffer is stopped.
+	*/
+	size_t	TryGetNextLocForCons(size_t& absLoc_)
+	{
+		if (m_stop) return (size_t)(-1);
+		auto absLoc = m_consLoc.load();
+		// same sanity check as (4) in GetNextLocForCons: a stale m_consLoc
+		// may point at a row already refilled for a later absolute location.
+		// Rows consumed ahead of the cursor are passed on the way.
+		while (!m_slots.ClaimForRead(absLoc % m_rows, absLoc))
+		{
+			if (!PassConsumed(absLoc))
+				return (size_t)(-1);
+		}
+		const auto loc = absLoc % m_rows;
+		// as in GetNextLocForCons, a row claimed while stopping is handed back.
+		if (m_stop)
+		{
+			m_slots.SetStatus(loc, Status::READY_FOR_READ);
+			return (size_t)(-1);
 		}
 		absLoc_ = absLoc;
-		if (m_stop) return (size_t)(-1); // when stopped, return val is invalid for caller
-		// before returning, increment m_consLoc for next pos
-		++absLoc;
-		m_consLoc.store(absLoc); //-------------- (5)
+		m_consLoc.store(absLoc + 1);
+		if (m_watermarks) CheckLowWatermark(absLoc + 1);
+		return loc;
+	}
 
-		return loc; // all elements at this loc can be read lock-free
+	//! copy out as many ready rows as fit in out_[0..size_), without waiting.
+	/*!
+	   Claims the rows ready from m_consLoc on, up to size_ / BufElemSize(),
+	   with a single update of m_consLoc; copies them out, with memcpy for a
+	   trivially copyable T, at most two copies as the ring wraps; and
+	   releases them all. For consumers that want the data out rather than
+	   processing it in place through operator[].
+
+	   \param  [out]   out_   destination
+	   \param  [in ]   size_  number of elements out_ holds
+	   \return         number of rows copied; 0 when none is ready or the
+	                   buffer is stopped
+	*/
+	size_t	DrainTo(T* out_, size_t size_)
+	{
+		size_t absLoc;
+		const auto numRows = ClaimReady(size_ / m_columns, absLoc);
+		if (!numRows)
+			return 0;
+		const auto loc = absLoc % m_rows;
+		const auto first = numRows < m_rows - loc ? numRows : m_rows - loc;
+		CopyRows(loc, first, out_);
+		CopyRows(0, numRows - first, out_ + first*m_columns);
+		ReleaseRows(absLoc, numRows);
+		return numRows;
+	}
+#if defined(__cpp_lib_span)
+	//! DrainTo(out_.data(), out_.size())
+	size_t	DrainTo(std::span<T> out_) { return DrainTo(out_.data(), out_.size()); }
+#endif
+
+	//! copy out up to maxRows_ ready rows to out_, without waiting.
+	/*!
+	   Same as DrainTo(T*, size_t) for any output iterator, e.g. a
+	   std::back_inserter; elements are copied with std::copy. Named apart
+	   from DrainTo as it takes a number of rows, not of elements.
+	   \return         number of rows copied
+	*/
+	template<typename TOutputIt>
+	size_t	DrainRowsTo(TOutputIt out_, size_t maxRows_)
+	{
+		size_t absLoc;
+		const auto numRows = ClaimReady(maxRows_, absLoc);
+		for (size_t i = 0; i < numRows; ++i)
+		{
+			const auto* row = &m_buf[((absLoc + i) % m_rows)*m_columns];
+			out_ = std::copy(row, row + m_columns, out_);
+		}
+		ReleaseRows(absLoc, numRows);
+		return numRows;
+	}
+
+	//! get a loc to consume near the calling thread, out of order if need be.
+	/*!
+	   Looks at the window_ rows from m_consLoc on that are published, in
+	   order, for the first one near_(absLoc) is true for, e.g. a row written
+	   by a producer sharing the caller's cache (see MAffinity.h). The row at
+	   m_consLoc is claimed as by GetNextLocForCons; a later one is claimed
+	   without moving m_consLoc, so rows may be consumed up to window_ - 1
+	   positions out of order. Without a near row ready, it is the same as
+	   GetNextLocForCons.
+
+	   Rows got here are released with SetLocConsumed; a row consumed ahead
+	   of the cursor is then reused only once the cursor passes it, which
+	   consumer claims do on their way. Not for buffers also consumed with
+	   GetNextLocsForCons (and so CombiningClaim), which expects rows ahead of
+	   the cursor to be unclaimed. Snapshot captures rows consumed ahead of
+	   the cursor as unconsumed.
+
+	   \param  [out]   absLoc_  absolute location for the consumer
+	   \param  [in ]   window_  rows to look at, at least 1
+	   \param  [in ]   near_    predicate on an absolute location
+	   \return         ring buffer location = absLoc_ % m_rows.
+	                   size_t(-1) when the buffer is stopped.
+	*/
+	template<typename TNear>
+	size_t	GetNextLocForConsNear(size_t& absLoc_, size_t window_, TNear&& near_)
+	{
+		if (!m_outOfOrder.load(std::memory_order_relaxed))
+			m_outOfOrder.store(true);
+		const auto consLoc = m_consLoc.load();
+		const auto prodLoc = m_prodLoc.load();
+		// the row at the cursor comes first when it is near
+		const auto end = near_((size_t) consLoc) ? consLoc : consLoc + (long) window_;
+		for (auto absLoc = consLoc + 1; absLoc < prodLoc && absLoc < end; ++absLoc)
+		{
+			if (!near_((size_t) absLoc))
+				continue;
+			// ClaimForRead checks absLoc is still unconsumed, even when
+			// consLoc is stale
+			const auto loc = absLoc % m_rows;
+			if (!m_slots.ClaimForRead(loc, absLoc))
+				continue;
+			if (m_stop)
+			{
+				m_slots.SetStatus(loc, Status::READY_FOR_READ);
+				return (size_t)(-1);
+			}
+			absLoc_ = absLoc;
+			return loc;
+		}
+		return NextLocForCons(absLoc_, nullptr);
+	}
+
+	/*!
+	Release a row got with GetNextLocForConsNear, after reading all its elements.
+	A row behind m_consLoc is set READY_FOR_WRITE; a row ahead of it,
+	CONSUMED, for the cursor to pass.
+	\param  [in ]   absloc_  asbolute location consumed
+	*/
+	void	SetLocConsumed(size_t absloc_)
+	{
+		// m_consLoc cannot pass a row being read, so it is either past
+		// absloc_ for good or yet to reach it
+		m_slots.SetStatus(absloc_ % m_rows,
+			(long) absloc_ < m_consLoc.load() ? Status::READY_FOR_WRITE : Status::CONSUMED);
 	}
 
 	//! set given loc ready to consume.
@@ -278,9 +740,7 @@ public:
 	*/
 	void	SetLocReadyForCons(size_t absloc_)
 	{
-		const auto loc = absloc_ % m_rows;
-		std::atomic<Status>& status{ m_locStatus[loc] };
-		status.store(Status::READY_FOR_READ);
+		m_slots.SetStatus(absloc_ % m_rows, Status::READY_FOR_READ);
 	}
 
 	/*!
@@ -290,9 +750,7 @@ public:
 	*/
 	void	SetLocReadyForProd(size_t absloc_)
 	{
-		const auto  loc = absloc_ % m_rows;
-		std::atomic<Status>& status{ m_locStatus[loc] };
-		status.store(Status::READY_FOR_WRITE);
+		m_slots.SetStatus(absloc_ % m_rows, Status::READY_FOR_WRITE);
 	}
 
 	//! Release all locks. 
@@ -304,10 +762,42 @@ public:
 	{
 		// release all locations
 		for (auto i = 0u; i < m_rows; ++i) {
-			std::atomic<Status>& status{ m_locStatus[i] };
-			status.store(Status::READY_FOR_WRITE);
-			m_locToAbsLocMap[i].store(-1); // loc -> abs location is not set to start woth
+			// loc -> abs location is not set to start woth
+			m_slots.Store(i, -1, Status::READY_FOR_WRITE);
+		}
+	}
+
+	//! set rate limiter shared by all producers; nullptr removes it.
+	/*! Its burst capacity must be at least the number of columns. */
+	void SetRateLimiter(TokenBucket* rateLimiter_) { m_rateLimiter = rateLimiter_; }
+
+	//! set high and low occupancy watermark hooks.
+	/*!
+	    onHigh_ is called by the producer whose claim brings occupancy to
+		highRows_ or more; onLow_ by the consumer whose claim then brings it
+		back to lowRows_ or less. Each fires once per crossing, alternately,
+		so upstream sources can throttle before producers start to wait for
+		free rows. Hooks run on producer/consumer threads and should be short.
+		Not thread safe: call before producers and consumers start.
+
+		\param highRows_   high watermark in rows; 0 removes the hooks
+		\param lowRows_    low watermark in rows, less than highRows_
+		\param onHigh_     called with the occupancy seen at the crossing
+		\param onLow_      called with the occupancy seen at the crossing
+	*/
+	void SetWatermarks(size_t highRows_, size_t lowRows_,
+		std::function<void(size_t)> onHigh_, std::function<void(size_t)> onLow_)
+	{
+		if (highRows_ && lowRows_ >= highRows_)
+		{
+			throw std::runtime_error("low watermark >= high watermark");
 		}
+		m_highWatermark = (long) highRows_;
+		m_lowWatermark = (long) lowRows_;
+		m_onHigh = std::move(onHigh_);
+		m_onLow = std::move(onLow_);
+		m_aboveHighWatermark.store(false);
+		m_watermarks = (highRows_ != 0);
 	}
 
 	//! Stop producer-consumer
@@ -328,10 +818,196 @@ public:
 	{
 		m_consLoc.store(0);
 		m_prodLoc.store(0);
+		m_aboveHighWatermark.store(false);
+		m_outOfOrder.store(false);
 		ReleaseAllLocks();
 		m_stop = false;
 	}
 
+	//! capture the buffer into file path_ for Restore, e.g. before a planned restart.
+	/*!
+	    Stops the buffer without releasing its rows: producers and consumers
+		waiting for a row return size_t(-1) as with Stop, and a row claimed
+		while stopping is handed back. Rows already claimed are waited for
+		until their producers and consumers release them, so the cursors
+		no longer move. The committed unconsumed rows [m_consLoc, m_prodLoc)
+		are then written, with the cursors, in one sequential write: no
+		drain is needed. The buffer stays stopped; Reset makes it usable again.
+		With relaxed claims, the open windows at the cursors are captured
+		too: a flag per row from m_consLoc to the end of the producer window
+		tells rows published and not consumed, whose contents are written,
+		from rows consumed ahead of m_consLoc and rows not yet published.
+		The file is written under a temporary name, synced to disk and
+		renamed into place.
+
+		\param path_   snapshot file
+		\return        number of rows captured
+	*/
+	size_t Snapshot(const std::string& path_)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "rows are written as bytes");
+		m_stop = true;
+		// let claims in progress settle
+		for (auto i = 0u; i < m_rows; ++i)
+		{
+			while (m_slots.GetStatus(i) == Status::WRITING || m_slots.GetStatus(i) == Status::READING)
+				std::this_thread::sleep_for(std::chrono::microseconds(1));
+		}
+		SnapshotHeader header{ m_snapshotMagic, m_rawBufSize, sizeof(T), m_rows, m_columns,
+			m_consLoc.load(), m_prodLoc.load(), m_segments };
+		const auto tmpPath = path_ + ".tmp";
+		auto* file = std::fopen(tmpPath.c_str(), "wb");
+		if (!file)
+		{
+			throw std::runtime_error("cannot create " + tmpPath);
+		}
+		auto ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+		size_t numRows = 0;
+		if (m_segments)
+		{
+			// rows of the open windows are published and consumed in any order
+			std::vector<uint8_t> flags((size_t) (header.m_prodLoc + (long) m_segments - header.m_consLoc));
+			for (size_t i = 0; i < flags.size(); ++i)
+			{
+				const auto absLoc = header.m_consLoc + (long) i;
+				int64_t boundTo;
+				Status status;
+				m_slots.Load(absLoc % m_rows, boundTo, status);
+				flags[i] = boundTo == absLoc && status == Status::READY_FOR_READ ? SNAP_UNCONSUMED :
+					RowClaimed(absLoc, Status::READING) ? SNAP_CONSUMED : SNAP_FREE;
+			}
+			ok = ok && std::fwrite(flags.data(), 1, flags.size(), file) == flags.size();
+			for (size_t i = 0; ok && i < flags.size(); ++i)
+			{
+				if (flags[i] != SNAP_UNCONSUMED) continue;
+				const auto loc = (size_t) (header.m_consLoc + (long) i) % m_rows;
+				ok = std::fwrite(&m_buf[loc*m_columns], sizeof(T)*m_columns, 1, file) == 1;
+				++numRows;
+			}
+		}
+		else
+		{
+			// the rows form at most two runs in the ring: up to its end, then from its start
+			numRows = (size_t) (header.m_prodLoc - header.m_consLoc);
+			const auto first = (size_t) header.m_consLoc % m_rows;
+			const auto run = numRows < m_rows - first ? numRows : m_rows - first;
+			ok = ok && std::fwrite(&m_buf[first*m_columns], sizeof(T)*m_columns, run, file) == run;
+			ok = ok && std::fwrite(&m_buf[0], sizeof(T)*m_columns, numRows - run, file) == numRows - run;
+		}
+		// on disk before the rename, so that a crash leaves the old snapshot or the new one
+		ok = ok && std::fflush(file) == 0 && SyncFile(file);
+		ok = (std::fclose(file) == 0) && ok;
+		if (!ok || std::rename(tmpPath.c_str(), path_.c_str()) != 0)
+		{
+			std::remove(tmpPath.c_str());
+			throw std::runtime_error("cannot write " + path_);
+		}
+		return numRows;
+	}
+
+	//! rebuild the buffer from a file written by Snapshot.
+	/*!
+	    The buffer gets the rows/columns configuration, relaxed segments,
+		cursors, rows and absolute location map it had at the snapshot, and
+		is not stopped, so consumers resume at the first unconsumed row.
+		Not thread safe: call before producers and consumers start.
+
+		\param path_   snapshot file
+		\return        number of rows restored
+	*/
+	size_t Restore(const std::string& path_)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "rows are read as bytes");
+		auto* file = std::fopen(path_.c_str(), "rb");
+		if (!file)
+		{
+			throw std::runtime_error("cannot open " + path_);
+		}
+		SnapshotHeader header;
+		auto ok = std::fread(&header, sizeof(header), 1, file) == 1 &&
+			header.m_magic == m_snapshotMagic && header.m_rawBufSize == m_rawBufSize &&
+			header.m_valueSize == sizeof(T) && header.m_rows && header.m_rows*header.m_columns == m_rawBufSize &&
+			header.m_consLoc >= 0 && header.m_prodLoc >= header.m_consLoc &&
+			header.m_prodLoc - header.m_consLoc <= (int64_t) header.m_rows &&
+			(!header.m_segments || (header.m_rows % header.m_segments == 0 &&
+			header.m_consLoc % (int64_t) header.m_segments == 0 && header.m_prodLoc % (int64_t) header.m_segments == 0));
+		size_t numRows = 0;
+		if (ok)
+		{
+			SetRowsColumns((size_t) header.m_rows, (size_t) header.m_columns);
+			m_segments = (size_t) header.m_segments;
+			Reset();
+			m_consLoc.store((long) header.m_consLoc);
+			m_prodLoc.store((long) header.m_prodLoc);
+			if (m_segments)
+			{
+				std::vector<uint8_t> flags((size_t) (header.m_prodLoc + (long) m_segments - header.m_consLoc));
+				ok = std::fread(flags.data(), 1, flags.size(), file) == flags.size();
+				// in absolute location order, so that a slot ends up with its latest row;
+				// a free row keeps the slot Reset leaves, free for any location
+				for (size_t i = 0; ok && i < flags.size(); ++i)
+				{
+					const auto absLoc = header.m_consLoc + (long) i;
+					const auto loc = (size_t) absLoc % m_rows;
+					if (flags[i] == SNAP_UNCONSUMED)
+					{
+						ok = ++numRows <= m_rows && std::fread(&m_buf[loc*m_columns], sizeof(T)*m_columns, 1, file) == 1;
+						m_slots.Store(loc, absLoc, Status::READY_FOR_READ);
+					}
+					else if (flags[i] == SNAP_CONSUMED)
+						m_slots.Store(loc, absLoc, Status::READY_FOR_WRITE);
+					else
+						ok = flags[i] == SNAP_FREE;
+				}
+			}
+			else
+			{
+				numRows = (size_t) (header.m_prodLoc - header.m_consLoc);
+				const auto first = (size_t) header.m_consLoc % m_rows;
+				const auto run = numRows < m_rows - first ? numRows : m_rows - first;
+				ok = std::fread(&m_buf[first*m_columns], sizeof(T)*m_columns, run, file) == run &&
+					std::fread(&m_buf[0], sizeof(T)*m_columns, numRows - run, file) == numRows - run;
+				for (auto absLoc = header.m_consLoc; ok && absLoc < header.m_prodLoc; ++absLoc)
+				{
+					const auto loc = (size_t) absLoc % m_rows;
+					m_slots.Store(loc, absLoc, Status::READY_FOR_READ);
+				}
+			}
+		}
+		std::fclose(file);
+		if (!ok)
+		{
+			Reset();
+			throw std::runtime_error("invalid snapshot " + path_);
+		}
+		return numRows;
+	}
+
+	//! prefetch the slot and payload of absolute location absLoc_.
+	/*!
+	    A consumer that has just claimed row x calls Prefetch(x + LookaheadRows())
+		before processing x, so that the lines of the row it will claim next
+		are on their way from the producer's cache meanwhile. Only a hint:
+		it helps when consumers run behind producers, and a row still being
+		written is better left alone, as the prefetch competes with its writer.
+	*/
+	void Prefetch(size_t absLoc_) const
+	{
+		const auto loc = absLoc_ % m_rows;
+		m_slots.Prefetch(loc);
+		const auto* row = reinterpret_cast<const char*>(&m_buf[loc*m_columns]);
+		const auto bytes = m_columns*sizeof(T);
+		for (size_t offset = 0; offset < bytes; offset += 64)
+			PrefetchLine(row + offset);
+	}
+	//! rows to prefetch ahead for the row width: about m_lookaheadBytes
+	//! ahead, at least 1 row and at most m_maxLookaheadRows.
+	size_t	LookaheadRows() const
+	{
+		const auto rows = m_lookaheadBytes/(m_columns*sizeof(T));
+		return rows < 1 ? 1 : rows > m_maxLookaheadRows ? m_maxLookaheadRows : rows;
+	}
+
 	//! Access a location
 	/*!
 	    Return address to the first element of a given location.
@@ -342,6 +1018,355 @@ public:
 	size_t	BufSize() const { return m_rows; }
 	//! Return number of elements in a buffer.
 	size_t	BufElemSize() const { return m_columns; }
+	//! Approximate number of rows claimed by producers and not yet by consumers.
+	/*! Relaxed reads of both cursors; exact only when no thread is claiming.
+	    With relaxed claims, the rows claimed in the open windows at the
+		cursors are counted from their slots.
+	*/
+	size_t	Occupancy() const
+	{
+		const auto prodLoc = m_prodLoc.load(std::memory_order_relaxed);
+		const auto consLoc = m_consLoc.load(std::memory_order_relaxed);
+		auto n = prodLoc - consLoc;
+		for (size_t i = 0; i < m_segments; ++i)
+			n += (long) RowClaimed(prodLoc + (long) i, Status::WRITING) - (long) RowClaimed(consLoc + (long) i, Status::READING);
+		return n > 0 ? (size_t) n : 0;
+	}
+	//! Approximately empty: no row left to claim for consumers.
+	bool	Empty() const { return Occupancy() == 0; }
+	//! Approximately full: no row left to claim for producers.
+	bool	Full() const { return Occupancy() >= m_rows; }
+	//! Return true if stopped, e.g. to tell a stopped buffer from a rate limited claim.
+	bool	Stopped() const { return m_stop; }
+private:
+	//! GetNextLocForProd, with a cached m_consLoc if consLoc_ is given
+	size_t NextLocForProd(size_t& absLoc_, long* consLoc_, TokenBucket* bucket_)
+	{
+		absLoc_ = (size_t)(-1);
+		// the global limiter first: tokens taken from the bucket of one
+		// producer are then the ones given back when it fails
+		if (m_rateLimiter && !m_rateLimiter->Acquire(m_columns, m_stop))
+			return (size_t)(-1);
+		if (bucket_ && !bucket_->Acquire(m_columns, m_stop))
+		{
+			if (m_rateLimiter) m_rateLimiter->Release(m_columns);
+			return (size_t)(-1);
+		}
+
+		size_t absLoc;
+		const auto loc = ClaimForProd(absLoc, consLoc_);
+		absLoc_ = absLoc;
+		if (loc >= m_rows)
+		{
+			// stopped, or full for a SingleThreaded buffer: no row, no tokens
+			ReleaseTokens(1, bucket_);
+			return loc;
+		}
+		// before returning, increment m_prodLoc for next pos
+		m_prodLoc.store(absLoc + 1);
+		if (m_watermarks) CheckHighWatermark(absLoc + 1);
+		// all elements at this loc can be written to lock-free
+		return loc; 
+	}
+	//! flush file_ to disk; true on success
+	static bool SyncFile(std::FILE* file_)
+	{
+#if defined(_WIN32)
+		return _commit(_fileno(file_)) == 0;
+#else
+		return fsync(fileno(file_)) == 0;
+#endif
+	}
+
+	//! give back the tokens taken for numRows_ rows of a failed claim
+	void ReleaseTokens(size_t numRows_, TokenBucket* bucket_)
+	{
+		if (m_rateLimiter) m_rateLimiter->Release(numRows_*m_columns);
+		if (bucket_) bucket_->Release(numRows_*m_columns);
+	}
+	//! GetNextLocForCons, with a cached m_prodLoc if prodLoc_ is given
+	size_t	NextLocForCons(size_t& absLoc_, long* prodLoc_)
+	{
+		size_t absLoc;
+		const auto loc = ClaimForCons(absLoc, prodLoc_);
+		absLoc_ = absLoc;
+		if (loc >= m_rows)
+			return loc;
+		// before returning, increment m_consLoc for next pos
+		m_consLoc.store(absLoc + 1); //-------------- (5)
+		if (m_watermarks) CheckLowWatermark(absLoc + 1);
+
+		return loc; // all elements at this loc can be read lock-free
+	}
+	//! false if the cached consumer cursor consLoc_, refreshed if need be,
+	//! shows the ring full at absLoc_; true without a cache
+	bool MayBeFree(long absLoc_, long* consLoc_)
+	{
+		if (!consLoc_ || absLoc_ - *consLoc_ < (long) m_rows)
+			return true;
+		*consLoc_ = m_consLoc.load();
+		return absLoc_ - *consLoc_ < (long) m_rows;
+	}
+	//! false if the cached producer cursor prodLoc_, refreshed if need be,
+	//! shows the ring empty at absLoc_; true without a cache
+	bool MayBeReady(long absLoc_, long* prodLoc_)
+	{
+		if (!prodLoc_ || absLoc_ < *prodLoc_)
+			return true;
+		*prodLoc_ = m_prodLoc.load();
+		return absLoc_ < *prodLoc_;
+	}
+	//! claim the row at m_prodLoc for GetNextLocForProd(s), without advancing m_prodLoc
+	/*!
+	   \param  [in ]   wait_   if 'false', fail rather than wait for a row
+	                           not yet freed by its consumer
+	   \return ring buffer location, associated with absLoc_; size_t(-1) when stopped
+	*/
+	size_t ClaimForProd(size_t& absLoc_, long* consLoc_ = nullptr, bool wait_ = true)
+	{
+		// wait as long as m_prodLoc status is not READY_FOR_WRITE;
+		// and then set status to WRITING.
+		// When status is WRITING, no other producer can write, 
+		// and no consumer can read.
+		auto absLoc = m_prodLoc.load();
+		auto loc = absLoc % m_rows;
+		auto claimed = false;
+		while (!m_stop)
+		{
+			while ( (!(claimed = MayBeFree(absLoc, consLoc_) && m_slots.ClaimForWrite(loc, absLoc)))
+				&& (!m_stop) )
+			{
+				// full, and no other thread to free a row
+				if (!m_concurrent) break;
+				// without waiting, retry only if another producer moved on
+				if (!wait_)
+				{
+					const auto prodLoc = m_prodLoc.load();
+					if (prodLoc == absLoc) break;
+					absLoc = prodLoc;
+					loc = absLoc % m_rows;
+					continue;
+				}
+				std::this_thread::sleep_for(std::chrono::microseconds(1)); 
+				// update loc in case m_prodLoc is changed by another 
+				// thread meanwhile
+				absLoc = m_prodLoc.load();
+				loc = absLoc % m_rows;
+			}
+			// check absLoc is still the one to produce. If this thread was
+			// delayed after loading m_prodLoc, another producer may have
+			// written absLoc, a consumer read it and released the row,
+			// so the CAS above succeeds for a stale absLoc. Claiming it would
+			// move m_prodLoc backwards and leave a row no consumer will take.
+			if (!claimed || m_prodLoc.load() == absLoc)
+				break;
+			// release the row for the producer of the current m_prodLoc
+			m_slots.SetStatus(loc, Status::READY_FOR_WRITE);
+			claimed = false;
+			absLoc = m_prodLoc.load();
+			loc = absLoc % m_rows;
+		}
+		absLoc_ = absLoc;
+		// when stopped, return val is invalid for caller. A row claimed
+		// meanwhile is handed back untouched (see Snapshot).
+		if (m_stop || !claimed)
+		{
+			if (claimed) m_slots.SetStatus(loc, Status::READY_FOR_WRITE);
+			return (size_t)(-1);
+		}
+		// loc is now assocaited with absLoc : loc = absLoc % m_rows 
+		m_slots.Bind(loc, absLoc);
+		return loc;
+	}
+	//! claim the row at m_consLoc for GetNextLocForCons(s), without advancing m_consLoc
+	/*! \return ring buffer location, associated with absLoc_; size_t(-1) when stopped */
+	size_t	ClaimForCons(size_t& absLoc_, long* prodLoc_ = nullptr)
+	{
+		// wait as long as m_consLoc status is not READY_FOR_READ;
+		// and then set status to READING.
+		// When status is READING, no producer can write, and no other consumer can read.
+		auto absLoc = m_consLoc.load();
+		auto loc = absLoc % m_rows;
+		auto claimed = false;
+		while ((!(claimed = MayBeReady(absLoc, prodLoc_) && m_slots.ClaimForRead(loc, absLoc)))
+			&& (!m_stop))
+			// ------- (1)
+		{
+			// a row consumed ahead of the cursor is passed without waiting
+			if (PassConsumed(absLoc))
+			{
+				loc = absLoc % m_rows;
+				continue;
+			}
+			// empty, and no other thread to publish a row
+			if (!m_concurrent) break;
+			std::this_thread::sleep_for(std::chrono::microseconds(1)); 
+			// update loc in case m_consLoc is changed by 
+			// another thread meanwhile
+			absLoc = m_consLoc.load(); // ------------- (2)
+			loc = absLoc % m_rows;
+			// --------- (3)
+			// In the sequence(2)--> (3)--- next iteration --->  (1) following may happen:
+			// Let this thread be A, another thread, say B, would be executing 
+			// the same code at (1).
+			// Thus, A and B are competing for the same m_consLoc.
+			// Let B wins and gets access to m_consLoc, sets status to READING
+			// comes out of loop, returns and reaches (5). Afer it is consumed, its
+			// status is set to READY_FOR_WRITE for a producer to pick up.
+			// Let a producer thread C, meanwhile puts a value in this location
+			// and sets status to READY_FOR_READ.
+			// Note that when the producer writes here, it will be equivalent to
+			// absolute location m_consLoc + m_rows.
+			// m_consLoc  and m_consLoc + m_rows are mapped to the same ring buffer loc.
+			// m_consLoc % m_rows =  (m_consLoc + m_roww) % m_rows
+
+			// A then finally gets this loc and reads value from here.
+			// The problem here is, A consumed a value which was the latest produced
+			// by producer, and not the previous value (m_rows back) it expected to read.
+			// The original value in that loc was overwritten by producer
+			// after B read it. This happens because we use ring buffer.
+			// A location x in ring buffer can refer to all absolute values
+			// x + m_rows, x + 2*m_rows, ..x + n*m_rows.
+			// Thus while a consumer is waiting to read at x, a producer writing
+			// at x + m_rows might overwrite ring buffer status.
+			// Thus a consumer reading at absolute loc x + n*m_rows should get
+			// value written by producer at x + n*m_rows only. This
+			// sanity check is done at (1) by ClaimForRead, which claims loc only
+			// if it is still associated with absLoc in the
+			// ring buffer location to absolute location map (4).
+		}
+		// (4): if the absLoc has changed by producer, this consumer is interested 
+		// in the old value which no longer exists as it was consumed allready.
+		// ClaimForRead then fails, leaving the row READY_FOR_READ so that a consumer
+		// thread (this or another thread) that wants to read from new abs loc can take it.
+		absLoc_ = absLoc;
+		// when stopped, return val is invalid for caller. A row claimed
+		// meanwhile is handed back unread (see Snapshot).
+		if (m_stop || !claimed)
+		{
+			if (claimed) m_slots.SetStatus(loc, Status::READY_FOR_READ);
+			return (size_t)(-1);
+		}
+		return loc;
+	}
+	//! claim up to maxRows_ rows ready from m_consLoc on, without waiting,
+	//! and advance m_consLoc past them; returns the number claimed
+	size_t	ClaimReady(size_t maxRows_, size_t& absLoc_)
+	{
+		if (m_stop || !maxRows_) return 0;
+		auto absLoc = m_consLoc.load();
+		// the first row is checked as in TryGetNextLocForCons; while it is
+		// held, the following rows are claimed without competition
+		while (!m_slots.ClaimForRead(absLoc % m_rows, absLoc))
+		{
+			if (!PassConsumed(absLoc))
+				return 0;
+		}
+		size_t numRows = 1;
+		while (numRows < maxRows_ && numRows < m_rows &&
+			m_slots.ClaimForRead((absLoc + numRows) % m_rows, absLoc + (long) numRows))
+			++numRows;
+		// rows freed by Stop may have been claimed while others still use them
+		if (m_stop)
+		{
+			for (size_t i = 0; i < numRows; ++i)
+				m_slots.SetStatus((absLoc + i) % m_rows, Status::READY_FOR_READ);
+			return 0;
+		}
+		absLoc_ = absLoc;
+		m_consLoc.store(absLoc + (long) numRows);
+		if (m_watermarks) CheckLowWatermark(absLoc + (long) numRows);
+		return numRows;
+	}
+	//! copy numRows_ rows from ring buffer location loc_ on, not wrapping, to out_
+	void	CopyRows(size_t loc_, size_t numRows_, T* out_) const
+	{
+		const auto* first = &m_buf[loc_*m_columns];
+		if constexpr (std::is_trivially_copyable<T>::value)
+		{
+			if (numRows_) std::memcpy(out_, first, numRows_*m_columns*sizeof(T));
+		}
+		else
+			std::copy(first, first + numRows_*m_columns, out_);
+	}
+	//! release numRows_ consumed rows from absLoc_ on to producers
+	void	ReleaseRows(size_t absLoc_, size_t numRows_)
+	{
+		for (size_t i = 0; i < numRows_; ++i)
+			m_slots.SetStatus((absLoc_ + i) % m_rows, Status::READY_FOR_WRITE);
+	}
+	//! first segment to try for a relaxed claim, by choice_
+	size_t	ChooseSegment(SegmentChoice& choice_) const
+	{
+		if (!choice_.m_random)
+			return choice_.m_next++ % m_segments;
+		// xorshift64
+		auto x = choice_.m_random;
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		choice_.m_random = x;
+		return x % m_segments;
+	}
+	//! 'true' if relaxed claim row absLoc_ was claimed by its producer
+	//! (claimed_ WRITING) or its consumer (claimed_ READING)
+	bool	RowClaimed(long absLoc_, Status claimed_) const
+	{
+		int64_t boundTo;
+		Status status;
+		// the absolute location is loaded first, so a status seen
+		// with boundTo == absLoc_ is at or after the producer's claim
+		m_slots.Load(absLoc_ % m_rows, boundTo, status);
+		if (boundTo != absLoc_)
+			return boundTo > absLoc_;
+		// bound to absLoc_: claimed by its producer; by a consumer if
+		// READING or, once consumed, READY_FOR_WRITE
+		return claimed_ == Status::WRITING || status == Status::READING || status == Status::READY_FOR_WRITE;
+	}
+	//! 'true' if every row of the relaxed claim window at window_ was claimed
+	//! by producers (claimed_ WRITING) or consumers (claimed_ READING)
+	bool	WindowPassed(long window_, Status claimed_) const
+	{
+		for (size_t i = 0; i < m_segments; ++i)
+		{
+			if (!RowClaimed(window_ + (long) i, claimed_))
+				return false;
+		}
+		return true;
+	}
+	//! if the row at cursor absLoc_ was consumed ahead of m_consLoc, pass it:
+	//! advance m_consLoc and absLoc_ to the next row and return true
+	bool	PassConsumed(long& absLoc_)
+	{
+		if (!m_outOfOrder.load(std::memory_order_relaxed) || !m_slots.PassConsumed(absLoc_ % m_rows, absLoc_))
+			return false;
+		// a CONSUMED row still associated with absLoc_ is one the cursor
+		// has yet to pass, so absLoc_ is the cursor, not a stale copy
+		++absLoc_;
+		m_consLoc.store(absLoc_);
+		if (m_watermarks) CheckLowWatermark(absLoc_);
+		return true;
+	}
+	//! call m_onHigh if producer cursor prodLoc_ takes occupancy to high watermark
+	void CheckHighWatermark(long prodLoc_)
+	{
+		const auto occupancy = prodLoc_ - m_consLoc.load(std::memory_order_relaxed);
+		if ((occupancy < m_highWatermark) || m_aboveHighWatermark.load(std::memory_order_relaxed))
+			return;
+		auto above = false;
+		if (m_aboveHighWatermark.compare_exchange_strong(above, true) && m_onHigh)
+			m_onHigh((size_t) occupancy);
+	}
+	//! call m_onLow if consumer cursor consLoc_ takes occupancy to low watermark
+	void CheckLowWatermark(long consLoc_)
+	{
+		const auto occupancy = m_prodLoc.load(std::memory_order_relaxed) - consLoc_;
+		if ((occupancy > m_lowWatermark) || !m_aboveHighWatermark.load(std::memory_order_relaxed))
+			return;
+		auto above = true;
+		if (m_aboveHighWatermark.compare_exchange_strong(above, false) && m_onLow)
+			m_onLow(occupancy > 0 ? (size_t) occupancy : 0);
+	}
 };
 
 
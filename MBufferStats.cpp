@@ -3,8 +3,13 @@
 
 Synchronised between multiple producer and consumer threads.
 */
+#include "MAffinity.h"
 #include "MBuffer.h"
+#include "MCombining.h"
+#include "MTrace.h"
+#include <algorithm>
 #include <iostream>
+#include <iterator>
 #include <string>
 #include <vector>
 #include <exception>      // std::exception
@@ -20,6 +25,8 @@ Synchronised between multiple producer and consumer threads.
 static const auto g_NumProd = 2;
 static const auto g_NumCons = 2;
 
+typedef Messenger::TraceRecorder<> RecorderType;
+
 
 //! Dbg: forwards requests to ostream
 /*! This prints output messages if ostream is supplied,
@@ -182,12 +189,16 @@ class Producer
 	double	m_timeElapsed; // total time elapsed
 	ObjType		m_lastObj; // value of the last object
 	TBuffer&     m_buffer; // buffer to write to
+	RecorderType*	m_recorder; // if not null, published rows are traced
+	uint32_t	m_id; // producer id in the trace
+	Messenger::TokenBucket*	m_bucket; // if not null, limits the production rate
 	std::thread m_thread; // default constructed thread
 
 public:
-	Producer(TBuffer& buf_, const char* s_ = "") :
+	Producer(TBuffer& buf_, const char* s_ = "", RecorderType* recorder_ = nullptr, uint32_t id_ = 0,
+		Messenger::TokenBucket* bucket_ = nullptr) :
 		m_name(s_), m_stop(false), m_numObjs(0), 
-		m_lastObj(-1), m_buffer(buf_)
+		m_lastObj(-1), m_buffer(buf_), m_recorder(recorder_), m_id(id_), m_bucket(bucket_)
 	{
 		m_thread = std::thread(ThreadFuncForProducer, this);
 		_dbg_ << m_name << " started\n"; // thread starts
@@ -218,7 +229,7 @@ public:
 			// produce: get next row to produce and fill object values
 			size_t absRow;
 			_dbg_ << "prod: " << m_name << " get next loc - ";
-			auto row = m_buffer.GetNextLocForProd(absRow);
+			auto row = m_buffer.GetNextLocForProd(absRow, m_bucket);
 			if (row >= m_buffer.BufSize() )
 			{
 				_dbg_ << m_name << " : Illegal row " << row << ". Buffer probably stopped\n";
@@ -247,6 +258,8 @@ public:
 			}
 			lastAbsRow = absRow;
 			m_buffer.SetLocReadyForCons(row); // all elements in row written. release this row to consumer
+			if (m_recorder)
+				m_recorder->Record(m_id, absRow, col, [](size_t) { return sizeof(ObjType); });
 		}
 		sw.stopTimer();
 		m_timeElapsed = sw.getElapsedTime();
@@ -398,19 +411,28 @@ public:
 
 
 template<typename TBuffer>
-void RunProducersConsumers(size_t numProd_, size_t numCons_, TBuffer& buffer_)
+void RunProducersConsumers(size_t numProd_, size_t numCons_, TBuffer& buffer_,
+	RecorderType* recorder_ = nullptr, double rowsPerSec_ = 0)
 {
 	_dbg_ << " Number of producers " << numProd_ << std::endl;
 	_dbg_ << " Number of consumers " << numCons_ << std::endl;
 	std::vector<std::unique_ptr<Producer<TBuffer>>> prods;
 	std::vector<std::unique_ptr<Consumer<TBuffer>>> cons;
+	std::vector<std::unique_ptr<Messenger::TokenBucket>> buckets;
 
 	decltype(((typename TBuffer::ValueType*) nullptr)->GetIndex()) lastProduced = -1;
 	decltype(((typename TBuffer::ValueType*) nullptr)->GetIndex()) lastConsumed = -1;
 
 	for (auto i = 0u; i < numProd_; ++i)
 	{
-		auto p = std::make_unique<Producer<TBuffer>>(buffer_);
+		Messenger::TokenBucket* bucket = nullptr;
+		if (rowsPerSec_ > 0)
+		{
+			buckets.push_back(std::make_unique<Messenger::TokenBucket>(rowsPerSec_*buffer_.BufElemSize(),
+				buffer_.BufElemSize()));
+			bucket = buckets.back().get();
+		}
+		auto p = std::make_unique<Producer<TBuffer>>(buffer_, "", recorder_, (uint32_t) i, bucket);
 		auto s = "prod " + std::to_string(i);
 		p->SetName(s);
 		prods.push_back(std::move(p));
@@ -520,10 +542,1301 @@ void RunProducersConsumers(size_t numProd_, size_t numCons_, TBuffer& buffer_)
 }
 
 
+//! replay trace path_ into buffer_ at timing scale_, with numCons_ consumers; print stats
+template<typename TBuffer>
+void ReplayTrace(const std::string& path_, double scale_, size_t numCons_, TBuffer& buffer_)
+{
+	typedef typename TBuffer::ValueType ObjType;
+	Messenger::TraceReplayer<TBuffer> replayer(path_);
+	std::vector<std::unique_ptr<Consumer<TBuffer>>> cons;
+	for (auto i = 0u; i < numCons_; ++i)
+		cons.push_back(std::make_unique<Consumer<TBuffer>>(buffer_));
+	// values follow the row and column, as IndexToObject for the consumers' sanity checks
+	const auto stats = replayer.Replay(buffer_, scale_,
+		[&buffer_](const Messenger::TraceEvent*, size_t absLoc_, size_t col_) {
+			return IndexToObject<ObjType>(absLoc_*buffer_.BufElemSize() + col_);
+		});
+	// an empty ring is not enough: the last rows may still be read. Wait
+	// until the consumers have counted every message replayed, or made no
+	// progress for a while
+	const auto expected = stats.m_rows*buffer_.BufElemSize();
+	const auto consumed = [&cons]() {
+		size_t n = 0;
+		for (auto& c : cons)
+			n += c->GetTotal();
+		return n;
+	};
+	for (auto idle = 0; consumed() < expected && idle < 1000; )
+	{
+		const auto before = consumed();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		idle = consumed() == before ? idle + 1 : 0;
+	}
+	size_t totalConsumed = 0;
+	for (auto& c : cons)
+	{
+		c->Stop();
+		c->GetThread().join();
+		totalConsumed += c->GetTotal();
+	}
+	std::cout << "------Replay of " << path_ << " at scale " << scale_ << " : "
+		<< replayer.NumProducers() << " producers, " << stats.m_messages << " messages in "
+		<< stats.m_rows << " rows, " << stats.m_secs << "s (" << stats.m_messages/stats.m_secs << " msgs/s)" << std::endl;
+	std::cout << "------Publish lateness usec p50 " << stats.m_p50LateNsec/1000.0
+		<< " p99 " << stats.m_p99LateNsec/1000.0 << " max " << stats.m_maxLateNsec/1000.0
+		<< ", " << numCons_ << " consumers, total consumed " << totalConsumed << std::endl;
+	if (totalConsumed != expected)
+		std::cout << "ERROR: " << expected << " messages replayed, " << totalConsumed << " consumed\n";
+}
+
+//! workload shapes for RunShape.
+/*! Each stresses one pathology of the row protocol: since rows are claimed
+    and released in strict order, a row held long by one thread delays every
+	thread behind it (head-of-line blocking), which steady load rarely shows.
+*/
+enum class Shape {
+	STEADY,         //!< all producers and consumers at full speed: the baseline
+	BURST,          //!< all producers publish a burst at the same instants and idle in between
+	SLOW_CONSUMER,  //!< one consumer holds each of its rows for a while, the others are fast
+	DESCHEDULED,    //!< producers are periodically descheduled while holding a claimed row
+	SKEWED          //!< producer rates fall by a factor 4 from one producer to the next
+};
+static const char* g_ShapeNames[] = { "steady", "burst", "slow consumer", "descheduled", "skewed" };
+// duration of each shape run
+static const auto g_ShapeDuration = std::chrono::seconds(2);
+// BURST: period of the bursts; each burst is twice the ring size, shared by all producers
+static const auto g_BurstPeriod = std::chrono::milliseconds(10);
+// SLOW_CONSUMER: time the slow consumer holds each row
+static const auto g_SlowConsumerHold = std::chrono::microseconds(50);
+// DESCHEDULED: every g_DescheduleEvery rows, a producer is off for g_DescheduleFor holding its row
+static const auto g_DescheduleEvery = 256u;
+static const auto g_DescheduleFor = std::chrono::milliseconds(1);
+// SKEWED: rows/s of producer 1; producer 0 is not limited, producer i > 1 gets a 4th of producer i - 1
+static const auto g_SkewRowsPerSec = 1'000'000.0;
+// publish-to-consume latency is sampled on one row in g_LatencySampleStride
+static const auto g_LatencySampleStride = 8u;
+
+//! run workload shape_ on buffer_ with numProd_ producers and numCons_ consumers; print stats
+/*! Column 0 of each row holds its publish time, the other columns their
+    index for a sanity check. Reports consumed messages/s and percentiles of
+	the publish-to-consume latency of rows.
+*/
+template<typename TBuffer>
+void RunShape(Shape shape_, size_t numProd_, size_t numCons_, TBuffer& buffer_)
+{
+	const auto nowNsec = []() {
+		return (int64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	};
+	buffer_.Reset();
+	std::atomic<bool> stop{ false };
+	std::vector<size_t> consumed(numCons_, 0), errors(numCons_, 0);
+	std::vector<std::vector<int64_t>> latencies(numCons_);
+	std::vector<std::unique_ptr<Messenger::TokenBucket>> buckets(numProd_);
+	if (shape_ == Shape::SKEWED)
+	{
+		auto rowsPerSec = g_SkewRowsPerSec;
+		for (auto p = 1u; p < numProd_; ++p, rowsPerSec /= 4)
+		{
+			buckets[p] = std::make_unique<Messenger::TokenBucket>(
+				std::max(rowsPerSec, 1.0)*buffer_.BufElemSize(), buffer_.BufElemSize());
+		}
+	}
+	std::vector<std::thread> threads;
+	const auto start = std::chrono::steady_clock::now();
+	for (auto p = 0u; p < numProd_; ++p)
+	{
+		threads.emplace_back([&, p]() {
+			const auto burstRows = 2*buffer_.BufSize()/numProd_ + 1;
+			for (size_t n = 0; !stop; ++n)
+			{
+				// burst k of all producers starts at start + k*period
+				if (shape_ == Shape::BURST && n % burstRows == 0)
+					std::this_thread::sleep_until(start + (n/burstRows + 1)*g_BurstPeriod);
+				size_t absLoc;
+				auto loc = buffer_.GetNextLocForProd(absLoc, buckets[p].get());
+				if (loc >= buffer_.BufSize()) break;
+				auto* row = buffer_[loc];
+				for (auto col = 1u; col < buffer_.BufElemSize(); ++col)
+					row[col] = (int64_t) (absLoc*buffer_.BufElemSize() + col);
+				if (shape_ == Shape::DESCHEDULED && n % g_DescheduleEvery == g_DescheduleEvery - 1)
+					std::this_thread::sleep_for(g_DescheduleFor);
+				row[0] = nowNsec();
+				buffer_.SetLocReadyForCons(absLoc);
+			}
+		});
+	}
+	for (auto c = 0u; c < numCons_; ++c)
+	{
+		threads.emplace_back([&, c]() {
+			while (!stop)
+			{
+				size_t absLoc;
+				auto loc = buffer_.GetNextLocForCons(absLoc);
+				if (loc >= buffer_.BufSize()) break;
+				const auto* row = buffer_[loc];
+				if (absLoc % g_LatencySampleStride == 0)
+					latencies[c].push_back(nowNsec() - row[0]);
+				for (auto col = 1u; col < buffer_.BufElemSize(); ++col)
+				{
+					if (row[col] != (int64_t) (absLoc*buffer_.BufElemSize() + col))
+						++errors[c];
+				}
+				if (shape_ == Shape::SLOW_CONSUMER && c == 0)
+					std::this_thread::sleep_for(g_SlowConsumerHold);
+				buffer_.SetLocReadyForProd(absLoc);
+				consumed[c] += buffer_.BufElemSize();
+			}
+		});
+	}
+	std::this_thread::sleep_for(g_ShapeDuration);
+	stop = true;
+	buffer_.Stop();
+	for (auto& t : threads)
+		t.join();
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	size_t totalConsumed = 0, totalErrors = 0;
+	std::vector<int64_t> all;
+	for (auto c = 0u; c < numCons_; ++c)
+	{
+		totalConsumed += consumed[c];
+		totalErrors += errors[c];
+		all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+	}
+	std::sort(all.begin(), all.end());
+	const auto percentile = [&all](double q_) {
+		return all.empty() ? 0.0 : all[(size_t) ((all.size() - 1)*q_)]/1000.0;
+	};
+	std::cout << "------Shape " << g_ShapeNames[(int) shape_] << " : " << numProd_ << " producers, "
+		<< numCons_ << " consumers, " << totalConsumed/secs.count() << " msgs/s, latency usec p50 "
+		<< percentile(0.5) << " p99 " << percentile(0.99) << " p99.9 " << percentile(0.999)
+		<< " max " << percentile(1.0) << (totalErrors ? ", CONSUMED WRONG VALUES" : "") << std::endl;
+}
+
+//! run all workload shapes
+void RunShapes(size_t numProd_, size_t numCons_)
+{
+	typedef Messenger::MBuffer<1024, 16, int64_t> ShapeBufType;
+	auto buffer = std::make_unique<ShapeBufType>();
+	std::cout << "Workload shapes, " << buffer->BufSize() << "x" << buffer->BufElemSize() << " buffer\n";
+	std::cout << "------------------------------------------------------\n";
+	for (auto shape : { Shape::STEADY, Shape::BURST, Shape::SLOW_CONSUMER, Shape::DESCHEDULED, Shape::SKEWED })
+		RunShape(shape, numProd_, numCons_, *buffer);
+}
+
+//! run producers and consumers on a buffer of each slot layout (see MSlots.h)
+/*! Narrow rows make claims, and so the slot layout, dominate the cost. */
+void RunSlotLayouts(size_t numProd_, size_t numCons_)
+{
+	static const auto SlotBufSize = 1'000'000;
+	typedef Messenger::MBuffer<SlotBufSize, 1, MsgType<int64_t>, Messenger::SplitSlots> SplitBufType;
+	typedef Messenger::MBuffer<SlotBufSize, 1, MsgType<int64_t>, Messenger::PackedSlots> PackedBufType;
+	auto split = std::make_unique<SplitBufType>();
+	auto packed = std::make_unique<PackedBufType>();
+#if defined(__SIZEOF_INT128__)
+	typedef Messenger::MBuffer<SlotBufSize, 1, MsgType<int64_t>, Messenger::WideSlots> WideBufType;
+	auto wide = std::make_unique<WideBufType>();
+#endif
+	for (auto numCols : { 1u, 10u, 100u })
+	{
+		std::cout << "Slots: status and abs location in two arrays\n";
+		split->Reset();
+		split->SetRowsColumns(SlotBufSize/numCols, numCols);
+		RunProducersConsumers(numProd_, numCons_, *split);
+		std::cout << "Slots: packed 64 bit word\n";
+		packed->Reset();
+		packed->SetRowsColumns(SlotBufSize/numCols, numCols);
+		RunProducersConsumers(numProd_, numCons_, *packed);
+#if defined(__SIZEOF_INT128__)
+		std::cout << "Slots: 128 bit word\n";
+		wide->Reset();
+		wide->SetRowsColumns(SlotBufSize/numCols, numCols);
+		RunProducersConsumers(numProd_, numCons_, *wide);
+#endif
+	}
+}
+
+//! claims straight from the buffer, with the interface of CombiningClaim;
+//! with TCached, each thread keeps a cached copy of the opposing cursor;
+//! with TLookahead, consumers prefetch the row they will claim next
+template<typename TBuffer, Messenger::ClaimSide TSide, bool TCached = false, bool TLookahead = false>
+class DirectClaim {
+	TBuffer&	m_buffer;
+public:
+	typedef typename TBuffer::CursorCache Handle;
+	DirectClaim(TBuffer& buffer_) : m_buffer(buffer_) {}
+	Handle Register() { return Handle(); }
+	size_t GetNextLoc(Handle& cache_, size_t& absLoc_)
+	{
+		if (TSide == Messenger::ClaimSide::PRODUCER)
+			return TCached ? m_buffer.GetNextLocForProd(absLoc_, cache_) : m_buffer.GetNextLocForProd(absLoc_);
+		const auto loc = TCached ? m_buffer.GetNextLocForCons(absLoc_, cache_) : m_buffer.GetNextLocForCons(absLoc_);
+		if (TLookahead && loc < m_buffer.BufSize())
+			m_buffer.Prefetch(absLoc_ + m_buffer.LookaheadRows());
+		return loc;
+	}
+	size_t NumBatches() const { return 0; }
+	size_t NumRows() const { return 0; }
+};
+
+//! register thread index_ with claim_
+template<typename TClaim>
+auto RegisterClaim(TClaim& claim_, size_t) { return claim_.Register(); }
+
+//! register thread index_ with cohorts claim_; threads are spread over the
+//! cohorts by index when the host has fewer nodes than claim_ has cohorts
+template<typename TBuffer, Messenger::ClaimSide TSide>
+typename Messenger::CohortClaim<TBuffer, TSide>::Handle RegisterClaim(
+	Messenger::CohortClaim<TBuffer, TSide>& claim_, size_t index_)
+{
+	return Messenger::Topology::Get().NumNodes() < claim_.NumNodes() ? claim_.Register(index_) : claim_.Register();
+}
+
+//! msgs/s with numProd_ producers claiming through prodClaim_ and
+//! numCons_ consumers claiming through consClaim_
+template<typename TBuffer, typename TProdClaim, typename TConsClaim>
+double RunClaims(size_t numProd_, size_t numCons_, TBuffer& buffer_, TProdClaim& prodClaim_, TConsClaim& consClaim_)
+{
+	buffer_.Reset();
+	std::atomic<bool> stop{ false };
+	std::atomic<size_t> consumed{ 0 }, errors{ 0 };
+	std::vector<std::thread> threads;
+	for (auto p = 0u; p < numProd_; ++p)
+	{
+		threads.emplace_back([&, p]() {
+			auto handle = RegisterClaim(prodClaim_, p);
+			while (!stop)
+			{
+				size_t absLoc;
+				auto loc = prodClaim_.GetNextLoc(handle, absLoc);
+				if (loc >= buffer_.BufSize()) break;
+				auto* row = buffer_[loc];
+				for (auto col = 0u; col < buffer_.BufElemSize(); ++col)
+					row[col] = (int64_t) (absLoc*buffer_.BufElemSize() + col);
+				buffer_.SetLocReadyForCons(absLoc);
+			}
+		});
+	}
+	for (auto c = 0u; c < numCons_; ++c)
+	{
+		threads.emplace_back([&, c]() {
+			auto handle = RegisterClaim(consClaim_, c);
+			size_t n = 0, bad = 0;
+			while (!stop)
+			{
+				size_t absLoc;
+				auto loc = consClaim_.GetNextLoc(handle, absLoc);
+				if (loc >= buffer_.BufSize()) break;
+				const auto* row = buffer_[loc];
+				for (auto col = 0u; col < buffer_.BufElemSize(); ++col)
+				{
+					if (row[col] != (int64_t) (absLoc*buffer_.BufElemSize() + col)) ++bad;
+				}
+				buffer_.SetLocReadyForProd(absLoc);
+				n += buffer_.BufElemSize();
+			}
+			consumed += n;
+			errors += bad;
+		});
+	}
+	const auto start = std::chrono::steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::seconds(2));
+	stop = true;
+	buffer_.Stop();
+	for (auto& t : threads)
+		t.join();
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	if (errors)
+		std::cout << "ERROR: " << errors << " messages consumed with wrong values\n";
+	return consumed/secs.count();
+}
+
+typedef Messenger::MBuffer<4096, 8, int64_t> ClaimBufType;
+typedef DirectClaim<ClaimBufType, Messenger::ClaimSide::PRODUCER> DirectProdClaim;
+typedef DirectClaim<ClaimBufType, Messenger::ClaimSide::CONSUMER> DirectConsClaim;
+
+//! direct claims with and without cached opposing cursors (MBuffer::CursorCache)
+void RunCursorCaching(size_t numProd_, size_t numCons_)
+{
+	typedef Messenger::ClaimSide Side;
+	auto buffer = std::make_unique<ClaimBufType>();
+	std::cout << "Cursor caching, " << buffer->BufSize() << "x" << buffer->BufElemSize() << " buffer\n";
+	std::cout << "------------------------------------------------------\n";
+	for (auto numThreads : { std::make_pair<size_t, size_t>(1, 1), std::make_pair(numProd_, numCons_) })
+	{
+		DirectProdClaim prod(*buffer);
+		DirectConsClaim cons(*buffer);
+		const auto plainRate = RunClaims(numThreads.first, numThreads.second, *buffer, prod, cons);
+		DirectClaim<ClaimBufType, Side::PRODUCER, true> cachedProd(*buffer);
+		DirectClaim<ClaimBufType, Side::CONSUMER, true> cachedCons(*buffer);
+		const auto cachedRate = RunClaims(numThreads.first, numThreads.second, *buffer, cachedProd, cachedCons);
+		std::cout << "------" << numThreads.first << " producers, " << numThreads.second << " consumers : "
+			<< plainRate << " msgs/s, with cached cursors " << cachedRate << " msgs/s" << std::endl;
+	}
+}
+
+//! consumer cost per message with and without lookahead prefetch (MBuffer::Prefetch),
+//! for rows from 64 bytes to 32 KB
+void RunLookahead(size_t numProd_, size_t numCons_)
+{
+	typedef Messenger::ClaimSide Side;
+	typedef Messenger::MBuffer<8192, 128, int64_t> LookaheadBufType;
+	auto buffer = std::make_unique<LookaheadBufType>();
+	std::cout << "Consumer lookahead, " << numProd_ << " producers, " << numCons_ << " consumers, "
+		<< buffer->BufSize()*buffer->BufElemSize()*sizeof(int64_t)/(1024*1024) << " MB buffer\n";
+	std::cout << "------------------------------------------------------\n";
+	for (auto numCols : { 8u, 64u, 512u, 4096u })
+	{
+		buffer->SetRowsColumns(buffer->BufSize()*buffer->BufElemSize()/numCols, numCols);
+		DirectClaim<LookaheadBufType, Side::PRODUCER> prod(*buffer);
+		DirectClaim<LookaheadBufType, Side::CONSUMER> cons(*buffer);
+		const auto plainRate = RunClaims(numProd_, numCons_, *buffer, prod, cons);
+		DirectClaim<LookaheadBufType, Side::CONSUMER, false, true> lookaheadCons(*buffer);
+		const auto lookaheadRate = RunClaims(numProd_, numCons_, *buffer, prod, lookaheadCons);
+		std::cout << "------" << numCols << " columns, lookahead " << buffer->LookaheadRows() << " rows : "
+			<< 1e9*numCons_/plainRate << " nsec/msg per consumer, with lookahead "
+			<< 1e9*numCons_/lookaheadRate << " nsec/msg" << std::endl;
+	}
+}
+
+//! msgs/s and fraction of rows consumed in the domain they were produced in,
+//! with consumers claiming in FIFO order or, if window_ > 1, with RowAffinity
+//! (see MAffinity.h). Threads are put in numDomains_ cache domains by index.
+template<typename TBuffer>
+std::pair<double, double> RunAffinityClaims(size_t numProd_, size_t numCons_, TBuffer& buffer_,
+	size_t numDomains_, size_t window_)
+{
+	buffer_.Reset();
+	Messenger::RowAffinity<TBuffer> affinity(buffer_);
+	std::atomic<bool> stop{ false };
+	std::atomic<size_t> consumed{ 0 }, near{ 0 }, errors{ 0 };
+	std::vector<std::thread> threads;
+	for (auto p = 0u; p < numProd_; ++p)
+	{
+		threads.emplace_back([&, p]() {
+			while (!stop)
+			{
+				size_t absLoc;
+				auto loc = buffer_.GetNextLocForProd(absLoc);
+				if (loc >= buffer_.BufSize()) break;
+				auto* row = buffer_[loc];
+				for (auto col = 0u; col < buffer_.BufElemSize(); ++col)
+					row[col] = (int64_t) (absLoc*buffer_.BufElemSize() + col);
+				affinity.Tag(absLoc, p % numDomains_);
+				buffer_.SetLocReadyForCons(absLoc);
+			}
+		});
+	}
+	for (auto c = 0u; c < numCons_; ++c)
+	{
+		threads.emplace_back([&, c]() {
+			const auto domain = c % numDomains_;
+			size_t n = 0, nearRows = 0, bad = 0;
+			while (!stop)
+			{
+				size_t absLoc;
+				auto loc = window_ > 1 ? affinity.GetNextLocForCons(absLoc, domain, window_)
+					: buffer_.GetNextLocForCons(absLoc);
+				if (loc >= buffer_.BufSize()) break;
+				const auto* row = buffer_[loc];
+				for (auto col = 0u; col < buffer_.BufElemSize(); ++col)
+				{
+					if (row[col] != (int64_t) (absLoc*buffer_.BufElemSize() + col)) ++bad;
+				}
+				if (affinity.Near(absLoc, domain)) ++nearRows;
+				if (window_ > 1)
+					buffer_.SetLocConsumed(absLoc);
+				else
+					buffer_.SetLocReadyForProd(absLoc);
+				n += buffer_.BufElemSize();
+			}
+			consumed += n;
+			near += nearRows;
+			errors += bad;
+		});
+	}
+	const auto start = std::chrono::steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::seconds(2));
+	stop = true;
+	buffer_.Stop();
+	for (auto& t : threads)
+		t.join();
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	if (errors)
+		std::cout << "ERROR: " << errors << " messages consumed with wrong values\n";
+	const auto rows = consumed/buffer_.BufElemSize();
+	return std::make_pair(consumed/secs.count(), rows ? double(near)/rows : 0.);
+}
+
+//! consumer claims in FIFO order vs cache affinity aware claims (see MAffinity.h)
+void RunAffinity(size_t numProd_, size_t numCons_)
+{
+	static const size_t NumDomains = 2;
+	static const size_t Window = 8;
+	auto buffer = std::make_unique<ClaimBufType>();
+	std::cout << "Affinity claims, " << buffer->BufSize() << "x" << buffer->BufElemSize() << " buffer, "
+		<< numProd_ << " producers, " << numCons_ << " consumers in " << NumDomains
+		<< " cache domains (emulated: threads spread by index)\n";
+	std::cout << "------------------------------------------------------\n";
+	const auto strict = RunAffinityClaims(numProd_, numCons_, *buffer, NumDomains, 1);
+	const auto near = RunAffinityClaims(numProd_, numCons_, *buffer, NumDomains, Window);
+	std::cout << "------FIFO " << strict.first << " msgs/s, " << 100*strict.second << "% rows near; window "
+		<< Window << " " << near.first << " msgs/s, " << 100*near.second << "% rows near" << std::endl;
+}
+
+//! msgs/s with producer and consumer logic inline on the calling thread,
+//! publishing batchRows_ rows and then consuming them
+template<typename TBuffer>
+double RunInlineClaims(TBuffer& buffer_, size_t batchRows_)
+{
+	buffer_.Reset();
+	size_t consumed = 0, errors = 0;
+	const auto start = std::chrono::steady_clock::now();
+	auto secs = std::chrono::duration<double>(0);
+	while (secs.count() < 2)
+	{
+		for (auto i = 0u; i < 1000; ++i)
+		{
+			for (auto r = 0u; r < batchRows_; ++r)
+			{
+				size_t absLoc;
+				auto loc = buffer_.GetNextLocForProd(absLoc);
+				if (loc >= buffer_.BufSize()) break;
+				auto* row = buffer_[loc];
+				for (auto col = 0u; col < buffer_.BufElemSize(); ++col)
+					row[col] = (int64_t) (absLoc*buffer_.BufElemSize() + col);
+				buffer_.SetLocReadyForCons(absLoc);
+			}
+			size_t absLoc;
+			for (auto loc = buffer_.TryGetNextLocForCons(absLoc); loc < buffer_.BufSize();
+				loc = buffer_.TryGetNextLocForCons(absLoc))
+			{
+				const auto* row = buffer_[loc];
+				for (auto col = 0u; col < buffer_.BufElemSize(); ++col)
+				{
+					if (row[col] != (int64_t) (absLoc*buffer_.BufElemSize() + col)) ++errors;
+				}
+				buffer_.SetLocReadyForProd(absLoc);
+				consumed += buffer_.BufElemSize();
+			}
+		}
+		secs = std::chrono::steady_clock::now() - start;
+	}
+	if (errors)
+		std::cout << "ERROR: " << errors << " messages consumed with wrong values\n";
+	return consumed/secs.count();
+}
+
+//! producer and consumer on one thread: MultiThreaded vs SingleThreaded buffer (see MThreading.h)
+void RunInline()
+{
+	typedef Messenger::MBuffer<4096, 8, int64_t> MultiBufType;
+	typedef Messenger::MBuffer<4096, 8, int64_t, Messenger::SplitSlots, Messenger::SingleThreaded> SingleBufType;
+	auto multi = std::make_unique<MultiBufType>();
+	auto single = std::make_unique<SingleBufType>();
+	std::cout << "Inline producer and consumer, " << multi->BufSize() << "x" << multi->BufElemSize() << " buffer\n";
+	std::cout << "------------------------------------------------------\n";
+	for (auto numCols : { 1u, 8u, 64u })
+	{
+		for (auto batchRows : { 1u, 64u })
+		{
+			multi->SetRowsColumns(multi->BufSize()*multi->BufElemSize()/numCols, numCols);
+			single->SetRowsColumns(single->BufSize()*single->BufElemSize()/numCols, numCols);
+			const auto multiRate = RunInlineClaims(*multi, batchRows);
+			const auto singleRate = RunInlineClaims(*single, batchRows);
+			std::cout << "------" << numCols << " columns, " << batchRows << " rows per batch : multi threaded "
+				<< multiRate << " msgs/s, single threaded " << singleRate << " msgs/s" << std::endl;
+		}
+	}
+}
+
+//! k-relaxed FIFO claims of the buffer (see MBuffer::SetRelaxedSegments), with
+//! the interface of CombiningClaim; segments are chosen at random if TRandom.
+//! Consumer claims keep the largest distance between a location claimed and
+//! the highest one claimed before it, which includes the time between claim
+//! and record, so strict claims show some too.
+template<typename TBuffer, Messenger::ClaimSide TSide, bool TRandom>
+class RelaxedClaim {
+	TBuffer&	m_buffer;
+	std::atomic<size_t>	m_threads{ 0 };
+	std::atomic<long>	m_highest{ -1 };
+	std::atomic<long>	m_reorder{ 0 };
+public:
+	typedef typename TBuffer::SegmentChoice Handle;
+	RelaxedClaim(TBuffer& buffer_) : m_buffer(buffer_) {}
+	Handle Register()
+	{
+		Handle choice;
+		choice.m_next = m_threads.fetch_add(1);
+		choice.m_random = TRandom ? 0x9e3779b97f4a7c15ull*(choice.m_next + 1) : 0;
+		return choice;
+	}
+	size_t GetNextLoc(Handle& choice_, size_t& absLoc_)
+	{
+		if (TSide == Messenger::ClaimSide::PRODUCER)
+			return m_buffer.GetNextLocForProdRelaxed(absLoc_, choice_);
+		const auto loc = m_buffer.GetNextLocForConsRelaxed(absLoc_, choice_);
+		if (loc < m_buffer.BufSize())
+			Record((long) absLoc_, m_highest, m_reorder);
+		return loc;
+	}
+	long Reorder() const { return m_reorder.load(); }
+	size_t NumBatches() const { return 0; }
+	size_t NumRows() const { return 0; }
+	//! keep the highest of absLoc_ in highest_, the largest distance below it in reorder_
+	static void Record(long absLoc_, std::atomic<long>& highest_, std::atomic<long>& reorder_)
+	{
+		auto highest = highest_.load(std::memory_order_relaxed);
+		while (absLoc_ > highest && !highest_.compare_exchange_weak(highest, absLoc_))
+			;
+		auto reorder = reorder_.load(std::memory_order_relaxed);
+		while (highest - absLoc_ > reorder && !reorder_.compare_exchange_weak(reorder, highest - absLoc_))
+			;
+	}
+};
+
+//! direct consumer claims recording their reordering as RelaxedClaim
+template<typename TBuffer>
+class StrictConsClaim : public DirectClaim<TBuffer, Messenger::ClaimSide::CONSUMER> {
+	std::atomic<long>	m_highest{ -1 };
+	std::atomic<long>	m_reorder{ 0 };
+public:
+	StrictConsClaim(TBuffer& buffer_) : DirectClaim<TBuffer, Messenger::ClaimSide::CONSUMER>(buffer_) {}
+	size_t GetNextLoc(typename TBuffer::CursorCache& cache_, size_t& absLoc_)
+	{
+		const auto loc = DirectClaim<TBuffer, Messenger::ClaimSide::CONSUMER>::GetNextLoc(cache_, absLoc_);
+		if (loc < TBuffer::m_rawBufSize)
+			RelaxedClaim<TBuffer, Messenger::ClaimSide::CONSUMER, false>::Record((long) absLoc_, m_highest, m_reorder);
+		return loc;
+	}
+	long Reorder() const { return m_reorder.load(); }
+};
+
+//! strict claims vs k-relaxed FIFO claims, as many producers as consumers
+void RunRelaxed(size_t maxThreads_)
+{
+	typedef Messenger::ClaimSide Side;
+	auto buffer = std::make_unique<ClaimBufType>();
+	std::cout << "Relaxed FIFO claims, " << buffer->BufSize() << "x" << buffer->BufElemSize() << " buffer\n";
+	std::cout << "------------------------------------------------------\n";
+	for (size_t n = 1; n <= maxThreads_; n *= 2)
+	{
+		DirectProdClaim strictProd(*buffer);
+		StrictConsClaim<ClaimBufType> strictCons(*buffer);
+		const auto strictRate = RunClaims(n, n, *buffer, strictProd, strictCons);
+		std::cout << "------" << n << " producers/consumers : strict " << strictRate << " msgs/s, reorder "
+			<< strictCons.Reorder();
+		for (auto k : { 4u, 16u })
+		{
+			buffer->SetRelaxedSegments(k);
+			RelaxedClaim<ClaimBufType, Side::PRODUCER, false> roundRobinProd(*buffer);
+			RelaxedClaim<ClaimBufType, Side::CONSUMER, false> roundRobinCons(*buffer);
+			const auto roundRobinRate = RunClaims(n, n, *buffer, roundRobinProd, roundRobinCons);
+			RelaxedClaim<ClaimBufType, Side::PRODUCER, true> randomProd(*buffer);
+			RelaxedClaim<ClaimBufType, Side::CONSUMER, true> randomCons(*buffer);
+			const auto randomRate = RunClaims(n, n, *buffer, randomProd, randomCons);
+			std::cout << "; k " << k << " round-robin " << roundRobinRate << " msgs/s, reorder "
+				<< roundRobinCons.Reorder() << ", random " << randomRate << " msgs/s, reorder " << randomCons.Reorder();
+		}
+		std::cout << std::endl;
+	}
+}
+
+//! how consumers of RunDrainClaims take rows out
+enum class Drain { PER_ROW, DRAIN_TO, IN_PLACE };
+static const char* g_DrainNames[] = { "per row copy", "DrainTo", "in place" };
+
+//! msgs/s with consumers copying rows out element by element, with DrainTo
+//! (g_DrainRows rows at a time) or reading them in place. Each consumer
+//! checks the values: a row holds n*columns .. n*columns + columns - 1.
+static const size_t g_DrainRows = 64;
+template<typename TBuffer>
+double RunDrainClaims(Drain drain_, size_t numProd_, size_t numCons_, TBuffer& buffer_)
+{
+	typedef typename TBuffer::ValueType ValueType;
+	buffer_.Reset();
+	std::atomic<bool> stop{ false };
+	std::atomic<size_t> consumed{ 0 }, errors{ 0 };
+	std::vector<std::thread> threads;
+	for (auto p = 0u; p < numProd_; ++p)
+	{
+		threads.emplace_back([&]() {
+			while (!stop)
+			{
+				size_t absLoc;
+				auto loc = buffer_.GetNextLocForProd(absLoc);
+				if (loc >= buffer_.BufSize()) break;
+				auto* row = buffer_[loc];
+				for (auto col = 0u; col < buffer_.BufElemSize(); ++col)
+					row[col] = (ValueType) (absLoc*buffer_.BufElemSize() + col);
+				buffer_.SetLocReadyForCons(absLoc);
+			}
+		});
+	}
+	for (auto c = 0u; c < numCons_; ++c)
+	{
+		threads.emplace_back([&, drain_]() {
+			const auto columns = buffer_.BufElemSize();
+			std::vector<ValueType> out(g_DrainRows*columns);
+			size_t n = 0, bad = 0;
+			auto check = [&](const ValueType* row_) {
+				bad += row_[0] % columns != 0;
+				for (auto col = 1u; col < columns; ++col)
+					bad += row_[col] != row_[0] + (ValueType) col;
+				n += columns;
+			};
+			while (!stop)
+			{
+				if (drain_ == Drain::DRAIN_TO)
+				{
+					const auto numRows = buffer_.DrainTo(out.data(), out.size());
+					for (size_t r = 0; r < numRows; ++r)
+						check(&out[r*columns]);
+					if (!numRows)
+					{
+						if (buffer_.Stopped()) break;
+						std::this_thread::yield();
+					}
+					continue;
+				}
+				size_t absLoc;
+				auto loc = buffer_.GetNextLocForCons(absLoc);
+				if (loc >= buffer_.BufSize()) break;
+				if (drain_ == Drain::PER_ROW)
+				{
+					for (auto col = 0u; col < columns; ++col)
+						out[col] = buffer_[loc][col];
+					buffer_.SetLocReadyForProd(absLoc);
+					check(out.data());
+				}
+				else
+				{
+					check(buffer_[loc]);
+					buffer_.SetLocReadyForProd(absLoc);
+				}
+			}
+			consumed += n;
+			errors += bad;
+		});
+	}
+	const auto start = std::chrono::steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::seconds(2));
+	stop = true;
+	buffer_.Stop();
+	for (auto& t : threads)
+		t.join();
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	if (errors)
+		std::cout << "ERROR: " << errors << " messages consumed with wrong values\n";
+	return consumed/secs.count();
+}
+
+//! rows produced by RunDrainOnce
+static const size_t g_DrainOnceRows = 400'000;
+
+//! numProd_ producers write g_DrainOnceRows rows to a small ring, consumed
+//! in turn with DrainTo, DrainRowsTo and TryGetNextLocForCons by numCons_
+//! consumers; every row must be consumed exactly once, with its values
+void RunDrainOnce(size_t numProd_, size_t numCons_)
+{
+	typedef Messenger::MBuffer<16, 4, int64_t> OnceBufType;
+	auto buffer = std::make_unique<OnceBufType>();
+	const auto columns = buffer->BufElemSize();
+	std::vector<std::atomic<uint8_t>> seen(g_DrainOnceRows);
+	for (auto& s : seen)
+		s = 0;
+	std::atomic<size_t> toProduce{ g_DrainOnceRows }, consumed{ 0 }, bad{ 0 };
+	std::vector<std::thread> threads;
+	for (auto p = 0u; p < numProd_; ++p)
+	{
+		threads.emplace_back([&]() {
+			for (size_t left = toProduce.load(); left; left = toProduce.load())
+			{
+				if (!toProduce.compare_exchange_weak(left, left - 1)) continue;
+				size_t absLoc;
+				const auto loc = buffer->GetNextLocForProd(absLoc);
+				if (loc >= buffer->BufSize()) break;
+				for (auto col = 0u; col < columns; ++col)
+					(*buffer)[loc][col] = (int64_t) (absLoc*columns + col);
+				buffer->SetLocReadyForCons(absLoc);
+			}
+		});
+	}
+	auto check = [&](const int64_t* row_) {
+		const auto absLoc = (size_t) row_[0]/columns;
+		bad += row_[0] % columns != 0 || absLoc >= g_DrainOnceRows;
+		for (auto col = 1u; col < columns; ++col)
+			bad += row_[col] != row_[0] + (int64_t) col;
+		if (absLoc < g_DrainOnceRows) ++seen[absLoc];
+		++consumed;
+	};
+	for (auto c = 0u; c < numCons_; ++c)
+	{
+		threads.emplace_back([&, c]() {
+			std::vector<int64_t> out(7*columns);
+			while (!buffer->Stopped())
+			{
+				size_t numRows = 0;
+				if (c % 3 == 0)
+				{
+					numRows = buffer->DrainTo(out.data(), out.size());
+					for (size_t r = 0; r < numRows; ++r)
+						check(&out[r*columns]);
+				}
+				else if (c % 3 == 1)
+				{
+					std::vector<int64_t> rows;
+					numRows = buffer->DrainRowsTo(std::back_inserter(rows), 5);
+					for (size_t r = 0; r < numRows; ++r)
+						check(&rows[r*columns]);
+				}
+				else
+				{
+					size_t absLoc;
+					const auto loc = buffer->TryGetNextLocForCons(absLoc);
+					if (loc < buffer->BufSize())
+					{
+						check((*buffer)[loc]);
+						buffer->SetLocReadyForProd(absLoc);
+						numRows = 1;
+					}
+				}
+				if (!numRows) std::this_thread::yield();
+			}
+		});
+	}
+	for (auto idle = 0; consumed < g_DrainOnceRows && idle < 1000; )
+	{
+		const auto before = consumed.load();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		idle = consumed == before ? idle + 1 : 0;
+	}
+	buffer->Stop();
+	for (auto& t : threads)
+		t.join();
+	size_t missed = 0, twice = 0;
+	for (auto& s : seen)
+	{
+		missed += s == 0;
+		twice += s > 1;
+	}
+	std::cout << "------" << buffer->BufSize() << "x" << columns << " buffer, mixed drains : " << consumed
+		<< " of " << g_DrainOnceRows << " rows consumed, " << missed << " missed, " << twice << " twice" << std::endl;
+	if (missed || twice || bad)
+		std::cout << "ERROR: " << missed << " rows missed, " << twice << " consumed twice, " << bad << " wrong values\n";
+}
+
+//! consumers copying rows out per row, with DrainTo, and processing them in place
+void RunDrain(size_t numProd_, size_t numCons_)
+{
+	typedef Messenger::MBuffer<4096, 64, int64_t> DrainBufType;
+	auto buffer = std::make_unique<DrainBufType>();
+	std::cout << "Drain, " << numProd_ << " producers, " << numCons_ << " consumers, DrainTo "
+		<< g_DrainRows << " rows at a time\n";
+	std::cout << "------------------------------------------------------\n";
+	for (auto numCols : { 8u, 64u })
+	{
+		buffer->SetRowsColumns(4096*64/numCols, numCols);
+		std::cout << "------" << buffer->BufSize() << "x" << numCols << " buffer :";
+		for (auto drain : { Drain::PER_ROW, Drain::DRAIN_TO, Drain::IN_PLACE })
+			std::cout << " " << g_DrainNames[(int) drain] << " " << RunDrainClaims(drain, numProd_, numCons_, *buffer) << " msgs/s";
+		std::cout << std::endl;
+	}
+	// at least one consumer of each kind
+	RunDrainOnce(numProd_, std::max<size_t>(numCons_, 3));
+}
+
+//! how RunWatermarkCycles claims rows
+enum class MarkPath { STRICT, RELAXED, DRAIN_TO };
+static const char* g_MarkPathNames[] = { "strict claims", "relaxed claims", "DrainTo" };
+//! watermarks, rows filled per cycle (a whole number of relaxed windows), cycles
+static const size_t g_HighMark = 192;
+static const size_t g_LowMark = 32;
+static const size_t g_MarkFill = 224;
+static const size_t g_MarkSegments = 4;
+static const size_t g_MarkCycles = 4;
+
+//! fill a buffer past its high watermark with numProd_ producers, then
+//! drain it below its low watermark with numCons_ consumers, g_MarkCycles
+//! times. After each phase exactly one more onHigh, then onLow, must have
+//! fired, alternately. Returns the number of phases where they did not.
+size_t RunWatermarkCycles(MarkPath path_, size_t numProd_, size_t numCons_)
+{
+	typedef Messenger::MBuffer<256, 4, int64_t> MarkBufType;
+	auto buffer = std::make_unique<MarkBufType>();
+	if (path_ == MarkPath::RELAXED)
+		buffer->SetRelaxedSegments(g_MarkSegments);
+	std::atomic<size_t> highs{ 0 }, lows{ 0 }, outOfTurn{ 0 };
+	std::atomic<bool> above{ false };
+	buffer->SetWatermarks(g_HighMark, g_LowMark,
+		[&](size_t) { ++highs; outOfTurn += above.exchange(true); },
+		[&](size_t) { ++lows; outOfTurn += !above.exchange(false); });
+	size_t mismatches = 0;
+	for (size_t cycle = 1; cycle <= g_MarkCycles; ++cycle)
+	{
+		std::atomic<long> toProduce{ (long) g_MarkFill };
+		std::vector<std::thread> threads;
+		for (auto p = 0u; p < numProd_; ++p)
+		{
+			threads.emplace_back([&, p]() {
+				MarkBufType::SegmentChoice choice;
+				choice.m_next = p;
+				size_t absLoc;
+				while (toProduce.fetch_sub(1) > 0)
+				{
+					const auto loc = path_ == MarkPath::RELAXED ?
+						buffer->GetNextLocForProdRelaxed(absLoc, choice) : buffer->GetNextLocForProd(absLoc);
+					if (loc >= buffer->BufSize()) break;
+					std::fill((*buffer)[loc], (*buffer)[loc] + buffer->BufElemSize(), (int64_t) absLoc);
+					buffer->SetLocReadyForCons(absLoc);
+				}
+			});
+		}
+		for (auto& t : threads)
+			t.join();
+		threads.clear();
+		mismatches += highs != cycle || lows != cycle - 1;
+		std::atomic<long> toConsume{ (long) g_MarkFill };
+		for (auto c = 0u; c < numCons_; ++c)
+		{
+			threads.emplace_back([&, c]() {
+				MarkBufType::SegmentChoice choice;
+				choice.m_next = c;
+				std::vector<int64_t> out(16*buffer->BufElemSize());
+				size_t absLoc;
+				if (path_ == MarkPath::DRAIN_TO)
+				{
+					while (toConsume.load() > 0)
+					{
+						const auto numRows = buffer->DrainTo(out.data(), out.size());
+						toConsume -= (long) numRows;
+						if (!numRows) std::this_thread::yield();
+					}
+					return;
+				}
+				while (toConsume.fetch_sub(1) > 0)
+				{
+					const auto loc = path_ == MarkPath::RELAXED ?
+						buffer->GetNextLocForConsRelaxed(absLoc, choice) : buffer->GetNextLocForCons(absLoc);
+					if (loc >= buffer->BufSize()) break;
+					buffer->SetLocReadyForProd(absLoc);
+				}
+			});
+		}
+		for (auto& t : threads)
+			t.join();
+		mismatches += highs != cycle || lows != cycle;
+	}
+	std::cout << "------" << g_MarkPathNames[(int) path_] << " : " << highs << " onHigh, " << lows
+		<< " onLow in " << g_MarkCycles << " cycles" << std::endl;
+	if (mismatches || outOfTurn)
+		std::cout << "ERROR: " << mismatches << " phases without exactly one crossing, "
+			<< outOfTurn << " hooks out of turn\n";
+	return mismatches + outOfTurn;
+}
+
+//! watermark hooks with strict claims, relaxed claims and DrainTo
+void RunWatermarks(size_t numProd_, size_t numCons_)
+{
+	std::cout << "Watermarks, high " << g_HighMark << " rows, low " << g_LowMark << " rows, "
+		<< g_MarkFill << " rows filled and drained per cycle\n";
+	std::cout << "------------------------------------------------------\n";
+	for (auto path : { MarkPath::STRICT, MarkPath::RELAXED, MarkPath::DRAIN_TO })
+		RunWatermarkCycles(path, numProd_, numCons_);
+}
+
+typedef Messenger::MBuffer<1024, 32, int64_t> SnapBufType;
+//! value of column col_ of the row at absLoc_ in the snapshot runs
+inline int64_t SnapValue(size_t absLoc_, size_t col_) { return (int64_t) (absLoc_*100 + col_); }
+//! snapshots taken while producers and consumers run
+static const size_t g_SnapRuns = 20;
+
+//! restore path_ into a new buffer and consume every row restored: they must
+//! be firstAbsLoc_ on, with their values, and producers must go on after them.
+//! Returns the number of errors.
+size_t CheckRestore(const std::string& path_, size_t firstAbsLoc_, size_t numRows_)
+{
+	auto buffer = std::make_unique<SnapBufType>();
+	size_t errors = buffer->Restore(path_) != numRows_;
+	for (size_t i = 0; i < numRows_; ++i)
+	{
+		size_t absLoc;
+		const auto loc = buffer->TryGetNextLocForCons(absLoc);
+		if (loc >= buffer->BufSize() || absLoc != firstAbsLoc_ + i)
+		{
+			++errors;
+			break;
+		}
+		for (auto col = 0u; col < buffer->BufElemSize(); ++col)
+			errors += (*buffer)[loc][col] != SnapValue(absLoc, col);
+		buffer->SetLocReadyForProd(absLoc);
+	}
+	size_t absLoc;
+	errors += buffer->TryGetNextLocForCons(absLoc) < buffer->BufSize();
+	errors += buffer->GetNextLocForProd(absLoc) >= buffer->BufSize() || absLoc != firstAbsLoc_ + numRows_;
+	return errors;
+}
+
+//! overwrite the 8 byte header field at offset_ of snapshot path_
+void PatchSnapshot(const std::string& path_, long offset_, int64_t value_)
+{
+	auto* file = fopen(path_.c_str(), "r+b");
+	if (!file) return;
+	fseek(file, offset_, SEEK_SET);
+	fwrite(&value_, sizeof(value_), 1, file);
+	fclose(file);
+}
+
+//! relaxed claims, g_SnapSegments rows per window
+static const size_t g_SnapSegments = 4;
+
+//! Snapshot -> Restore of relaxed claims with rows published and consumed
+//! in the open windows at both cursors. Returns the number of errors.
+size_t RunRelaxedSnapshot(const std::string& path_)
+{
+	auto buffer = std::make_unique<SnapBufType>();
+	buffer->SetRelaxedSegments(g_SnapSegments);
+	SnapBufType::SegmentChoice prodChoice, consChoice;
+	size_t errors = 0, absLoc;
+	// rows published in the producer window count before the window is full
+	std::vector<bool> unconsumed, produced;
+	const auto produce = [&](size_t numRows_) {
+		for (size_t i = 0; i < numRows_; ++i)
+		{
+			const auto loc = buffer->GetNextLocForProdRelaxed(absLoc, prodChoice);
+			for (auto col = 0u; col < buffer->BufElemSize(); ++col)
+				(*buffer)[loc][col] = SnapValue(absLoc, col);
+			buffer->SetLocReadyForCons(absLoc);
+			unconsumed.resize(std::max(unconsumed.size(), absLoc + 1));
+			unconsumed[absLoc] = true;
+			produced.resize(unconsumed.size());
+			produced[absLoc] = true;
+		}
+	};
+	produce(2);
+	errors += buffer->Occupancy() != 2 || buffer->Empty();
+	// 10 rows published, the last 2 in the open producer window; 5 consumed, the
+	// last one in the open consumer window
+	produce(8);
+	for (auto i = 0u; i < 5; ++i)
+	{
+		const auto loc = buffer->GetNextLocForConsRelaxed(absLoc, consChoice);
+		errors += (*buffer)[loc][7] != SnapValue(absLoc, 7);
+		unconsumed[absLoc] = false;
+		buffer->SetLocReadyForProd(absLoc);
+	}
+	const auto numRows = (size_t) std::count(unconsumed.begin(), unconsumed.end(), true);
+	errors += buffer->Occupancy() != numRows;
+	errors += buffer->Snapshot(path_) != numRows;
+	auto restored = std::make_unique<SnapBufType>();
+	errors += restored->Restore(path_) != numRows || restored->Occupancy() != numRows;
+	// every row left is consumed once with its values, and no other
+	for (size_t i = 0; i < numRows; ++i)
+	{
+		const auto loc = restored->GetNextLocForConsRelaxed(absLoc, consChoice);
+		if (loc >= restored->BufSize() || absLoc >= unconsumed.size() || !unconsumed[absLoc])
+		{
+			++errors;
+			break;
+		}
+		unconsumed[absLoc] = false;
+		for (auto col = 0u; col < restored->BufElemSize(); ++col)
+			errors += (*restored)[loc][col] != SnapValue(absLoc, col);
+		restored->SetLocReadyForProd(absLoc);
+	}
+	errors += !restored->Empty();
+	// producers fill the free rows of the open window first, and claim no
+	// location twice
+	const auto windowEnd = (unconsumed.size() + g_SnapSegments - 1)/g_SnapSegments*g_SnapSegments;
+	for (auto i = unconsumed.size(); i < windowEnd + g_SnapSegments; ++i)
+	{
+		const auto loc = restored->GetNextLocForProdRelaxed(absLoc, prodChoice);
+		errors += loc >= restored->BufSize() || (absLoc < produced.size() && produced[absLoc]);
+		errors += i < windowEnd && absLoc >= windowEnd;
+		produced.resize(std::max(produced.size(), absLoc + 1));
+		produced[absLoc] = true;
+		restored->SetLocReadyForCons(absLoc);
+	}
+	std::cout << "------relaxed claims, " << g_SnapSegments << " rows per window : " << numRows
+		<< " rows captured of the open windows, " << (errors ? "restored wrong" : "restored") << std::endl;
+	return errors;
+}
+
+//! Snapshot -> Restore round trips: with numProd_ producers and numCons_
+//! consumers running, of a wrapped ring, and of corrupt snapshots
+void RunSnapshot(size_t numProd_, size_t numCons_)
+{
+	const std::string path = "mbuffer_stats.snap";
+	std::cout << "Snapshot and Restore, " << SnapBufType().BufSize() << "x" << SnapBufType().BufElemSize() << " buffer\n";
+	std::cout << "------------------------------------------------------\n";
+	size_t errors = 0, wrapped = 0, captured = 0;
+	for (size_t run = 0; run < g_SnapRuns; ++run)
+	{
+		auto buffer = std::make_unique<SnapBufType>();
+		std::vector<std::vector<size_t>> consumed(numCons_);
+		std::atomic<size_t> badValues{ 0 };
+		std::vector<std::thread> threads;
+		for (auto p = 0u; p < numProd_; ++p)
+		{
+			threads.emplace_back([&]() {
+				size_t absLoc;
+				for (auto loc = buffer->GetNextLocForProd(absLoc); loc < buffer->BufSize(); loc = buffer->GetNextLocForProd(absLoc))
+				{
+					for (auto col = 0u; col < buffer->BufElemSize(); ++col)
+						(*buffer)[loc][col] = SnapValue(absLoc, col);
+					buffer->SetLocReadyForCons(absLoc);
+				}
+			});
+		}
+		for (auto c = 0u; c < numCons_; ++c)
+		{
+			threads.emplace_back([&, c]() {
+				size_t absLoc;
+				for (auto loc = buffer->GetNextLocForCons(absLoc); loc < buffer->BufSize(); loc = buffer->GetNextLocForCons(absLoc))
+				{
+					badValues += (*buffer)[loc][5] != SnapValue(absLoc, 5);
+					consumed[c].push_back(absLoc);
+					buffer->SetLocReadyForProd(absLoc);
+					// consumers behind producers, so that rows are left to capture
+					std::this_thread::sleep_for(std::chrono::microseconds(10));
+				}
+			});
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(3 + run % 5));
+		const auto numRows = buffer->Snapshot(path);
+		for (auto& t : threads)
+			t.join();
+		// consumers stopped at the snapshot: they took exactly [0, consLoc)
+		std::vector<size_t> all;
+		for (auto& c : consumed)
+			all.insert(all.end(), c.begin(), c.end());
+		std::sort(all.begin(), all.end());
+		for (size_t i = 0; i < all.size(); ++i)
+			errors += all[i] != i;
+		errors += badValues;
+		wrapped += numRows && all.size() % buffer->BufSize() + numRows > buffer->BufSize();
+		captured += numRows;
+		errors += CheckRestore(path, all.size(), numRows);
+	}
+	std::cout << "------" << numProd_ << " producers, " << numCons_ << " consumers : " << g_SnapRuns
+		<< " snapshots, " << captured/g_SnapRuns << " rows captured on average, " << wrapped << " wrapped" << std::endl;
+	// a ring wrapped for sure: consumer cursor at 1000 % rows, producer cursor at 1900 % rows
+	auto buffer = std::make_unique<SnapBufType>();
+	size_t absLoc;
+	for (auto i = 0u; i < 1900; ++i)
+	{
+		const auto loc = buffer->GetNextLocForProd(absLoc);
+		for (auto col = 0u; col < buffer->BufElemSize(); ++col)
+			(*buffer)[loc][col] = SnapValue(absLoc, col);
+		buffer->SetLocReadyForCons(absLoc);
+		if (i < 1000)
+		{
+			buffer->GetNextLocForCons(absLoc);
+			buffer->SetLocReadyForProd(absLoc);
+		}
+	}
+	const size_t consLoc = 1000, numRows = (size_t) buffer->Occupancy();
+	errors += buffer->Snapshot(path) != numRows;
+	errors += CheckRestore(path, consLoc, numRows);
+	std::cout << "------wrapped ring : consumer cursor at row " << consLoc % buffer->BufSize()
+		<< ", producer cursor at row " << (consLoc + numRows) % buffer->BufSize() << ", "
+		<< numRows << " rows restored" << std::endl;
+	// corrupt headers of the wrapped ring: magic, buffer size, rows, cursors
+	// out of order, more rows than the ring holds, rows missing from the file
+	const std::pair<long, int64_t> patches[] = { { 0, 0 }, { 8, 1 }, { 24, 3 }, { 40, 2000 }, { 48, -1 },
+		{ 48, 1000 + 2000 }, { 48, 2000 } };
+	size_t rejected = 0;
+	for (const auto& patch : patches)
+	{
+		// the buffer is still stopped: the cursors have not moved
+		buffer->Snapshot(path);
+		PatchSnapshot(path, patch.first, patch.second);
+		auto restored = std::make_unique<SnapBufType>();
+		try
+		{
+			restored->Restore(path);
+		}
+		catch (const std::runtime_error&)
+		{
+			++rejected;
+		}
+	}
+	std::cout << "------corrupt snapshots : " << rejected << " of " << sizeof(patches)/sizeof(patches[0])
+		<< " rejected" << std::endl;
+	errors += RunRelaxedSnapshot(path);
+	std::remove(path.c_str());
+	if (errors || rejected != sizeof(patches)/sizeof(patches[0]))
+		std::cout << "ERROR: " << errors << " rows restored wrong\n";
+}
+
+//! rows per cursor update of claim_
+template<typename TClaim>
+double RowsPerBatch(const TClaim& claim_)
+{
+	return double(claim_.NumRows())/std::max<size_t>(claim_.NumBatches(), 1);
+}
+
+//! producer claim scaling: direct claims vs flat combining (see MCombining.h)
+void RunClaimScaling(size_t maxProd_, size_t numCons_)
+{
+	auto buffer = std::make_unique<ClaimBufType>();
+	std::cout << "Producer claims, " << buffer->BufSize() << "x" << buffer->BufElemSize() << " buffer, "
+		<< numCons_ << " consumers\n";
+	std::cout << "------------------------------------------------------\n";
+	for (size_t numProd = 1; numProd <= maxProd_; numProd *= 2)
+	{
+		DirectProdClaim direct(*buffer);
+		DirectConsClaim cons(*buffer);
+		const auto directRate = RunClaims(numProd, numCons_, *buffer, direct, cons);
+		Messenger::CombiningClaim<ClaimBufType> combiner(*buffer);
+		const auto combinedRate = RunClaims(numProd, numCons_, *buffer, combiner, cons);
+		std::cout << "------" << numProd << " producers : direct " << directRate << " msgs/s, combining "
+			<< combinedRate << " msgs/s, " << RowsPerBatch(combiner) << " rows per cursor update" << std::endl;
+	}
+}
+
+//! claim scaling with as many producers as consumers: direct claims,
+//! flat combining and combining in numNodes_ NUMA cohorts (see MCombining.h)
+void RunCohortScaling(size_t maxThreads_, size_t numNodes_)
+{
+	typedef Messenger::ClaimSide Side;
+	auto buffer = std::make_unique<ClaimBufType>();
+	std::cout << "Producer and consumer claims, " << buffer->BufSize() << "x" << buffer->BufElemSize()
+		<< " buffer, " << numNodes_ << " cohorts"
+		<< (Messenger::Topology::Get().NumNodes() < numNodes_ ? " (nodes emulated: threads spread by index)" : "")
+		<< "\n";
+	std::cout << "------------------------------------------------------\n";
+	for (size_t n = 1; n <= maxThreads_; n *= 2)
+	{
+		DirectProdClaim directProd(*buffer);
+		DirectConsClaim directCons(*buffer);
+		const auto directRate = RunClaims(n, n, *buffer, directProd, directCons);
+		Messenger::CombiningClaim<ClaimBufType, Side::PRODUCER> combProd(*buffer);
+		Messenger::CombiningClaim<ClaimBufType, Side::CONSUMER> combCons(*buffer);
+		const auto combinedRate = RunClaims(n, n, *buffer, combProd, combCons);
+		Messenger::CohortClaim<ClaimBufType, Side::PRODUCER> cohortProd(*buffer, numNodes_);
+		Messenger::CohortClaim<ClaimBufType, Side::CONSUMER> cohortCons(*buffer, numNodes_);
+		const auto cohortRate = RunClaims(n, n, *buffer, cohortProd, cohortCons);
+		std::cout << "------" << n << " producers/consumers : direct " << directRate << " msgs/s, combining "
+			<< combinedRate << " msgs/s (" << RowsPerBatch(combProd) << "/" << RowsPerBatch(combCons)
+			<< " rows per update), cohorts " << cohortRate << " msgs/s (" << RowsPerBatch(cohortProd) << "/"
+			<< RowsPerBatch(cohortCons) << ")" << std::endl;
+	}
+}
+
 int main(int argc, char** argv)
 {
 	int numProd = g_NumProd, numCons = g_NumCons;
 	_dbg_ << "Num args :  " << argc << std::endl;
+	// record/replay traffic traces
+	static const auto TraceRows = 100'000;
+	static const auto TraceColumns = 100;
+	typedef Messenger::MBuffer<TraceRows, TraceColumns, MsgType<int64_t>> TraceBufType;
+	if (argc == 6 && std::string(argv[1]) == "record")
+	{
+		double rowsPerSec = 0;
+		sscanf_s(argv[3], "%d", &numProd);
+		sscanf_s(argv[4], "%d", &numCons);
+		sscanf_s(argv[5], "%lf", &rowsPerSec);
+		auto buffer = std::make_unique<TraceBufType>();
+		RecorderType recorder(argv[2]);
+		RunProducersConsumers(numProd, numCons, *buffer, &recorder, rowsPerSec);
+		recorder.Stop();
+		std::cout << "------Recorded " << recorder.NumEvents() << " messages to " << argv[2]
+			<< ", dropped " << recorder.Dropped() << std::endl;
+		return 0;
+	}
+	if (argc == 5 && std::string(argv[1]) == "replay")
+	{
+		double scale = 1;
+		sscanf_s(argv[3], "%lf", &scale);
+		sscanf_s(argv[4], "%d", &numCons);
+		auto buffer = std::make_unique<TraceBufType>();
+		ReplayTrace(argv[2], scale, numCons, *buffer);
+		return 0;
+	}
+	if (argc == 4 && std::string(argv[1]) == "shapes")
+	{
+		sscanf_s(argv[2], "%d", &numProd);
+		sscanf_s(argv[3], "%d", &numCons);
+		RunShapes(numProd, numCons);
+		return 0;
+	}
+	if (argc == 4 && std::string(argv[1]) == "slots")
+	{
+		sscanf_s(argv[2], "%d", &numProd);
+		sscanf_s(argv[3], "%d", &numCons);
+		RunSlotLayouts(numProd, numCons);
+		return 0;
+	}
+	if (argc == 4 && std::string(argv[1]) == "combining")
+	{
+		sscanf_s(argv[2], "%d", &numProd);
+		sscanf_s(argv[3], "%d", &numCons);
+		RunClaimScaling(numProd, numCons);
+		return 0;
+	}
+	if (argc == 4 && std::string(argv[1]) == "cursorcache")
+	{
+		sscanf_s(argv[2], "%d", &numProd);
+		sscanf_s(argv[3], "%d", &numCons);
+		RunCursorCaching(numProd, numCons);
+		return 0;
+	}
+	if (argc == 4 && std::string(argv[1]) == "lookahead")
+	{
+		sscanf_s(argv[2], "%d", &numProd);
+		sscanf_s(argv[3], "%d", &numCons);
+		RunLookahead(numProd, numCons);
+		return 0;
+	}
+	if (argc == 4 && std::string(argv[1]) == "affinity")
+	{
+		sscanf_s(argv[2], "%d", &numProd);
+		sscanf_s(argv[3], "%d", &numCons);
+		RunAffinity(numProd, numCons);
+		return 0;
+	}
+	if (argc == 3 && std::string(argv[1]) == "relaxed")
+	{
+		sscanf_s(argv[2], "%d", &numProd);
+		RunRelaxed(numProd);
+		return 0;
+	}
+	if (argc == 4 && std::string(argv[1]) == "drain")
+	{
+		sscanf_s(argv[2], "%d", &numProd);
+		sscanf_s(argv[3], "%d", &numCons);
+		RunDrain(numProd, numCons);
+		return 0;
+	}
+	if (argc == 4 && std::string(argv[1]) == "watermarks")
+	{
+		sscanf_s(argv[2], "%d", &numProd);
+		sscanf_s(argv[3], "%d", &numCons);
+		RunWatermarks(numProd, numCons);
+		return 0;
+	}
+	if (argc == 4 && std::string(argv[1]) == "snapshot")
+	{
+		sscanf_s(argv[2], "%d", &numProd);
+		sscanf_s(argv[3], "%d", &numCons);
+		RunSnapshot(numProd, numCons);
+		return 0;
+	}
+	if (argc == 2 && std::string(argv[1]) == "inline")
+	{
+		RunInline();
+		return 0;
+	}
+	if (argc == 4 && std::string(argv[1]) == "cohorts")
+	{
+		int numNodes = 2;
+		sscanf_s(argv[2], "%d", &numProd);
+		sscanf_s(argv[3], "%d", &numNodes);
+		RunCohortScaling(numProd, numNodes);
+		return 0;
+	}
 	if (argc == 3)
 	{
 		sscanf_s(argv[1], "%d", &numProd);
@@ -532,6 +1845,20 @@ int main(int argc, char** argv)
 	else
 	{
 		std::cout << "Usage: Messenger <num prod> <num cons>\n";
+		std::cout << "       Messenger record <trace file> <num prod> <num cons> <rows/s per producer>\n";
+		std::cout << "       Messenger replay <trace file> <time scale> <num cons>\n";
+		std::cout << "       Messenger shapes <num prod> <num cons>\n";
+		std::cout << "       Messenger slots <num prod> <num cons>\n";
+		std::cout << "       Messenger combining <max num prod> <num cons>\n";
+		std::cout << "       Messenger cohorts <max num prod/cons> <num nodes>\n";
+		std::cout << "       Messenger cursorcache <num prod> <num cons>\n";
+		std::cout << "       Messenger lookahead <num prod> <num cons>\n";
+		std::cout << "       Messenger affinity <num prod> <num cons>\n";
+		std::cout << "       Messenger inline\n";
+		std::cout << "       Messenger relaxed <max num prod/cons>\n";
+		std::cout << "       Messenger drain <num prod> <num cons>\n";
+		std::cout << "       Messenger watermarks <num prod> <num cons>\n";
+		std::cout << "       Messenger snapshot <num prod> <num cons>\n";
 		std::cout << "No args provided. Taking defaults: "
 			<< numProd << " producer(s), "
 			<< numCons << " consumer(s)\n" << std::endl;
@@ -562,6 +1889,7 @@ int main(int argc, char** argv)
 		buffer->SetRowsColumns(numRows, numCols);
 		RunProducersConsumers(numProd, numCons, *buffer);
 	}
+	RunShapes(numProd, numCons);
 	_dbg_ << ">>>>>>>> DEBUG print ON\n";
 	_dbg_ << "End of simulation\n";
 }
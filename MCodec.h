@@ -0,0 +1,430 @@
+/*! \file MCodec.h
+    \brief  Compact binary encoding of MBuffer rows driven by a compile time schema.
+
+	A row of n messages is encoded column by column: each schema field of
+	all n messages is stored together, either raw (memcpy) or as zigzag
+	varints of the difference to the previous message. Monotonic integer
+	columns such as sequence numbers and timestamps shrink to 1-2 bytes.
+*/
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
+namespace Messenger {
+
+/*! \enum how a field is encoded
+
+    RAW:           field bytes copied as they are
+    DELTA_VARINT:  integer fields only: zigzag varint of the difference
+                   to the same field of the previous message in the row
+*/
+enum class Encoding { RAW = 0, DELTA_VARINT = 1 };
+
+//! Schema field: data member TMember of the message, encoded as TEnc.
+
+//! e.g. Field<&Trade::m_seq, Encoding::DELTA_VARINT>
+template<auto TMember, Encoding TEnc = Encoding::RAW>
+struct Field;
+
+template<typename TMsg, typename TValue, TValue TMsg::*TMember, Encoding TEnc>
+struct Field<TMember, TEnc> {
+	typedef TValue ValueType;
+	static const Encoding m_encoding = TEnc;
+	static TValue Get(const TMsg& msg_) { return msg_.*TMember; }
+	static void Set(TMsg& msg_, TValue value_) { msg_.*TMember = value_; }
+};
+
+//! Schema field covering a whole message of the same size as TValue.
+
+//! For messages that wrap a single integer, e.g. MsgType<int64_t>.
+template<typename TValue, Encoding TEnc = Encoding::RAW>
+struct Whole {
+	typedef TValue ValueType;
+	static const Encoding m_encoding = TEnc;
+	template<typename TMsg>
+	static TValue Get(const TMsg& msg_)
+	{
+		static_assert(sizeof(TMsg) == sizeof(TValue), "message must be the size of the field");
+		TValue value;
+		memcpy(&value, &msg_, sizeof(value));
+		return value;
+	}
+	template<typename TMsg>
+	static void Set(TMsg& msg_, TValue value_)
+	{
+		memcpy(&msg_, &value_, sizeof(value_));
+	}
+};
+
+//! Varint and zigzag primitives.
+struct Varint {
+	//! max bytes of a 64 bit varint
+	static const size_t m_maxBytes = 10;
+
+	static uint64_t ZigZag(int64_t v_) { return (uint64_t(v_) << 1) ^ uint64_t(v_ >> 63); }
+	static int64_t UnZigZag(uint64_t v_) { return int64_t(v_ >> 1) ^ -int64_t(v_ & 1); }
+
+	//! write v_ at out_; return bytes written
+	static size_t Put(uint64_t v_, char* out_)
+	{
+		size_t n = 0;
+		while (v_ >= 0x80)
+		{
+			out_[n++] = char(v_ | 0x80);
+			v_ >>= 7;
+		}
+		out_[n++] = char(v_);
+		return n;
+	}
+	//! read a varint at in_, at most end_ - in_ bytes; return bytes read, 0 if malformed.
+	/*!
+	    With 8 bytes available, varints up to 8 bytes are decoded from one
+		unaligned load: the terminating byte is found from the continuation
+		bits with a count of trailing zeros, and the 7 bit groups are packed
+		with one pext (BMI2) or a fixed sequence of shifts and masks. No
+		branch depends on the individual bytes.
+	*/
+	static size_t Get(const char* in_, const char* end_, uint64_t& v_)
+	{
+		if (end_ - in_ >= 8)
+		{
+			uint64_t x;
+			memcpy(&x, in_, sizeof(x)); // little endian
+			const auto stop = ~x & 0x8080808080808080ull;
+			if (stop)
+			{
+				const auto bits = (size_t) __builtin_ctzll(stop) + 1; // 8 * length
+				const auto bytes = bits == 64 ? x : (x & ((uint64_t(1) << bits) - 1));
+#if defined(__BMI2__)
+				v_ = _pext_u64(bytes, 0x7f7f7f7f7f7f7f7full);
+#else
+				v_ = (bytes & 0x7full)
+					| ((bytes >> 1) & (0x7full << 7))
+					| ((bytes >> 2) & (0x7full << 14))
+					| ((bytes >> 3) & (0x7full << 21))
+					| ((bytes >> 4) & (0x7full << 28))
+					| ((bytes >> 5) & (0x7full << 35))
+					| ((bytes >> 6) & (0x7full << 42))
+					| ((bytes >> 7) & (0x7full << 49));
+#endif
+				return bits >> 3;
+			}
+		}
+		// short input or varint longer than 8 bytes
+		v_ = 0;
+		for (size_t n = 0; n < m_maxBytes && in_ + n < end_; ++n)
+		{
+			const auto b = (unsigned char) in_[n];
+			v_ |= uint64_t(b & 0x7f) << (7*n);
+			if (!(b & 0x80)) return n + 1;
+		}
+		return 0;
+	}
+};
+
+//! Encodes and decodes rows of messages TMsg according to schema TFields.
+
+//! Encoded row: varint message count, then one column per field in
+// schema order. RAW columns hold n copies of the field bytes; DELTA_VARINT
+// columns hold n zigzag varints, the first relative to 0.
+// With no fields the message is treated as plain bytes and the row is
+// copied with one memcpy.
+template<typename TMsg, typename... TFields>
+class RowCodec {
+	static_assert(std::is_trivially_copyable<TMsg>::value || sizeof...(TFields) > 0,
+		"a message without schema must be trivially copyable");
+public:
+	typedef TMsg MsgType;
+
+	//! upper bound of the encoded size of n_ messages
+	static size_t MaxEncodedSize(size_t n_)
+	{
+		if (sizeof...(TFields) == 0) return Varint::m_maxBytes + n_*sizeof(TMsg);
+		return Varint::m_maxBytes + (0 + ... + MaxColumnSize<TFields>(n_));
+	}
+	//! encode row_[0, n_) at out_, which has MaxEncodedSize(n_) bytes; return bytes written
+	static size_t Encode(const TMsg* row_, size_t n_, char* out_)
+	{
+		auto* p = out_ + Varint::Put(n_, out_);
+		if constexpr (sizeof...(TFields) == 0)
+		{
+			memcpy(p, row_, n_*sizeof(TMsg));
+			p += n_*sizeof(TMsg);
+		}
+		else
+		{
+			((p = EncodeColumn<TFields>(row_, n_, p)), ...);
+		}
+		return (size_t) (p - out_);
+	}
+	//! decode n_ messages from in_[0, size_) into row_.
+	/*! \return bytes read, 0 if input is malformed or does not hold n_ messages */
+	static size_t Decode(const char* in_, size_t size_, TMsg* row_, size_t n_)
+	{
+		const auto* end = in_ + size_;
+		uint64_t count;
+		auto read = Varint::Get(in_, end, count);
+		if (!read || count != n_) return 0;
+		const auto* p = in_ + read;
+		if constexpr (sizeof...(TFields) == 0)
+		{
+			if ((size_t) (end - p) < n_*sizeof(TMsg)) return 0;
+			memcpy(row_, p, n_*sizeof(TMsg));
+			p += n_*sizeof(TMsg);
+		}
+		else
+		{
+			// stop at the first malformed column
+			((p = p ? DecodeColumn<TFields>(p, end, row_, n_) : nullptr), ...);
+			if (!p) return 0;
+		}
+		return (size_t) (p - in_);
+	}
+private:
+	template<typename TField>
+	static size_t MaxColumnSize(size_t n_)
+	{
+		if (TField::m_encoding == Encoding::RAW) return n_*sizeof(typename TField::ValueType);
+		return n_*Varint::m_maxBytes;
+	}
+	template<typename TField>
+	static char* EncodeColumn(const TMsg* row_, size_t n_, char* out_)
+	{
+		typedef typename TField::ValueType ValueType;
+		if constexpr (TField::m_encoding == Encoding::RAW)
+		{
+			for (size_t i = 0; i < n_; ++i, out_ += sizeof(ValueType))
+			{
+				const auto v = TField::Get(row_[i]);
+				memcpy(out_, &v, sizeof(v));
+			}
+		}
+		else
+		{
+			static_assert(std::is_integral<ValueType>::value, "DELTA_VARINT needs an integer field");
+			uint64_t prev = 0;
+			for (size_t i = 0; i < n_; ++i)
+			{
+				const auto v = (uint64_t) TField::Get(row_[i]);
+				out_ += Varint::Put(Varint::ZigZag(int64_t(v - prev)), out_);
+				prev = v;
+			}
+		}
+		return out_;
+	}
+	template<typename TField>
+	static const char* DecodeColumn(const char* in_, const char* end_, TMsg* row_, size_t n_)
+	{
+		typedef typename TField::ValueType ValueType;
+		if constexpr (TField::m_encoding == Encoding::RAW)
+		{
+			if ((size_t) (end_ - in_) < n_*sizeof(ValueType)) return nullptr;
+			for (size_t i = 0; i < n_; ++i, in_ += sizeof(ValueType))
+			{
+				ValueType v;
+				memcpy(&v, in_, sizeof(v));
+				TField::Set(row_[i], v);
+			}
+		}
+		else
+		{
+			uint64_t prev = 0;
+			for (size_t i = 0; i < n_; ++i)
+			{
+				// eight 1 byte varints, the usual case for monotonic columns, from one load
+				uint64_t x;
+				if (n_ - i >= 8 && end_ - in_ >= 8 && (memcpy(&x, in_, sizeof(x)), !(x & 0x8080808080808080ull)))
+				{
+					for (auto k = 0u; k < 8; ++k, x >>= 8)
+					{
+						prev += (uint64_t) Varint::UnZigZag(x & 0xff);
+						TField::Set(row_[i + k], (ValueType) prev);
+					}
+					in_ += 8;
+					i += 7;
+					continue;
+				}
+				uint64_t delta;
+				const auto read = Varint::Get(in_, end_, delta);
+				if (!read) return nullptr;
+				in_ += read;
+				prev += (uint64_t) Varint::UnZigZag(delta);
+				TField::Set(row_[i], (ValueType) prev);
+			}
+		}
+		return in_;
+	}
+};
+
+//! Codec copying messages as plain bytes.
+template<typename TMsg>
+using RawCodec = RowCodec<TMsg>;
+
+//! LZ77 block compressor in the LZ4 block format.
+
+//! A block is a sequence of (literals, match) pairs: a token byte holding
+// the literal length and match length - 4 in its two nibbles, extra length
+// bytes for values of 15 and more, the literals, and a 2 byte little endian
+// match offset. The last sequence has literals only.
+// Matches are found through a single hash table of 4 byte prefixes with
+// no chaining, trading ratio for speed; repetitive rows still compress well.
+// Decompression is bounds checked and rejects malformed input.
+class BlockCodec {
+	static const unsigned m_hashBits = 14;
+	static const size_t m_minMatch = 4;
+	//! a match must start at least this far from the end of the input
+	static const size_t m_matchStartLimit = 12;
+	//! the last bytes of the input are always literals
+	static const size_t m_lastLiterals = 5;
+	static const size_t m_maxOffset = 65535;
+public:
+	//! upper bound of the compressed size of n_ bytes
+	static size_t Bound(size_t n_) { return n_ + n_/255 + 16; }
+
+	//! compress src_[0, n_) into dst_, which has Bound(n_) bytes; return compressed size
+	static size_t Compress(const char* src_, size_t n_, char* dst_)
+	{
+		uint32_t table[1 << m_hashBits];
+		memset(table, 0, sizeof(table));
+		auto* op = dst_;
+		size_t ip = 0, anchor = 0;
+		if (n_ > m_matchStartLimit)
+		{
+			const auto matchStartEnd = n_ - m_matchStartLimit;
+			const auto matchEnd = n_ - m_lastLiterals;
+			ip = 1; // offset 0 is the empty table entry
+			while (ip < matchStartEnd)
+			{
+				const auto seq = Load32(src_ + ip);
+				auto& entry = table[Hash(seq)];
+				const size_t ref = entry;
+				entry = (uint32_t) ip;
+				if (!ref || ip - ref > m_maxOffset || Load32(src_ + ref) != seq)
+				{
+					// skip faster through input that does not compress
+					ip += 1 + ((ip - anchor) >> 6);
+					continue;
+				}
+				auto len = m_minMatch + MatchLength(src_ + ip + m_minMatch, src_ + ref + m_minMatch, src_ + matchEnd);
+				op = PutSequence(op, src_ + anchor, ip - anchor, ip - ref, len);
+				ip += len;
+				anchor = ip;
+				if (ip < matchStartEnd) table[Hash(Load32(src_ + ip - 2))] = (uint32_t) (ip - 2);
+			}
+		}
+		op = PutLiterals(op, src_ + anchor, n_ - anchor);
+		return (size_t) (op - dst_);
+	}
+	//! decompress src_[0, size_) into dst_, which has capacity_ bytes.
+	/*! \return decompressed size, 0 if the input is malformed or does not fit */
+	static size_t Decompress(const char* src_, size_t size_, char* dst_, size_t capacity_)
+	{
+		const auto* ip = (const unsigned char*) src_;
+		const auto* end = ip + size_;
+		auto* op = dst_;
+		auto* opEnd = dst_ + capacity_;
+		while (ip < end)
+		{
+			const auto token = *ip++;
+			size_t lit = token >> 4;
+			if (lit == 15 && !GetLength(ip, end, lit)) return 0;
+			if (lit > (size_t) (end - ip) || lit > (size_t) (opEnd - op)) return 0;
+			memcpy(op, ip, lit);
+			op += lit;
+			ip += lit;
+			if (ip == end) break; // last sequence
+			if (end - ip < 2) return 0;
+			const size_t offset = ip[0] | (size_t(ip[1]) << 8);
+			ip += 2;
+			size_t len = token & 15;
+			if (len == 15 && !GetLength(ip, end, len)) return 0;
+			len += m_minMatch;
+			if (!offset || offset > (size_t) (op - dst_) || len > (size_t) (opEnd - op)) return 0;
+			const auto* match = op - offset;
+			size_t i = 0;
+			if (offset >= 8)
+			{
+				// 8 byte chunks never overlap the bytes they are copied to
+				for (; i + 8 <= len; i += 8)
+					memcpy(op + i, match + i, 8);
+			}
+			for (; i < len; ++i)
+				op[i] = match[i];
+			op += len;
+		}
+		return (size_t) (op - dst_);
+	}
+private:
+	static uint32_t Load32(const char* p_)
+	{
+		uint32_t v;
+		memcpy(&v, p_, sizeof(v));
+		return v;
+	}
+	static uint32_t Hash(uint32_t seq_) { return (seq_*2654435761u) >> (32 - m_hashBits); }
+	//! number of equal bytes at a_ and b_, a_ not going past end_
+	static size_t MatchLength(const char* a_, const char* b_, const char* end_)
+	{
+		const auto* start = a_;
+		while (a_ + 8 <= end_)
+		{
+			uint64_t x, y;
+			memcpy(&x, a_, sizeof(x));
+			memcpy(&y, b_, sizeof(y));
+			if (x != y) return (size_t) (a_ - start) + (size_t) (__builtin_ctzll(x ^ y) >> 3);
+			a_ += 8;
+			b_ += 8;
+		}
+		while (a_ < end_ && *a_ == *b_)
+		{
+			++a_;
+			++b_;
+		}
+		return (size_t) (a_ - start);
+	}
+	//! write the extra bytes of a length of 15 or more
+	static char* PutLength(char* op_, size_t len_)
+	{
+		for (; len_ >= 255; len_ -= 255)
+			*op_++ = (char) 255;
+		*op_++ = (char) len_;
+		return op_;
+	}
+	//! add extra length bytes to len_; false if input ends
+	static bool GetLength(const unsigned char*& ip_, const unsigned char* end_, size_t& len_)
+	{
+		unsigned char b;
+		do {
+			if (ip_ == end_) return false;
+			b = *ip_++;
+			len_ += b;
+		} while (b == 255);
+		return true;
+	}
+	static char* PutSequence(char* op_, const char* lit_, size_t litLen_, size_t offset_, size_t len_)
+	{
+		const auto matchCode = len_ - m_minMatch;
+		*op_++ = (char) (((litLen_ < 15 ? litLen_ : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+		if (litLen_ >= 15) op_ = PutLength(op_, litLen_ - 15);
+		memcpy(op_, lit_, litLen_);
+		op_ += litLen_;
+		*op_++ = (char) (offset_ & 0xff);
+		*op_++ = (char) (offset_ >> 8);
+		if (matchCode >= 15) op_ = PutLength(op_, matchCode - 15);
+		return op_;
+	}
+	static char* PutLiterals(char* op_, const char* lit_, size_t litLen_)
+	{
+		*op_++ = (char) ((litLen_ < 15 ? litLen_ : 15) << 4);
+		if (litLen_ >= 15) op_ = PutLength(op_, litLen_ - 15);
+		memcpy(op_, lit_, litLen_);
+		return op_ + litLen_;
+	}
+};
+
+}
@@ -0,0 +1,219 @@
+/*! \file MCombining.h
+    \brief  Flat combining and NUMA cohort claims for MBuffer.
+
+	With many producers, every claim of a row reads and writes the shared
+	producer cursor, and the cache line holding it moves from core to core.
+	With flat combining, producers post their claims in per thread request
+	slots instead; one of them, the combiner, claims rows for all posted
+	requests with a single cursor update (MBuffer::GetNextLocsForProd)
+	and hands them out. Cursor traffic is then per batch, not per producer.
+	The same holds for consumers and the consumer cursor.
+
+	Cohort claims combine per NUMA node first, so only one thread per node
+	at a time touches the shared cursor.
+*/
+#pragma once
+
+#include "MBuffer.h"
+#include "MTopology.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace Messenger {
+
+//! cursor of the buffer that claims are combined for
+enum class ClaimSide { PRODUCER, CONSUMER };
+
+//! Producer or consumer claims of a buffer, combined.
+
+//! Each thread registers once for a request slot and then calls GetNextLoc
+// with it instead of the buffer's GetNextLocForProd or GetNextLocForCons.
+// Rows are released with the buffer's SetLocReadyForCons/SetLocReadyForProd
+// as usual. Threads claiming directly from the buffer may be mixed with
+// combined ones. A combined consumer claim waits until all rows of its
+// batch are published.
+template<typename TBuffer, ClaimSide TSide = ClaimSide::PRODUCER, size_t TMaxThreads = 64>
+class CombiningClaim {
+	//! request slot states; a granted slot holds the absolute location
+	static const int64_t m_idle = -1;
+	static const int64_t m_pending = -2;
+	static const int64_t m_stopped = -3;
+	//! a request slot per cache line, written by its thread and the combiner
+	struct alignas(64) Request {
+		std::atomic<int64_t>	m_state;
+	};
+	TBuffer&	m_buffer;
+	Request		m_requests[TMaxThreads];
+	//! number of registered threads
+	std::atomic<size_t>	m_numThreads;
+	//! 'true' while a thread is combining
+	alignas(64) std::atomic<bool>	m_combining;
+	//! batches combined and rows granted, for stats
+	std::atomic<size_t>	m_batches;
+	std::atomic<size_t>	m_rows;
+public:
+	//! ctor: combine the TSide claims of buffer_
+	CombiningClaim(TBuffer& buffer_) : m_buffer(buffer_)
+	{
+		for (auto& r : m_requests)
+			r.m_state.store(m_idle);
+		m_numThreads.store(0);
+		m_combining.store(false);
+		m_batches.store(0);
+		m_rows.store(0);
+	}
+	CombiningClaim(const CombiningClaim&) = delete;
+	CombiningClaim& operator=(const CombiningClaim&) = delete;
+
+	//! register a thread; returns its request slot. Throws if there are TMaxThreads already.
+	size_t Register()
+	{
+		const auto slot = m_numThreads.fetch_add(1);
+		if (slot >= TMaxThreads)
+		{
+			throw std::runtime_error("too many combining threads");
+		}
+		return slot;
+	}
+
+	//! get next loc to produce or consume, as MBuffer::GetNextLocForProd/GetNextLocForCons.
+	/*!
+	    Posts a request in slot_ and waits until a combiner grants a row;
+		if no thread is combining, this one becomes the combiner.
+
+		\param  [in ]   slot_    request slot from Register
+		\param  [out]   absLoc_  absolute location granted
+		\return         ring buffer location = absLoc_ % BufSize().
+		                size_t(-1) when the buffer is stopped.
+	*/
+	size_t GetNextLoc(size_t slot_, size_t& absLoc_)
+	{
+		auto& request = m_requests[slot_].m_state;
+		request.store(m_pending);
+		for (auto spins = 0u; ; ++spins)
+		{
+			const auto state = request.load(std::memory_order_acquire);
+			if (state != m_pending)
+			{
+				request.store(m_idle, std::memory_order_relaxed);
+				if (state == m_stopped)
+					return (size_t)(-1);
+				absLoc_ = (size_t) state;
+				return absLoc_ % m_buffer.BufSize();
+			}
+			if (!m_combining.load(std::memory_order_relaxed) && !m_combining.exchange(true, std::memory_order_acquire))
+			{
+				Combine();
+				m_combining.store(false, std::memory_order_release);
+				continue;
+			}
+			// a combiner is at work; let it run if it shares our core
+			if (spins % 64 == 63)
+				std::this_thread::yield();
+			else
+				TscClock::Pause();
+		}
+	}
+
+	//! batches combined so far
+	size_t NumBatches() const { return m_batches.load(); }
+	//! rows granted so far
+	size_t NumRows() const { return m_rows.load(); }
+private:
+	//! grant rows to all pending requests in one claim
+	void Combine()
+	{
+		const auto numThreads = m_numThreads.load() < TMaxThreads ? m_numThreads.load() : TMaxThreads;
+		size_t pending = 0;
+		for (size_t i = 0; i < numThreads; ++i)
+		{
+			if (m_requests[i].m_state.load(std::memory_order_relaxed) == m_pending)
+				++pending;
+		}
+		if (!pending) return;
+		if (pending > m_buffer.BufSize()) pending = m_buffer.BufSize();
+		const auto granted = pending;
+		size_t absLoc;
+		size_t loc;
+		if constexpr (TSide == ClaimSide::PRODUCER)
+			loc = m_buffer.GetNextLocsForProd(granted, absLoc);
+		else
+			loc = m_buffer.GetNextLocsForCons(granted, absLoc);
+		// as many requests as counted are granted; one posted since the
+		// count may take the place of a later one, which the next batch serves
+		for (size_t i = 0; i < numThreads && pending; ++i)
+		{
+			auto& request = m_requests[i].m_state;
+			if (request.load(std::memory_order_relaxed) != m_pending) continue;
+			request.store(loc >= m_buffer.BufSize() ? m_stopped : (int64_t) absLoc++, std::memory_order_release);
+			--pending;
+		}
+		m_batches.fetch_add(1, std::memory_order_relaxed);
+		if (loc < m_buffer.BufSize())
+			m_rows.fetch_add(granted, std::memory_order_relaxed);
+	}
+};
+
+//! Claims combined per NUMA node, then across nodes.
+
+//! Threads register on a node and post their claims to that node's
+// CombiningClaim. Only the node combiners claim from the buffer, each for
+// all waiting threads of its node, and split the batch among them; so the
+// cursor's cache line crosses sockets once per batch instead of once per
+// claim. A batch is a contiguous run of rows, so rows are still claimed
+// in global FIFO order.
+template<typename TBuffer, ClaimSide TSide = ClaimSide::PRODUCER, size_t TMaxThreadsPerNode = 64>
+class CohortClaim {
+	typedef CombiningClaim<TBuffer, TSide, TMaxThreadsPerNode> NodeClaim;
+	std::vector<std::unique_ptr<NodeClaim>>	m_nodes;
+public:
+	//! a registered thread: its node and its request slot there
+	struct Handle {
+		size_t	m_node;
+		size_t	m_slot;
+	};
+	//! ctor: a cohort per node of this host, or numNodes_ cohorts if not 0
+	CohortClaim(TBuffer& buffer_, size_t numNodes_ = 0)
+	{
+		const auto numNodes = numNodes_ ? numNodes_ : Topology::Get().NumNodes();
+		for (size_t i = 0; i < numNodes; ++i)
+			m_nodes.push_back(std::make_unique<NodeClaim>(buffer_));
+	}
+	//! register the calling thread in the cohort of the node it runs on.
+	/*! Throws if the cohort has TMaxThreadsPerNode threads already. */
+	Handle Register() { return Register(Topology::Get().CurrentNode()); }
+	//! register the calling thread in cohort node_ % NumNodes()
+	Handle Register(size_t node_)
+	{
+		const auto node = node_ % m_nodes.size();
+		return Handle{ node, m_nodes[node]->Register() };
+	}
+	//! get next loc, as CombiningClaim::GetNextLoc
+	size_t GetNextLoc(const Handle& handle_, size_t& absLoc_)
+	{
+		return m_nodes[handle_.m_node]->GetNextLoc(handle_.m_slot, absLoc_);
+	}
+	size_t NumNodes() const { return m_nodes.size(); }
+	//! batches claimed from the buffer so far, by all nodes
+	size_t NumBatches() const
+	{
+		size_t n = 0;
+		for (const auto& node : m_nodes)
+			n += node->NumBatches();
+		return n;
+	}
+	//! rows claimed so far, by all nodes
+	size_t NumRows() const
+	{
+		size_t n = 0;
+		for (const auto& node : m_nodes)
+			n += node->NumRows();
+		return n;
+	}
+};
+
+}
@@ -0,0 +1,371 @@
+/*! \file MFileSink.h
+    \brief  Asynchronous file sink consumer based on io_uring.
+
+	Consumed rows are written to a file straight from row memory; a row
+	is released to producers only when its write has completed.
+	Linux only; falls back to pwrite() where io_uring is unavailable.
+*/
+#pragma once
+
+#include "MBuffer.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace Messenger {
+
+//! Minimal io_uring: a submission and a completion ring set up with raw syscalls.
+
+//! Only what FileSink needs: queue writes, submit, reap completions.
+// Valid() is false when the kernel (or a seccomp policy) does not provide io_uring.
+class IoUring {
+	int			m_fd;
+	//! submission ring
+	void*		m_sqRing;
+	size_t		m_sqRingSize;
+	unsigned*	m_sqHead;
+	unsigned*	m_sqTail;
+	unsigned	m_sqMask;
+	unsigned*	m_sqArray;
+	io_uring_sqe*	m_sqes;
+	size_t		m_sqesSize;
+	//! completion ring; same mapping as m_sqRing with IORING_FEAT_SINGLE_MMAP
+	void*		m_cqRing;
+	size_t		m_cqRingSize;
+	unsigned*	m_cqHead;
+	unsigned*	m_cqTail;
+	unsigned	m_cqMask;
+	io_uring_cqe*	m_cqes;
+	//! sqes queued with Write and not yet passed to the kernel
+	unsigned	m_toSubmit;
+public:
+	IoUring(unsigned entries_) :
+		m_fd(-1), m_sqRing(MAP_FAILED), m_sqRingSize(0), m_sqes((io_uring_sqe*) MAP_FAILED),
+		m_sqesSize(0), m_cqRing(MAP_FAILED), m_cqRingSize(0), m_toSubmit(0)
+	{
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		m_fd = (int) syscall(__NR_io_uring_setup, entries_, &p);
+		if (m_fd < 0) return;
+		m_sqRingSize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+		m_cqRingSize = p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe);
+		const bool singleMmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (singleMmap && m_cqRingSize > m_sqRingSize) m_sqRingSize = m_cqRingSize;
+		m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+		m_cqRing = singleMmap ? m_sqRing : mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+		m_sqesSize = p.sq_entries*sizeof(io_uring_sqe);
+		m_sqes = (io_uring_sqe*) mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+		if (m_sqRing == MAP_FAILED || m_cqRing == MAP_FAILED || m_sqes == MAP_FAILED)
+		{
+			Close();
+			return;
+		}
+		auto* sq = (char*) m_sqRing;
+		m_sqHead = (unsigned*) (sq + p.sq_off.head);
+		m_sqTail = (unsigned*) (sq + p.sq_off.tail);
+		m_sqMask = *(unsigned*) (sq + p.sq_off.ring_mask);
+		m_sqArray = (unsigned*) (sq + p.sq_off.array);
+		auto* cq = (char*) m_cqRing;
+		m_cqHead = (unsigned*) (cq + p.cq_off.head);
+		m_cqTail = (unsigned*) (cq + p.cq_off.tail);
+		m_cqMask = *(unsigned*) (cq + p.cq_off.ring_mask);
+		m_cqes = (io_uring_cqe*) (cq + p.cq_off.cqes);
+	}
+	~IoUring()
+	{
+		Close();
+	}
+	IoUring(const IoUring&) = delete;
+	IoUring& operator=(const IoUring&) = delete;
+
+	bool Valid() const { return m_fd >= 0; }
+	//! queue a write of len_ bytes at addr_ to fd_ at offset off_. Caller keeps
+	//! the number of outstanding writes within the ring size.
+	void Write(int fd_, const void* addr_, unsigned len_, uint64_t off_, uint64_t userData_)
+	{
+		const auto tail = *m_sqTail;
+		const auto idx = tail & m_sqMask;
+		auto& sqe = m_sqes[idx];
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_WRITE;
+		sqe.fd = fd_;
+		sqe.addr = (uint64_t) (uintptr_t) addr_;
+		sqe.len = len_;
+		sqe.off = off_;
+		sqe.user_data = userData_;
+		m_sqArray[idx] = idx;
+		__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+		++m_toSubmit;
+	}
+	//! pass queued writes to the kernel and wait for at least minComplete_ completions.
+	/*! \return false on error */
+	bool Submit(unsigned minComplete_)
+	{
+		const unsigned flags = minComplete_ ? IORING_ENTER_GETEVENTS : 0;
+		while (true)
+		{
+			const auto n = syscall(__NR_io_uring_enter, m_fd, m_toSubmit, minComplete_, flags, nullptr, 0);
+			if (n >= 0)
+			{
+				m_toSubmit -= (unsigned) n;
+				return true;
+			}
+			if (errno != EINTR) return false;
+		}
+	}
+	//! take back the writes queued and not yet passed to the kernel, e.g. after
+	//! Submit failed: call f_(userData) for each; return their number
+	/*! Without SQPOLL the kernel reads sqes only within Submit, so they are stable here. */
+	template<typename TFunc>
+	size_t Unqueue(TFunc&& f_)
+	{
+		const auto head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+		const auto tail = *m_sqTail;
+		for (auto i = head; i != tail; ++i)
+			f_(m_sqes[m_sqArray[i & m_sqMask]].user_data);
+		__atomic_store_n(m_sqTail, head, __ATOMIC_RELEASE);
+		m_toSubmit = 0;
+		return tail - head;
+	}
+	//! call f_(userData, result) for each available completion; return their number
+	template<typename TFunc>
+	size_t Reap(TFunc&& f_)
+	{
+		size_t n = 0;
+		auto head = *m_cqHead;
+		while (head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE))
+		{
+			const auto& cqe = m_cqes[head & m_cqMask];
+			f_(cqe.user_data, cqe.res);
+			++head;
+			++n;
+		}
+		__atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+		return n;
+	}
+private:
+	void Close()
+	{
+		if (m_sqes != MAP_FAILED) munmap(m_sqes, m_sqesSize);
+		if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing) munmap(m_cqRing, m_cqRingSize);
+		if (m_sqRing != MAP_FAILED) munmap(m_sqRing, m_sqRingSize);
+		m_sqes = (io_uring_sqe*) MAP_FAILED;
+		m_sqRing = m_cqRing = MAP_FAILED;
+		if (m_fd >= 0) ::close(m_fd);
+		m_fd = -1;
+	}
+};
+
+//! File sink consumer: writes each consumed row to a file.
+
+//! The row memory itself is the I/O buffer, so nothing is copied: a row
+// stays claimed (READING) while its write is outstanding, and
+// SetLocReadyForProd is called only when the write completes.
+// Up to queueDepth_ writes are kept in flight.
+// A row at absolute location x is written at file offset x * row bytes,
+// so several sinks on one buffer can share a file: only the first one
+// created, before any of them runs, truncates it.
+// With directIO_ the file is opened with O_DIRECT, which requires rows
+// aligned to the logical block size: allocate the MBuffer on a page
+// boundary and use a row size that is a multiple of the page size.
+// When io_uring is not available, rows are written with pwrite() and
+// released at once.
+// Stop ends Run once the writes in flight have completed. It does not stop
+// the buffer, whose Stop hands every claimed row back to producers, the
+// rows being written included: stop the buffer after Run has returned.
+template<typename TBuffer>
+class FileSink {
+	typedef typename TBuffer::ValueType ValueType;
+	TBuffer&	m_buffer;
+	int			m_fd;
+	//! max writes in flight
+	unsigned	m_queueDepth;
+	std::unique_ptr<IoUring>	m_ring;
+	//! writes in flight
+	unsigned	m_inFlight;
+	//! rows written
+	std::atomic<size_t>	m_numRows;
+	//! first error (negative errno) or 0
+	int			m_error;
+	//! if 'true', Run stops consuming.
+	std::atomic<bool>	m_stop;
+public:
+	//! ctor: open (create, and truncate if truncate_) the output file.
+	/*!
+	    \param buffer_       buffer to consume from
+		\param path_         output file
+		\param queueDepth_   max writes in flight
+		\param directIO_     open with O_DIRECT
+		\param useIoUring_   false forces the pwrite() fallback
+		\param truncate_     false keeps the rows in the file, e.g. for the
+		                     sinks after the first on a shared file
+	*/
+	FileSink(TBuffer& buffer_, const std::string& path_, unsigned queueDepth_ = 32,
+		bool directIO_ = false, bool useIoUring_ = true, bool truncate_ = true) :
+		m_buffer(buffer_),
+		m_fd(-1),
+		m_queueDepth(queueDepth_ ? queueDepth_ : 1),
+		m_inFlight(0),
+		m_error(0)
+	{
+		m_numRows.store(0);
+		m_stop.store(false);
+		if (directIO_)
+		{
+			const auto pageSize = (size_t) sysconf(_SC_PAGESIZE);
+			if (((uintptr_t) m_buffer[0] % pageSize) || (RowBytes() % pageSize))
+			{
+				throw std::runtime_error("O_DIRECT needs page aligned rows");
+			}
+		}
+		m_fd = ::open(path_.c_str(), O_WRONLY | O_CREAT | (truncate_ ? O_TRUNC : 0) | (directIO_ ? O_DIRECT : 0), 0644);
+		if (m_fd < 0)
+		{
+			throw std::runtime_error("cannot open " + path_);
+		}
+		if (useIoUring_)
+		{
+			m_ring = std::make_unique<IoUring>(m_queueDepth);
+			if (!m_ring->Valid()) m_ring.reset();
+		}
+	}
+	~FileSink()
+	{
+		::close(m_fd);
+	}
+	FileSink(const FileSink&) = delete;
+	FileSink& operator=(const FileSink&) = delete;
+
+	//! consume and write rows until stopped. Returns after all writes completed.
+	/*! \return number of rows written */
+	size_t Run()
+	{
+		if (m_ring) RunIoUring();
+		else RunPwrite();
+		return m_numRows;
+	}
+	//! stop Run: called from some other thread. The buffer is left running.
+	void Stop()
+	{
+		m_stop = true;
+	}
+	//! rows written so far
+	size_t NumRows() const { return m_numRows.load(); }
+	//! true if rows are written through io_uring, false for the pwrite() fallback
+	bool UsesIoUring() const { return m_ring != nullptr; }
+	//! first write error as negative errno, or 0
+	int Error() const { return m_error; }
+private:
+	size_t RowBytes() const { return m_buffer.BufElemSize()*sizeof(ValueType); }
+
+	void RunIoUring()
+	{
+		while (!m_stop && !m_error)
+		{
+			// queue as many ready rows as the queue depth allows; wait for
+			// a row only when nothing is in flight
+			unsigned queued = 0;
+			while (m_inFlight < m_queueDepth)
+			{
+				size_t absLoc;
+				auto loc = NextRow(absLoc, m_inFlight == 0);
+				if (loc >= m_buffer.BufSize()) break;
+				m_ring->Write(m_fd, m_buffer[loc], (unsigned) RowBytes(),
+					(uint64_t) absLoc*RowBytes(), absLoc);
+				++m_inFlight;
+				++queued;
+			}
+			if (!m_inFlight) break; // stopped
+			// block for a completion only when no more rows could be queued
+			const unsigned minComplete = (m_inFlight == m_queueDepth || !queued) ? 1 : 0;
+			if (!m_ring->Submit(minComplete))
+			{
+				if (!m_error) m_error = -errno;
+				// writes the kernel has not taken are done here instead
+				m_ring->Unqueue([this](uint64_t absLoc_) { Release(absLoc_, WriteRow(absLoc_, 0)); });
+			}
+			Complete();
+		}
+		// reap the write of every claimed row before returning; should the
+		// ring fail to wait, its completions are polled for
+		while (m_inFlight)
+		{
+			if (Complete()) continue;
+			if (!m_ring->Submit(1))
+				std::this_thread::sleep_for(std::chrono::microseconds(1));
+		}
+	}
+	//! next row to write; waits for one, until stopped, only if wait_
+	size_t NextRow(size_t& absLoc_, bool wait_)
+	{
+		while (true)
+		{
+			const auto loc = m_buffer.TryGetNextLocForCons(absLoc_);
+			if (loc < m_buffer.BufSize() || !wait_ || m_stop || m_buffer.Stopped())
+				return loc;
+			std::this_thread::sleep_for(std::chrono::microseconds(1));
+		}
+	}
+	//! count the write of the row at absLoc_, with result res_, and release the row
+	void Release(size_t absLoc_, int res_)
+	{
+		if (res_ < 0) { if (!m_error) m_error = res_; }
+		else ++m_numRows;
+		m_buffer.SetLocReadyForProd(absLoc_);
+		--m_inFlight;
+	}
+	//! release rows whose write has completed; return their number
+	size_t Complete()
+	{
+		return m_ring->Reap([this](uint64_t absLoc_, int res_) {
+			auto res = res_;
+			if ((res >= 0) && ((size_t) res < RowBytes()))
+			{
+				// short write: finish synchronously
+				res = WriteRow(absLoc_, (size_t) res);
+			}
+			Release(absLoc_, res);
+		});
+	}
+	void RunPwrite()
+	{
+		while (!m_stop && !m_error)
+		{
+			size_t absLoc;
+			auto loc = NextRow(absLoc, true);
+			if (loc >= m_buffer.BufSize()) break;
+			const auto res = WriteRow(absLoc, 0);
+			if (res < 0) m_error = res;
+			else ++m_numRows;
+			m_buffer.SetLocReadyForProd(absLoc);
+		}
+	}
+	//! pwrite() row at absLoc_ from byte done_ on; return 0 or negative errno
+	int WriteRow(size_t absLoc_, size_t done_)
+	{
+		const auto* row = (const char*) m_buffer[absLoc_ % m_buffer.BufSize()];
+		const auto bytes = RowBytes();
+		while (done_ < bytes)
+		{
+			const auto n = ::pwrite(m_fd, row + done_, bytes - done_, (off_t) (absLoc_*bytes + done_));
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return n < 0 ? -errno : -EIO;
+			done_ += (size_t) n;
+		}
+		return 0;
+	}
+};
+
+}
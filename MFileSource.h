@@ -0,0 +1,232 @@
+/*! \file MFileSource.h
+    \brief  Zero-copy file ingestion into an MBuffer.
+
+	A producer that memory maps an input file and publishes rows of
+	record views (pointers into the mapping) instead of copying records.
+	POSIX only (mmap/madvise).
+*/
+#pragma once
+
+#include "MBuffer.h"
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Messenger {
+
+//! A record in a mapped file: pointer and length. Empty views pad rows.
+struct RecordView {
+	const char*	m_data;
+	size_t		m_length;
+	RecordView(const char* data_ = nullptr, size_t length_ = 0) :
+		m_data(data_), m_length(length_) {}
+	explicit operator bool() const { return m_data != nullptr; }
+};
+
+/*! \enum record framing in the input
+
+    FIXED_SIZE:       every record is frameSize bytes
+    LENGTH_PREFIXED:  each record is preceded by its length as a
+                      little endian unsigned integer of frameSize bytes (1 to 8).
+                      The view excludes the prefix.
+    DELIMITED:        each record ends with the byte frameSize, e.g. '\n'.
+                      The view excludes the delimiter. Input that ends
+                      without a delimiter ends with a last record.
+*/
+enum class Framing { FIXED_SIZE = 0, LENGTH_PREFIXED = 1, DELIMITED = 2 };
+
+//! check framing_ and frameSize_ are consistent; throw if not
+inline void CheckFraming(Framing framing_, size_t frameSize_)
+{
+	if ((framing_ != Framing::DELIMITED && frameSize_ == 0) ||
+		(framing_ == Framing::LENGTH_PREFIXED && frameSize_ > sizeof(uint64_t)) ||
+		(framing_ == Framing::DELIMITED && frameSize_ > 0xff))
+	{
+		throw std::runtime_error("invalid frame size");
+	}
+}
+
+//! frame the record at pos_ in data_[0, size_); advance pos_ past it.
+/*!
+    \param atEnd_  no more data follows data_: a DELIMITED record may end without delimiter
+	\return        false if no complete record starts at pos_
+*/
+inline bool FrameRecord(const char* data_, size_t size_, size_t& pos_,
+	Framing framing_, size_t frameSize_, bool atEnd_, RecordView& view_)
+{
+	const auto left = size_ - pos_;
+	switch (framing_)
+	{
+	case Framing::FIXED_SIZE:
+		if (left < frameSize_) return false;
+		view_ = RecordView(data_ + pos_, frameSize_);
+		pos_ += frameSize_;
+		return true;
+	case Framing::LENGTH_PREFIXED:
+	{
+		if (left < frameSize_) return false;
+		uint64_t length = 0;
+		for (auto i = 0u; i < frameSize_; ++i)
+			length |= uint64_t((unsigned char) data_[pos_ + i]) << (8*i);
+		if (left - frameSize_ < length) return false;
+		view_ = RecordView(data_ + pos_ + frameSize_, (size_t) length);
+		pos_ += frameSize_ + (size_t) length;
+		return true;
+	}
+	case Framing::DELIMITED:
+	{
+		if (!left) return false;
+		const auto* end = (const char*) memchr(data_ + pos_, (int) frameSize_, left);
+		if (!end)
+		{
+			if (!atEnd_) return false;
+			view_ = RecordView(data_ + pos_, left);
+			pos_ = size_;
+			return true;
+		}
+		view_ = RecordView(data_ + pos_, (size_t) (end - data_ - pos_));
+		pos_ += view_.m_length + 1;
+		return true;
+	}
+	}
+	return false;
+}
+
+//! File source: maps a file and publishes its records as RecordView rows.
+
+//! TBuffer::ValueType must be RecordView. The mapping is read only and
+// stays valid as long as the FileSource, so consumers must be done with
+// the views before it is destroyed.
+// The file is mapped with MADV_SEQUENTIAL, and the next readahead window
+// past the read position is requested with MADV_WILLNEED as records are published,
+// so page faults are mostly served from the page cache.
+template<typename TBuffer>
+class FileSource {
+	//! mapped file
+	const char*	m_map;
+	//! file size in bytes
+	size_t		m_size;
+	//! record framing
+	Framing		m_framing;
+	//! record size, prefix size or delimiter; see Framing
+	size_t		m_frameSize;
+	//! bytes requested ahead of the read position
+	size_t		m_readahead;
+	//! if 'true', Run stops publishing.
+	std::atomic<bool>	m_stop;
+public:
+	//! ctor: map file.
+	/*!
+	    \param path_       input file
+		\param framing_    record framing
+		\param frameSize_  record size, prefix size or delimiter; see Framing
+		\param readahead_  bytes requested ahead of the read position
+	*/
+	FileSource(const std::string& path_, Framing framing_, size_t frameSize_,
+		size_t readahead_ = 8*1024*1024) :
+		m_map(nullptr),
+		m_size(0),
+		m_framing(framing_),
+		m_frameSize(frameSize_),
+		m_readahead(readahead_)
+	{
+		m_stop.store(false);
+		CheckFraming(framing_, frameSize_);
+		const auto fd = ::open(path_.c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			throw std::runtime_error("cannot open " + path_);
+		}
+		struct stat st;
+		if (::fstat(fd, &st) != 0)
+		{
+			::close(fd);
+			throw std::runtime_error("cannot stat " + path_);
+		}
+		m_size = (size_t) st.st_size;
+		if (m_size)
+		{
+			::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			auto* map = ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (map == MAP_FAILED)
+			{
+				::close(fd);
+				throw std::runtime_error("cannot map " + path_);
+			}
+			m_map = (const char*) map;
+			::madvise(map, m_size, MADV_SEQUENTIAL);
+			::madvise(map, m_readahead < m_size ? m_readahead : m_size, MADV_WILLNEED);
+		}
+		// the mapping keeps the file referenced
+		::close(fd);
+	}
+	~FileSource()
+	{
+		if (m_map)
+			::munmap((void*) m_map, m_size);
+	}
+	FileSource(const FileSource&) = delete;
+	FileSource& operator=(const FileSource&) = delete;
+
+	//! publish all records of the file into buffer_, row by row.
+	/*!
+	    The last row is padded with empty views. A truncated last record is
+		not published, except for DELIMITED framing.
+		\return number of records published
+	*/
+	size_t Run(TBuffer& buffer_)
+	{
+		size_t pos = 0, numRecords = 0;
+		// start of the window not yet requested with MADV_WILLNEED
+		auto adviseEnd = m_readahead;
+		RecordView view;
+		auto more = Next(pos, view);
+		while (more && !m_stop)
+		{
+			size_t absLoc;
+			auto loc = buffer_.GetNextLocForProd(absLoc);
+			if (loc >= buffer_.BufSize()) break; // stopped
+			auto* row = buffer_[loc];
+			auto col = 0u;
+			for (; (col < buffer_.BufElemSize()) && more; ++col)
+			{
+				row[col] = view;
+				++numRecords;
+				more = Next(pos, view);
+			}
+			for (; col < buffer_.BufElemSize(); ++col)
+				row[col] = RecordView();
+			buffer_.SetLocReadyForCons(absLoc);
+			if (pos + m_readahead > adviseEnd && adviseEnd < m_size)
+			{
+				Advise(adviseEnd);
+				adviseEnd += m_readahead;
+			}
+		}
+		return numRecords;
+	}
+	//! stop Run: called from some other thread
+	void Stop() { m_stop = true; }
+	//! file size in bytes
+	size_t Size() const { return m_size; }
+private:
+	//! frame the record at pos_; advance pos_ past it
+	bool Next(size_t& pos_, RecordView& view_) const
+	{
+		return FrameRecord(m_map, m_size, pos_, m_framing, m_frameSize, true, view_);
+	}
+	//! request the readahead window starting at from_
+	void Advise(size_t from_) const
+	{
+		const auto pageSize = (size_t) ::sysconf(_SC_PAGESIZE);
+		from_ -= from_ % pageSize;
+		const auto len = (from_ + m_readahead < m_size) ? m_readahead : (m_size - from_);
+		::madvise((void*) (m_map + from_), len, MADV_WILLNEED);
+	}
+};
+
+}
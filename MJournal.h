@@ -0,0 +1,748 @@
+/*! \file MJournal.h
+    \brief  Segmented on-disk journal of MBuffer rows with background compression.
+
+	A JournalWriter consumes rows and appends them to segment files. Sealed
+	segments are compressed with BlockCodec by a compactor thread, off the
+	producer and consumer paths. A JournalCursor reads the rows back in
+	order, decompressing compressed segments transparently; a JournalReader
+	reads rows and ranges of rows at any retained absLoc.
+	POSIX only.
+*/
+#pragma once
+
+#include "MBuffer.h"
+#include "MCodec.h"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Messenger {
+
+//! Header of a compressed segment file.
+
+//! It is followed by m_numBlocks + 1 uint64_t file offsets: block i is
+// stored at [offset[i], offset[i + 1]) and holds rows
+// [i*m_blockRows, (i + 1)*m_blockRows) of the segment. A block that did not
+// compress is stored as it is, i.e. its stored size equals its raw size.
+struct JournalSegmentHeader {
+	static const uint64_t m_magicValue = 0x314e52554f4a424dull; // "MBJOURN1"
+	uint64_t	m_magic;
+	uint64_t	m_rowBytes;
+	uint64_t	m_firstAbsLoc;
+	uint64_t	m_numRows;
+	uint64_t	m_blockRows;
+	uint64_t	m_numBlocks;
+};
+
+//! Journal directory layout shared by JournalWriter and JournalCursor.
+
+//! A journal with segmentRows rows per segment stores the row at absolute
+// location absLoc in the segment starting at absLoc - absLoc % segmentRows.
+// Segment files are named after their first absLoc, zero padded so that
+// names sort by position:
+//   00000000000000004096.seg  raw rows, row i at offset i*rowBytes
+//   00000000000000004096.lz   compressed segment, see JournalSegmentHeader
+// The compactor writes a compressed segment to a temporary file, syncs it,
+// renames it into place, syncs the directory and only then removes the raw
+// file, so a segment is always readable in one of the two forms, also after
+// a crash.
+struct JournalLayout {
+	static std::string SegmentPath(const std::string& dir_, uint64_t first_, bool compressed_)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "%020llu", (unsigned long long) first_);
+		return dir_ + "/" + name + (compressed_ ? ".lz" : ".seg");
+	}
+	//! first absLocs of the segments in dir_, ascending
+	static std::vector<uint64_t> Segments(const std::string& dir_)
+	{
+		std::vector<uint64_t> segments;
+		auto* d = ::opendir(dir_.c_str());
+		if (!d) return segments;
+		while (auto* e = ::readdir(d))
+		{
+			unsigned long long first;
+			char ext[8];
+			if (strlen(e->d_name) <= 24 && sscanf(e->d_name, "%20llu.%7s", &first, ext) == 2 &&
+				(!strcmp(ext, "seg") || !strcmp(ext, "lz")))
+			{
+				segments.push_back(first);
+			}
+		}
+		::closedir(d);
+		std::sort(segments.begin(), segments.end());
+		segments.erase(std::unique(segments.begin(), segments.end()), segments.end());
+		return segments;
+	}
+};
+
+//! Consumer appending rows to a journal directory.
+
+//! Rows are written with pwrite at their position in the raw segment of
+// their absLoc, so the writer must be the only consumer of the buffer.
+// A segment is sealed when its last row is written, or when Run returns,
+// and is then queued to the compactor thread, which replaces it by its
+// compressed form. The writer never waits for the compactor.
+// A segment is never written twice: a writer that finds the segment of a
+// row already there, raw or compressed, e.g. after a restart on the same
+// directory, fails with -EEXIST rather than overwrite it.
+template<typename TBuffer>
+class JournalWriter {
+	typedef typename TBuffer::ValueType ValueType;
+	static_assert(std::is_trivially_copyable<ValueType>::value, "rows are written as bytes");
+	TBuffer&	m_buffer;
+	std::string	m_dir;
+	size_t		m_segmentRows;
+	//! rows per compressed block
+	size_t		m_blockRows;
+	bool		m_compress;
+	//! raw segment being written, -1 if none
+	int			m_fd;
+	//! first absLoc of the segment being written
+	uint64_t	m_segment;
+	//! rows written
+	std::atomic<size_t>	m_numRows;
+	//! first write error (negative errno) or 0
+	int			m_error;
+	//! raw and compressed bytes of the segments compacted so far
+	std::atomic<uint64_t>	m_rawBytes;
+	std::atomic<uint64_t>	m_compressedBytes;
+	//! guards m_sealed, m_compacting and m_stopCompactor
+	std::mutex	m_mutex;
+	std::condition_variable	m_cond;
+	//! sealed segments waiting for the compactor
+	std::deque<uint64_t>	m_sealed;
+	//! true while the compactor works on a segment
+	bool		m_compacting;
+	bool		m_stopCompactor;
+	std::thread	m_compactor;
+public:
+	//! ctor: creates dir_ if needed and starts the compactor thread.
+	/*!
+	    \param buffer_       buffer to consume from
+		\param dir_          journal directory
+		\param segmentRows_  rows per segment
+		\param compress_     false keeps raw segments and starts no compactor
+		\param blockBytes_   raw bytes per compressed block, rounded to whole rows
+	*/
+	JournalWriter(TBuffer& buffer_, const std::string& dir_, size_t segmentRows_ = 4096,
+		bool compress_ = true, size_t blockBytes_ = 64*1024) :
+		m_buffer(buffer_),
+		m_dir(dir_),
+		m_segmentRows(segmentRows_ ? segmentRows_ : 1),
+		m_blockRows(1),
+		m_compress(compress_),
+		m_fd(-1),
+		m_segment(0),
+		m_error(0),
+		m_compacting(false),
+		m_stopCompactor(false)
+	{
+		m_numRows.store(0);
+		m_rawBytes.store(0);
+		m_compressedBytes.store(0);
+		const auto rowBytes = RowBytes();
+		if (blockBytes_ > rowBytes) m_blockRows = blockBytes_/rowBytes;
+		if (::mkdir(m_dir.c_str(), 0755) != 0 && errno != EEXIST)
+		{
+			throw std::runtime_error("cannot create " + m_dir);
+		}
+		if (m_compress)
+			m_compactor = std::thread(ThreadFuncForCompactor, this);
+	}
+	//! dtor: seals the current segment and waits for the compactor to finish
+	~JournalWriter()
+	{
+		Seal();
+		if (m_compactor.joinable())
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stopCompactor = true;
+			}
+			m_cond.notify_all();
+			m_compactor.join();
+		}
+	}
+	JournalWriter(const JournalWriter&) = delete;
+	JournalWriter& operator=(const JournalWriter&) = delete;
+
+	//! consume and journal rows until the buffer is stopped
+	/*! \return number of rows written */
+	size_t Run()
+	{
+		const auto rowBytes = RowBytes();
+		while (!m_error)
+		{
+			size_t absLoc;
+			auto loc = m_buffer.GetNextLocForCons(absLoc);
+			if (loc >= m_buffer.BufSize()) break; // stopped
+			const auto segment = (uint64_t) (absLoc - absLoc % m_segmentRows);
+			if (m_fd < 0 || segment != m_segment)
+			{
+				Seal();
+				Open(segment);
+			}
+			if (m_fd >= 0)
+				WriteRow((const char*) m_buffer[loc], rowBytes, (absLoc - segment)*rowBytes);
+			m_buffer.SetLocReadyForProd(absLoc);
+			if (m_error) break;
+			++m_numRows;
+			if (absLoc + 1 == segment + m_segmentRows) Seal();
+		}
+		Seal();
+		return m_numRows;
+	}
+	//! stop Run: called from some other thread
+	void Stop() { m_buffer.Stop(); }
+	//! wait until the compactor has compressed all sealed segments
+	void Flush()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cond.wait(lock, [this]() { return m_sealed.empty() && !m_compacting; });
+	}
+	//! rows written so far
+	size_t NumRows() const { return m_numRows.load(); }
+	//! first write error as negative errno, or 0
+	int Error() const { return m_error; }
+	//! raw bytes of the segments compressed so far
+	uint64_t RawBytes() const { return m_rawBytes.load(); }
+	//! size of the compressed files written so far
+	uint64_t CompressedBytes() const { return m_compressedBytes.load(); }
+
+	// compactor thread: compress sealed segments until stopped and none is left
+	void RunCompactor()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
+		{
+			m_cond.wait(lock, [this]() { return m_stopCompactor || !m_sealed.empty(); });
+			if (m_sealed.empty()) break;
+			const auto segment = m_sealed.front();
+			m_sealed.pop_front();
+			m_compacting = true;
+			lock.unlock();
+			Compact(segment);
+			lock.lock();
+			m_compacting = false;
+			m_cond.notify_all();
+		}
+	}
+
+	// thread function: transfers control back to JournalWriter by calling RunCompactor method
+	static void ThreadFuncForCompactor(JournalWriter* w)
+	{
+		w->RunCompactor();
+	}
+private:
+	size_t RowBytes() const { return m_buffer.BufElemSize()*sizeof(ValueType); }
+	//! create the raw segment starting at segment_; fails if it exists in either form
+	void Open(uint64_t segment_)
+	{
+		m_segment = segment_;
+		struct stat st;
+		if (::stat(JournalLayout::SegmentPath(m_dir, segment_, true).c_str(), &st) == 0)
+		{
+			m_error = -EEXIST;
+			return;
+		}
+		m_fd = ::open(JournalLayout::SegmentPath(m_dir, segment_, false).c_str(),
+			O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (m_fd < 0) m_error = -errno;
+	}
+	void WriteRow(const char* row_, size_t size_, size_t offset_)
+	{
+		size_t done = 0;
+		while (done < size_)
+		{
+			const auto n = ::pwrite(m_fd, row_ + done, size_ - done, (off_t) (offset_ + done));
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0)
+			{
+				m_error = n < 0 ? -errno : -EIO;
+				return;
+			}
+			done += (size_t) n;
+		}
+	}
+	//! close the segment being written and queue it for compaction
+	void Seal()
+	{
+		if (m_fd < 0) return;
+		::close(m_fd);
+		m_fd = -1;
+		if (!m_compress) return;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_sealed.push_back(m_segment);
+		}
+		m_cond.notify_all();
+	}
+	//! replace raw segment first_ by its compressed form. On failure the raw segment stays.
+	void Compact(uint64_t first_)
+	{
+		const auto rawPath = JournalLayout::SegmentPath(m_dir, first_, false);
+		const auto rowBytes = RowBytes();
+		const auto fd = ::open(rawPath.c_str(), O_RDONLY);
+		if (fd < 0) return;
+		struct stat st;
+		const auto size = ::fstat(fd, &st) == 0 ? (size_t) st.st_size : 0;
+		const auto numRows = size/rowBytes;
+		void* map = numRows ? ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+		::close(fd);
+		if (map == MAP_FAILED) return;
+		::madvise(map, size, MADV_SEQUENTIAL);
+		const auto* raw = (const char*) map;
+		const auto numBlocks = (numRows + m_blockRows - 1)/m_blockRows;
+		JournalSegmentHeader header{ JournalSegmentHeader::m_magicValue, rowBytes, first_,
+			numRows, m_blockRows, numBlocks };
+		std::vector<uint64_t> offsets(numBlocks + 1);
+		const auto dataStart = sizeof(header) + offsets.size()*sizeof(uint64_t);
+		std::vector<char> out(dataStart);
+		std::vector<char> block(BlockCodec::Bound(m_blockRows*rowBytes));
+		for (size_t b = 0; b < numBlocks; ++b)
+		{
+			const auto rows = std::min(m_blockRows, numRows - b*m_blockRows);
+			const auto* src = raw + b*m_blockRows*rowBytes;
+			const auto rawSize = rows*rowBytes;
+			auto n = BlockCodec::Compress(src, rawSize, block.data());
+			offsets[b] = out.size();
+			if (n < rawSize)
+				out.insert(out.end(), block.data(), block.data() + n);
+			else
+				out.insert(out.end(), src, src + rawSize);
+		}
+		::munmap(map, size);
+		offsets[numBlocks] = out.size();
+		memcpy(out.data(), &header, sizeof(header));
+		memcpy(out.data() + sizeof(header), offsets.data(), offsets.size()*sizeof(uint64_t));
+		const auto path = JournalLayout::SegmentPath(m_dir, first_, true);
+		const auto tmpPath = path + ".tmp";
+		if (!WriteFile(tmpPath, out) || ::rename(tmpPath.c_str(), path.c_str()) != 0)
+		{
+			::unlink(tmpPath.c_str());
+			return;
+		}
+		// the compressed file must be in the directory on disk before the raw
+		// one leaves it; if not, both stay and readers take the compressed one
+		if (!SyncDir(m_dir)) return;
+		::unlink(rawPath.c_str());
+		m_rawBytes += numRows*rowBytes;
+		m_compressedBytes += out.size();
+	}
+	//! write data_ to a new file path_ with one sequential write, and sync it to disk
+	static bool WriteFile(const std::string& path_, const std::vector<char>& data_)
+	{
+		const auto fd = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) return false;
+		size_t done = 0;
+		while (done < data_.size())
+		{
+			const auto n = ::write(fd, data_.data() + done, data_.size() - done);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) break;
+			done += (size_t) n;
+		}
+		const auto synced = done == data_.size() && ::fsync(fd) == 0;
+		return (::close(fd) == 0) && synced;
+	}
+	//! sync the entries of directory dir_, e.g. a rename, to disk
+	static bool SyncDir(const std::string& dir_)
+	{
+		const auto fd = ::open(dir_.c_str(), O_RDONLY | O_DIRECTORY);
+		if (fd < 0) return false;
+		const auto synced = ::fsync(fd) == 0;
+		::close(fd);
+		return synced;
+	}
+};
+
+//! A journal segment file mapped for reading, raw or compressed.
+
+//! Row returns a row by its index in the segment. Rows of a compressed
+// segment are decompressed one block at a time into a block owned by the
+// segment; while blocks are read in order, the next prefetchBlocks_ blocks
+// are requested from the page cache with MADV_WILLNEED.
+class JournalSegment {
+	size_t		m_rowBytes;
+	size_t		m_prefetchBlocks;
+	//! mapped file, nullptr if none
+	const char*	m_map;
+	size_t		m_mapSize;
+	//! first absLoc and number of rows
+	uint64_t	m_first;
+	uint64_t	m_numRows;
+	//! header if compressed, else nullptr
+	const JournalSegmentHeader*	m_header;
+	const uint64_t*	m_offsets;
+	//! decompressed block m_blockIndex
+	std::vector<char>	m_block;
+	uint64_t	m_blockIndex;
+	//! true if the last Map found a damaged compressed file or Row a damaged block
+	bool		m_corrupt;
+public:
+	JournalSegment(size_t rowBytes_, size_t prefetchBlocks_) :
+		m_rowBytes(rowBytes_),
+		m_prefetchBlocks(prefetchBlocks_),
+		m_map(nullptr),
+		m_mapSize(0),
+		m_first(0),
+		m_numRows(0),
+		m_header(nullptr),
+		m_offsets(nullptr),
+		m_blockIndex(uint64_t(-1)),
+		m_corrupt(false)
+	{
+	}
+	~JournalSegment()
+	{
+		Unmap();
+	}
+	JournalSegment(const JournalSegment&) = delete;
+	JournalSegment& operator=(const JournalSegment&) = delete;
+
+	//! map segment first_ of dir_, compressed if it has been compacted
+	/*! \return false if it does not exist yet or is damaged, see Corrupt */
+	bool Map(const std::string& dir_, uint64_t first_)
+	{
+		Unmap();
+		m_corrupt = false;
+		// the compactor renames the compressed file into place before removing
+		// the raw one, so if neither exists the segment is being replaced: retry
+		for (auto compressed : { true, false, true })
+		{
+			const auto fd = ::open(JournalLayout::SegmentPath(dir_, first_, compressed).c_str(), O_RDONLY);
+			if (fd < 0) continue;
+			struct stat st;
+			const auto size = ::fstat(fd, &st) == 0 ? (size_t) st.st_size : 0;
+			void* map = size ? ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+			::close(fd);
+			if (map == MAP_FAILED)
+			{
+				// a raw segment may have no row yet; a compressed one is complete
+				m_corrupt = compressed && !size;
+				return false;
+			}
+			m_map = (const char*) map;
+			m_mapSize = size;
+			m_first = first_;
+			if (!compressed)
+			{
+				m_numRows = size/m_rowBytes;
+				::madvise(map, size, MADV_SEQUENTIAL);
+				return true;
+			}
+			m_header = (const JournalSegmentHeader*) m_map;
+			m_offsets = (const uint64_t*) (m_map + sizeof(JournalSegmentHeader));
+			if (!CheckHeader())
+			{
+				Unmap();
+				m_corrupt = true;
+				return false;
+			}
+			m_numRows = m_header->m_numRows;
+			m_block.resize(m_header->m_blockRows*m_rowBytes);
+			return true;
+		}
+		return false;
+	}
+	void Unmap()
+	{
+		if (m_map) ::munmap((void*) m_map, m_mapSize);
+		m_map = nullptr;
+		m_numRows = 0;
+		m_header = nullptr;
+		m_offsets = nullptr;
+		m_blockIndex = uint64_t(-1);
+	}
+	bool Mapped() const { return m_map != nullptr; }
+	//! true if mapped in compressed form, which is final
+	bool Compressed() const { return m_header != nullptr; }
+	uint64_t First() const { return m_first; }
+	uint64_t NumRows() const { return m_numRows; }
+	//! true if absLoc_ is held by the mapped segment
+	bool Holds(uint64_t absLoc_) const { return absLoc_ >= m_first && absLoc_ - m_first < m_numRows; }
+	//! true if the last Map failed on a damaged compressed file, or the last Row on a damaged block
+	bool Corrupt() const { return m_corrupt; }
+	//! row row_ of the segment, row_ < NumRows(); nullptr if its block is corrupt.
+	/*! The row stays valid until a row of another block is requested. */
+	const char* Row(uint64_t row_)
+	{
+		m_corrupt = false;
+		if (!m_header) return m_map + row_*m_rowBytes;
+		const auto block = row_/m_header->m_blockRows;
+		if (block != m_blockIndex && !LoadBlock(block))
+		{
+			m_corrupt = true;
+			return nullptr;
+		}
+		return m_block.data() + (row_ - block*m_header->m_blockRows)*m_rowBytes;
+	}
+private:
+	bool CheckHeader() const
+	{
+		if (m_mapSize < sizeof(JournalSegmentHeader)) return false;
+		const auto& h = *m_header;
+		if (h.m_magic != JournalSegmentHeader::m_magicValue || h.m_rowBytes != m_rowBytes ||
+			!h.m_blockRows || h.m_numBlocks != (h.m_numRows + h.m_blockRows - 1)/h.m_blockRows ||
+			(m_mapSize - sizeof(h))/sizeof(uint64_t) <= h.m_numBlocks)
+		{
+			return false;
+		}
+		for (uint64_t b = 0; b <= h.m_numBlocks; ++b)
+			if (m_offsets[b] > m_mapSize || (b && m_offsets[b] < m_offsets[b - 1])) return false;
+		return true;
+	}
+	//! decompress block_ and prefetch the blocks after it
+	bool LoadBlock(uint64_t block_)
+	{
+		const auto& h = *m_header;
+		const auto rows = std::min<uint64_t>(h.m_blockRows, h.m_numRows - block_*h.m_blockRows);
+		const auto rawSize = (size_t) (rows*m_rowBytes);
+		const auto* src = m_map + m_offsets[block_];
+		const auto size = (size_t) (m_offsets[block_ + 1] - m_offsets[block_]);
+		if (size == rawSize)
+			memcpy(m_block.data(), src, size);
+		else if (BlockCodec::Decompress(src, size, m_block.data(), rawSize) != rawSize)
+			return false;
+		// prefetch only while blocks are read in order
+		const auto sequential = block_ == m_blockIndex + 1;
+		m_blockIndex = block_;
+		const auto last = std::min<uint64_t>(block_ + 1 + m_prefetchBlocks, h.m_numBlocks);
+		if (sequential && block_ + 1 < last)
+		{
+			const auto pageSize = (size_t) ::sysconf(_SC_PAGESIZE);
+			auto from = (size_t) m_offsets[block_ + 1];
+			from -= from % pageSize;
+			::madvise((void*) (m_map + from), (size_t) m_offsets[last] - from, MADV_WILLNEED);
+		}
+		return true;
+	}
+};
+
+//! Reads the rows of a journal in absLoc order.
+
+//! Raw segments are read in place through a mapping; compressed segments
+// are decompressed one block at a time, with the blocks ahead prefetched
+// (see JournalSegment).
+// Next returns nullptr once all rows written so far have been read; it
+// can be called again later to follow a journal that is still written.
+// It also returns nullptr when the next row is in a damaged compressed
+// segment or block, which Error tells apart: the cursor does not skip it.
+template<typename TValue>
+class JournalCursor {
+	static_assert(std::is_trivially_copyable<TValue>::value, "rows are read as bytes");
+	std::string	m_dir;
+	//! absLoc of the next row
+	uint64_t	m_next;
+	//! segment holding m_next, if mapped
+	JournalSegment	m_segment;
+	//! -EIO if the row at m_next is damaged, else 0
+	int			m_error;
+public:
+	//! ctor
+	/*!
+	    \param dir_             journal directory
+		\param columns_         values per row
+		\param from_            absLoc of the first row to read; older rows no longer retained are skipped
+		\param prefetchBlocks_  compressed blocks requested ahead of the current one
+	*/
+	JournalCursor(const std::string& dir_, size_t columns_, uint64_t from_ = 0, size_t prefetchBlocks_ = 4) :
+		m_dir(dir_),
+		m_next(from_),
+		m_segment(columns_*sizeof(TValue), prefetchBlocks_),
+		m_error(0)
+	{
+	}
+	JournalCursor(const JournalCursor&) = delete;
+	JournalCursor& operator=(const JournalCursor&) = delete;
+
+	//! next row and its absLoc_; nullptr if no further row has been written
+	//! yet, or if it cannot be read (see Error).
+	/*! The row stays valid until the next call. */
+	const TValue* Next(uint64_t& absLoc_)
+	{
+		m_error = 0;
+		if (!m_segment.Holds(m_next) && !OpenSegment()) return nullptr;
+		const auto* row = m_segment.Row(m_next - m_segment.First());
+		if (!row)
+		{
+			m_error = -EIO;
+			return nullptr;
+		}
+		absLoc_ = m_next++;
+		return (const TValue*) row;
+	}
+	//! absLoc of the next row to read
+	uint64_t Position() const { return m_next; }
+	//! -EIO if the last Next returned nullptr because the segment or block
+	//! of the row at Position() is damaged; 0 if the row is not written yet
+	int Error() const { return m_error; }
+private:
+	//! map the segment holding m_next, or the first one after it; false if none has it yet
+	bool OpenSegment()
+	{
+		m_segment.Unmap();
+		const auto segments = JournalLayout::Segments(m_dir);
+		// last segment starting at or before m_next, else the first after it
+		auto it = std::upper_bound(segments.begin(), segments.end(), m_next);
+		if (it != segments.begin()) --it;
+		for (; it != segments.end(); ++it)
+		{
+			if (*it > m_next) m_next = *it;
+			if (m_segment.Map(m_dir, *it) && m_segment.Holds(m_next)) return true;
+			m_segment.Unmap();
+			// stop at a damaged segment rather than skip its rows
+			if (m_segment.Corrupt())
+			{
+				m_error = -EIO;
+				return false;
+			}
+		}
+		return false;
+	}
+};
+
+//! Random access to the rows of a journal by absLoc.
+
+//! A sparse index maps the first absLoc of each segment to the segment;
+// lookups are a binary search over it, then an offset computation within
+// the segment (and its block table, if compressed). The index grows
+// incrementally: only when a lookup falls past the end of the last indexed
+// segment does Refresh list the directory for segments sealed since.
+// Segments are mapped on first use and stay mapped; only the last one can
+// still grow, so Refresh remaps it alone if it is raw.
+template<typename TValue>
+class JournalReader {
+	static_assert(std::is_trivially_copyable<TValue>::value, "rows are read as bytes");
+	std::string	m_dir;
+	size_t		m_rowBytes;
+	size_t		m_prefetchBlocks;
+	//! first absLocs of the indexed segments, ascending
+	std::vector<uint64_t>	m_firsts;
+	//! segment of each m_firsts entry, mapped on first use
+	std::vector<std::unique_ptr<JournalSegment>>	m_segments;
+public:
+	//! ctor: indexes the segments present
+	/*!
+	    \param dir_             journal directory
+		\param columns_         values per row
+		\param prefetchBlocks_  compressed blocks requested ahead during scans
+	*/
+	JournalReader(const std::string& dir_, size_t columns_, size_t prefetchBlocks_ = 4) :
+		m_dir(dir_),
+		m_rowBytes(columns_*sizeof(TValue)),
+		m_prefetchBlocks(prefetchBlocks_)
+	{
+		Refresh();
+	}
+	JournalReader(const JournalReader&) = delete;
+	JournalReader& operator=(const JournalReader&) = delete;
+
+	//! row absLoc_; nullptr if it is not retained or not written yet.
+	/*! The row stays valid until the next call. */
+	const TValue* ReadAt(uint64_t absLoc_)
+	{
+		auto* segment = Find(absLoc_);
+		if (!segment && PastEnd(absLoc_))
+		{
+			Refresh();
+			segment = Find(absLoc_);
+		}
+		return segment ? (const TValue*) segment->Row(absLoc_ - segment->First()) : nullptr;
+	}
+	//! call f_(absLoc, row) for each retained row in [from_, to_), in order
+	/*! \return number of rows passed to f_ */
+	template<typename TFunc>
+	size_t Scan(uint64_t from_, uint64_t to_, TFunc&& f_)
+	{
+		size_t n = 0;
+		auto absLoc = from_;
+		while (absLoc < to_)
+		{
+			auto* segment = Find(absLoc);
+			if (!segment && PastEnd(absLoc))
+			{
+				Refresh();
+				segment = Find(absLoc);
+			}
+			if (!segment)
+			{
+				// not retained: continue with the next segment, if any
+				auto it = std::upper_bound(m_firsts.begin(), m_firsts.end(), absLoc);
+				if (it == m_firsts.end()) break;
+				absLoc = *it;
+				continue;
+			}
+			// rows of one segment are read sequentially without further lookups
+			const auto end = std::min(to_, segment->First() + segment->NumRows());
+			for (; absLoc < end; ++absLoc, ++n)
+			{
+				const auto* row = segment->Row(absLoc - segment->First());
+				if (!row) return n;
+				f_(absLoc, (const TValue*) row);
+			}
+		}
+		return n;
+	}
+	//! first retained absLoc, as of the last Refresh
+	uint64_t Begin() const { return m_firsts.empty() ? 0 : m_firsts.front(); }
+	//! index segments created or removed since the last call
+	void Refresh()
+	{
+		const auto segments = JournalLayout::Segments(m_dir);
+		// drop segments no longer retained
+		size_t dropped = 0;
+		while (dropped < m_firsts.size() &&
+			!std::binary_search(segments.begin(), segments.end(), m_firsts[dropped]))
+		{
+			++dropped;
+		}
+		m_firsts.erase(m_firsts.begin(), m_firsts.begin() + dropped);
+		m_segments.erase(m_segments.begin(), m_segments.begin() + dropped);
+		// the last raw segment may have grown; it is complete once a later one
+		// is listed, and a segment compacted since is still readable as mapped
+		if (!m_segments.empty() && m_segments.back()->Mapped() && !m_segments.back()->Compressed())
+			m_segments.back()->Unmap();
+		for (auto first : segments)
+		{
+			if (!m_firsts.empty() && first <= m_firsts.back()) continue;
+			m_firsts.push_back(first);
+			m_segments.push_back(std::make_unique<JournalSegment>(m_rowBytes, m_prefetchBlocks));
+		}
+	}
+private:
+	//! true if absLoc_ is past the rows of the last indexed segment, as mapped
+	bool PastEnd(uint64_t absLoc_)
+	{
+		if (m_firsts.empty()) return true;
+		auto& last = *m_segments.back();
+		if (!last.Mapped()) last.Map(m_dir, m_firsts.back());
+		return absLoc_ >= m_firsts.back() + last.NumRows();
+	}
+	//! mapped segment holding absLoc_, or nullptr: binary search over the index
+	JournalSegment* Find(uint64_t absLoc_)
+	{
+		auto it = std::upper_bound(m_firsts.begin(), m_firsts.end(), absLoc_);
+		if (it == m_firsts.begin()) return nullptr;
+		auto& segment = *m_segments[(size_t) (it - m_firsts.begin()) - 1];
+		if (!segment.Mapped() && !segment.Map(m_dir, *(it - 1))) return nullptr;
+		return segment.Holds(absLoc_) ? &segment : nullptr;
+	}
+};
+
+}
@@ -0,0 +1,241 @@
+/*! \file MMultiQueue.h
+    \brief  Relaxed concurrent priority queue (MultiQueue) fed from and
+	        draining into MBuffer rows.
+
+	c x P sequential binary heaps, each behind a try-lock. Push goes to a
+	random heap; PopMin samples two heaps and takes the smaller top of the
+	two. No heap is a hot spot, so throughput scales with threads, at the
+	price of popping an element that is not always the smallest: its rank
+	is O(c x P) on average. Elements move between the queue and MBuffer
+	rows a row at a time, under one lock.
+*/
+#pragma once
+
+#include "MBuffer.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace Messenger {
+
+//! An element of a MultiQueue: priority, smaller first, and value.
+
+//! Also the element type of MBuffer rows moved in and out of the queue.
+// An entry of priority m_empty pads a partially filled row.
+template<typename T>
+struct PriorityEntry {
+	static const uint64_t m_empty = UINT64_MAX;
+	uint64_t	m_priority = m_empty;
+	T			m_value = T();
+	bool operator>(const PriorityEntry& entry_) const { return m_priority > entry_.m_priority; }
+};
+
+//! Relaxed priority queue of c x P heaps of PriorityEntry<T>.
+
+//! Any thread may push and pop. The top of each heap is also kept in an
+// atomic, so the two heaps of a pop are compared without locking them.
+template<typename T>
+class MultiQueue {
+public:
+	typedef PriorityEntry<T> Entry;
+private:
+	//! a heap per cache line
+	struct alignas(64) Heap {
+		std::atomic<bool>		m_locked;
+		//! priority of the top entry; m_empty when empty
+		std::atomic<uint64_t>	m_top;
+		std::vector<Entry>		m_entries;
+	};
+	std::unique_ptr<Heap[]>	m_heaps;
+	size_t	m_numHeaps;
+	//! samples of a pop before it takes the queue to be empty
+	static const size_t m_maxSamples = 64;
+
+	//! per thread random generator
+	static std::minstd_rand& Random()
+	{
+		static thread_local std::minstd_rand rand(
+			(unsigned) std::hash<std::thread::id>()(std::this_thread::get_id()) | 1);
+		return rand;
+	}
+	bool TryLock(Heap& heap_)
+	{
+		return !heap_.m_locked.load(std::memory_order_relaxed) &&
+			!heap_.m_locked.exchange(true, std::memory_order_acquire);
+	}
+	void Unlock(Heap& heap_)
+	{
+		heap_.m_top.store(heap_.m_entries.empty() ? Entry::m_empty : heap_.m_entries.front().m_priority,
+			std::memory_order_relaxed);
+		heap_.m_locked.store(false, std::memory_order_release);
+	}
+	//! a random heap, locked
+	Heap& LockRandom()
+	{
+		for (;;)
+		{
+			auto& heap = m_heaps[Random()() % m_numHeaps];
+			if (TryLock(heap))
+				return heap;
+		}
+	}
+	//! the better of two random heaps, locked; nullptr when both look empty
+	Heap* LockBetterOfTwo()
+	{
+		for (;;)
+		{
+			auto* a = &m_heaps[Random()() % m_numHeaps];
+			auto* b = &m_heaps[Random()() % m_numHeaps];
+			if (b->m_top.load(std::memory_order_relaxed) < a->m_top.load(std::memory_order_relaxed))
+				std::swap(a, b);
+			if (a->m_top.load(std::memory_order_relaxed) == Entry::m_empty)
+				return nullptr;
+			if (!TryLock(*a))
+				continue;
+			if (!a->m_entries.empty())
+				return a;
+			// emptied meanwhile
+			Unlock(*a);
+		}
+	}
+	//! 'true' if every heap looks empty
+	bool LooksEmpty() const
+	{
+		for (size_t i = 0; i < m_numHeaps; ++i)
+		{
+			if (m_heaps[i].m_top.load(std::memory_order_relaxed) != Entry::m_empty)
+				return false;
+		}
+		return true;
+	}
+public:
+	//! ctor: c_ heaps per thread for numThreads_ threads
+	MultiQueue(size_t numThreads_, size_t c_ = 2) :
+		m_heaps(new Heap[numThreads_*c_]),
+		m_numHeaps(numThreads_*c_)
+	{
+		if (m_numHeaps == 0)
+		{
+			throw std::runtime_error("no heaps");
+		}
+		for (size_t i = 0; i < m_numHeaps; ++i)
+		{
+			m_heaps[i].m_locked.store(false);
+			m_heaps[i].m_top.store(Entry::m_empty);
+		}
+	}
+	MultiQueue(const MultiQueue&) = delete;
+	MultiQueue& operator=(const MultiQueue&) = delete;
+
+	size_t NumHeaps() const { return m_numHeaps; }
+
+	//! push value_ with priority_, smaller first; priority_ must not be Entry::m_empty
+	void Push(uint64_t priority_, const T& value_)
+	{
+		Entry entry;
+		entry.m_priority = priority_;
+		entry.m_value = value_;
+		PushBatch(&entry, 1);
+	}
+	//! push entries_[0..num_) into one random heap under one lock; empty entries are skipped
+	void PushBatch(const Entry* entries_, size_t num_)
+	{
+		auto& heap = LockRandom();
+		for (size_t i = 0; i < num_; ++i)
+		{
+			if (entries_[i].m_priority == Entry::m_empty) continue;
+			heap.m_entries.push_back(entries_[i]);
+			std::push_heap(heap.m_entries.begin(), heap.m_entries.end(), std::greater<Entry>());
+		}
+		Unlock(heap);
+	}
+
+	//! pop a small entry: the top of the better of two random heaps.
+	/*! \return false if the queue looked empty */
+	bool TryPopMin(uint64_t& priority_, T& value_)
+	{
+		Entry entry;
+		if (!PopBatch(&entry, 1))
+			return false;
+		priority_ = entry.m_priority;
+		value_ = entry.m_value;
+		return true;
+	}
+	//! pop up to max_ entries in priority order from the better of two random heaps, under one lock.
+	/*!
+	    The entries after the first come from the same heap, so their rank
+		error grows with max_.
+	    \return number of entries popped; 0 if the queue looked empty
+	*/
+	size_t PopBatch(Entry* entries_, size_t max_)
+	{
+		for (size_t samples = 0; samples < m_maxSamples; ++samples)
+		{
+			auto* heap = LockBetterOfTwo();
+			if (!heap)
+			{
+				if (LooksEmpty()) return 0;
+				continue;
+			}
+			size_t n = 0;
+			for (; n < max_ && !heap->m_entries.empty(); ++n)
+			{
+				std::pop_heap(heap->m_entries.begin(), heap->m_entries.end(), std::greater<Entry>());
+				entries_[n] = heap->m_entries.back();
+				heap->m_entries.pop_back();
+			}
+			Unlock(*heap);
+			return n;
+		}
+		return 0;
+	}
+
+	//! move one row of entries from buffer_, if one is ready, into one heap.
+	/*! \return number of entries in the row, padding included; 0 if none was ready or buffer_ is stopped */
+	template<typename TBuffer>
+	size_t PushFrom(TBuffer& buffer_)
+	{
+		size_t absLoc;
+		const auto loc = buffer_.TryGetNextLocForCons(absLoc);
+		if (loc >= buffer_.BufSize())
+			return 0;
+		PushBatch(buffer_[loc], buffer_.BufElemSize());
+		buffer_.SetLocReadyForProd(absLoc);
+		return buffer_.BufElemSize();
+	}
+	//! pop a row of up to buffer_.BufElemSize() entries (PopBatch) and publish it in buffer_.
+	/*!
+	    Waits for a free row of buffer_ only once entries are popped; the
+		rest of a partially filled row is padded with empty entries.
+		\return number of entries published; 0 if the queue looked empty or
+		        buffer_ is stopped (the popped entries are pushed back)
+	*/
+	template<typename TBuffer>
+	size_t PopTo(TBuffer& buffer_)
+	{
+		// staged, as a claimed row cannot be handed back unpublished
+		static thread_local std::vector<Entry> row;
+		row.assign(buffer_.BufElemSize(), Entry());
+		const auto n = PopBatch(row.data(), row.size());
+		if (!n)
+			return 0;
+		size_t absLoc;
+		const auto loc = buffer_.GetNextLocForProd(absLoc);
+		if (loc >= buffer_.BufSize())
+		{
+			PushBatch(row.data(), n);
+			return 0;
+		}
+		std::copy(row.begin(), row.end(), buffer_[loc]);
+		buffer_.SetLocReadyForCons(absLoc);
+		return n;
+	}
+};
+
+}
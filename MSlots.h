@@ -0,0 +1,269 @@
+/*! \file MSlots.h
+    \brief  Per row slot state of MBuffer: status and absolute location.
+
+	A slot holds the status of a ring buffer row and the absolute location
+	the row is associated with. MBuffer claims a row by changing its slot,
+	so the layout of the slots decides how many atomics a claim takes.
+	Three layouts with the same interface are provided:
+
+	SplitSlots:  two arrays, one of statuses and one of absolute locations.
+	             A claim is a CAS on the status followed by a separate load
+	             (consumer) or store (producer) of the absolute location.
+	PackedSlots: status and absolute location packed into one 64 bit word
+	             (61 bits of absolute location). A claim is a single CAS.
+	WideSlots:   status and absolute location side by side in one 16 byte
+	             aligned word, updated with a 128 bit CAS (cmpxchg16b).
+	             A claim is a single CAS without narrowing the location.
+	             Needs a 128 bit integer type and GCC atomic builtins: only
+	             defined where __SIZEOF_INT128__ is (GCC, Clang; not MSVC).
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace Messenger {
+
+/*! \enum slot status
+
+    READY_FOR_WRITE: available to write
+    WRITING:			being written
+    READY_FOR_READ:	available to read
+    READING:			being read
+    CONSUMED:		read ahead of the consumer cursor, which is yet to pass it
+					(see MBuffer::GetNextLocForConsNear)
+*/
+enum class	SlotStatus: long {READY_FOR_WRITE = 0, WRITING=1, READY_FOR_READ=2,
+	                      READING=3, CONSUMED=4};
+
+//! hint the CPU to fetch the cache line at address_, for writing if write_
+inline void PrefetchLine(const void* address_, bool write_ = false)
+{
+#if defined(__GNUC__)
+	if (write_)
+		__builtin_prefetch(address_, 1);
+	else
+		__builtin_prefetch(address_, 0);
+#elif defined(_MSC_VER)
+	(void) write_;
+	_mm_prefetch((const char*) address_, _MM_HINT_T0);
+#endif
+}
+
+//! Status and absolute location in two separate arrays.
+
+//! The default layout of MBuffer. A consumer claim and its check of the
+// absolute location are two atomics, and so are a producer claim and the
+// store of the absolute location: they may be interleaved with other
+// threads, which MBuffer accounts for.
+template<size_t TSize>
+class SplitSlots {
+	std::atomic<SlotStatus>	m_status[TSize];
+	std::atomic<int64_t>	m_absLoc[TSize];
+public:
+	//! set slot loc_ to absLoc_ and status_; not a claim
+	void Store(size_t loc_, int64_t absLoc_, SlotStatus status_)
+	{
+		m_absLoc[loc_].store(absLoc_);
+		m_status[loc_].store(status_);
+	}
+	SlotStatus GetStatus(size_t loc_) const { return m_status[loc_].load(); }
+	//! prefetch slot loc_ for a claim
+	void Prefetch(size_t loc_) const
+	{
+		PrefetchLine(&m_status[loc_], true);
+		PrefetchLine(&m_absLoc[loc_]);
+	}
+	//! set the status of slot loc_, claimed by the caller
+	void SetStatus(size_t loc_, SlotStatus status_) { m_status[loc_].store(status_); }
+	//! claim slot loc_ for writing absLoc_: READY_FOR_WRITE -> WRITING
+	bool ClaimForWrite(size_t loc_, int64_t)
+	{
+		auto expected = SlotStatus::READY_FOR_WRITE;
+		return m_status[loc_].compare_exchange_strong(expected, SlotStatus::WRITING);
+	}
+	//! associate claimed slot loc_ with absLoc_
+	void Bind(size_t loc_, int64_t absLoc_) { m_absLoc[loc_].store(absLoc_); }
+	//! claim slot loc_ for writing absLoc_ as ClaimForWrite, only if it is
+	//! associated with an earlier location: absLoc_ is claimed at most once
+	bool ClaimForWriteOnce(size_t loc_, int64_t absLoc_)
+	{
+		auto expected = SlotStatus::READY_FOR_WRITE;
+		if (!m_status[loc_].compare_exchange_strong(expected, SlotStatus::WRITING))
+			return false;
+		if (m_absLoc[loc_].load() < absLoc_)
+			return true;
+		m_status[loc_].store(SlotStatus::READY_FOR_WRITE);
+		return false;
+	}
+	//! absolute location and status of slot loc_, loaded in that order
+	void Load(size_t loc_, int64_t& absLoc_, SlotStatus& status_) const
+	{
+		absLoc_ = m_absLoc[loc_].load();
+		status_ = m_status[loc_].load();
+	}
+	//! claim slot loc_ for reading absLoc_: READY_FOR_READ -> READING,
+	//! only if loc_ is still associated with absLoc_
+	bool ClaimForRead(size_t loc_, int64_t absLoc_)
+	{
+		auto expected = SlotStatus::READY_FOR_READ;
+		if (!m_status[loc_].compare_exchange_strong(expected, SlotStatus::READING))
+			return false;
+		if (m_absLoc[loc_].load() == absLoc_)
+			return true;
+		// absLoc_ was consumed already and the row refilled for a later location
+		m_status[loc_].store(SlotStatus::READY_FOR_READ);
+		return false;
+	}
+	//! pass slot loc_, consumed ahead of the cursor: CONSUMED -> READY_FOR_WRITE,
+	//! only if loc_ is still associated with absLoc_
+	bool PassConsumed(size_t loc_, int64_t absLoc_)
+	{
+		auto expected = SlotStatus::CONSUMED;
+		if (!m_status[loc_].compare_exchange_strong(expected, SlotStatus::READING))
+			return false;
+		const auto passed = m_absLoc[loc_].load() == absLoc_;
+		m_status[loc_].store(passed ? SlotStatus::READY_FOR_WRITE : SlotStatus::CONSUMED);
+		return passed;
+	}
+};
+
+//! Status and absolute location packed into one 64 bit word.
+
+//! The word is (absLoc + 1) << 3 | status, so absolute locations are limited
+// to 2^61 - 1 and -1, for a slot not yet associated, packs to 0.
+template<size_t TSize>
+class PackedSlots {
+	std::atomic<uint64_t>	m_slots[TSize];
+
+	static uint64_t Pack(int64_t absLoc_, SlotStatus status_)
+	{
+		return ((uint64_t) (absLoc_ + 1) << 3) | (uint64_t) status_;
+	}
+	static SlotStatus StatusOf(uint64_t slot_) { return (SlotStatus) (slot_ & 7); }
+	static int64_t AbsLocOf(uint64_t slot_) { return (int64_t) (slot_ >> 3) - 1; }
+public:
+	void Store(size_t loc_, int64_t absLoc_, SlotStatus status_) { m_slots[loc_].store(Pack(absLoc_, status_)); }
+	SlotStatus GetStatus(size_t loc_) const { return StatusOf(m_slots[loc_].load()); }
+	void Prefetch(size_t loc_) const { PrefetchLine(&m_slots[loc_], true); }
+	void SetStatus(size_t loc_, SlotStatus status_)
+	{
+		auto slot = m_slots[loc_].load();
+		while (!m_slots[loc_].compare_exchange_weak(slot, (slot & ~(uint64_t) 7) | (uint64_t) status_))
+			;
+	}
+	//! claim and associate with absLoc_ in one CAS
+	bool ClaimForWrite(size_t loc_, int64_t absLoc_)
+	{
+		auto slot = m_slots[loc_].load();
+		return StatusOf(slot) == SlotStatus::READY_FOR_WRITE &&
+			m_slots[loc_].compare_exchange_strong(slot, Pack(absLoc_, SlotStatus::WRITING));
+	}
+	void Bind(size_t, int64_t) {}
+	bool ClaimForWriteOnce(size_t loc_, int64_t absLoc_)
+	{
+		auto slot = m_slots[loc_].load();
+		return StatusOf(slot) == SlotStatus::READY_FOR_WRITE && AbsLocOf(slot) < absLoc_ &&
+			m_slots[loc_].compare_exchange_strong(slot, Pack(absLoc_, SlotStatus::WRITING));
+	}
+	void Load(size_t loc_, int64_t& absLoc_, SlotStatus& status_) const
+	{
+		const auto slot = m_slots[loc_].load();
+		absLoc_ = AbsLocOf(slot);
+		status_ = StatusOf(slot);
+	}
+	//! claim and check the association in one CAS
+	bool ClaimForRead(size_t loc_, int64_t absLoc_)
+	{
+		auto expected = Pack(absLoc_, SlotStatus::READY_FOR_READ);
+		return m_slots[loc_].compare_exchange_strong(expected, Pack(absLoc_, SlotStatus::READING));
+	}
+	bool PassConsumed(size_t loc_, int64_t absLoc_)
+	{
+		auto expected = Pack(absLoc_, SlotStatus::CONSUMED);
+		return m_slots[loc_].compare_exchange_strong(expected, Pack(absLoc_, SlotStatus::READY_FOR_WRITE));
+	}
+};
+
+#if defined(__SIZEOF_INT128__)
+//! Status and absolute location in one 16 byte word updated with a 128 bit CAS.
+
+//! With -mcx16 (x86-64) the CAS is an inline lock cmpxchg16b; otherwise
+// it goes through libatomic (link with -latomic), which may use a lock.
+// Plain loads of a half are only hints for the expected value of a CAS,
+// so a torn read makes the CAS fail rather than succeed wrongly.
+template<size_t TSize>
+class WideSlots {
+	union alignas(16) Slot {
+		unsigned __int128	m_word;
+		//! absolute location, status
+		int64_t				m_half[2];
+	};
+	Slot	m_slots[TSize];
+
+	static unsigned __int128 Pack(int64_t absLoc_, SlotStatus status_)
+	{
+		return ((unsigned __int128) (uint64_t) status_ << 64) | (uint64_t) absLoc_;
+	}
+	bool Cas(size_t loc_, unsigned __int128 expected_, unsigned __int128 desired_)
+	{
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_16
+		return __sync_bool_compare_and_swap(&m_slots[loc_].m_word, expected_, desired_);
+#else
+		return __atomic_compare_exchange_n(&m_slots[loc_].m_word, &expected_, desired_, false,
+			__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+	}
+	int64_t LoadHalf(size_t loc_, int half_) const
+	{
+		return __atomic_load_n(&m_slots[loc_].m_half[half_], __ATOMIC_ACQUIRE);
+	}
+public:
+	void Store(size_t loc_, int64_t absLoc_, SlotStatus status_)
+	{
+		while (!Cas(loc_, Pack(LoadHalf(loc_, 0), (SlotStatus) LoadHalf(loc_, 1)), Pack(absLoc_, status_)))
+			;
+	}
+	SlotStatus GetStatus(size_t loc_) const { return (SlotStatus) LoadHalf(loc_, 1); }
+	void Prefetch(size_t loc_) const { PrefetchLine(&m_slots[loc_], true); }
+	void SetStatus(size_t loc_, SlotStatus status_)
+	{
+		int64_t absLoc;
+		do
+		{
+			absLoc = LoadHalf(loc_, 0);
+		} while (!Cas(loc_, Pack(absLoc, (SlotStatus) LoadHalf(loc_, 1)), Pack(absLoc, status_)));
+	}
+	bool ClaimForWrite(size_t loc_, int64_t absLoc_)
+	{
+		return GetStatus(loc_) == SlotStatus::READY_FOR_WRITE &&
+			Cas(loc_, Pack(LoadHalf(loc_, 0), SlotStatus::READY_FOR_WRITE), Pack(absLoc_, SlotStatus::WRITING));
+	}
+	void Bind(size_t, int64_t) {}
+	bool ClaimForWriteOnce(size_t loc_, int64_t absLoc_)
+	{
+		const auto absLoc = LoadHalf(loc_, 0);
+		return absLoc < absLoc_ &&
+			Cas(loc_, Pack(absLoc, SlotStatus::READY_FOR_WRITE), Pack(absLoc_, SlotStatus::WRITING));
+	}
+	void Load(size_t loc_, int64_t& absLoc_, SlotStatus& status_) const
+	{
+		absLoc_ = LoadHalf(loc_, 0);
+		status_ = (SlotStatus) LoadHalf(loc_, 1);
+	}
+	bool ClaimForRead(size_t loc_, int64_t absLoc_)
+	{
+		return Cas(loc_, Pack(absLoc_, SlotStatus::READY_FOR_READ), Pack(absLoc_, SlotStatus::READING));
+	}
+	bool PassConsumed(size_t loc_, int64_t absLoc_)
+	{
+		return Cas(loc_, Pack(absLoc_, SlotStatus::CONSUMED), Pack(absLoc_, SlotStatus::READY_FOR_WRITE));
+	}
+};
+#endif // __SIZEOF_INT128__
+
+}
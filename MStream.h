@@ -0,0 +1,312 @@
+/*! \file MStream.h
+    \brief  Pipe/stdin source and stdout sink for MBuffer byte rows.
+
+	For command line pipelines: capture | ingest into MBuffer | ... | stdout.
+	Linux only (vmsplice).
+*/
+#pragma once
+
+#include "MFileSource.h"
+#include <cerrno>
+#include <deque>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+namespace Messenger {
+
+//! Layout of a byte row exchanged by StreamSource and StreamSink.
+
+//! TBuffer::ValueType is char. The first m_headerSize bytes of a row hold
+// the payload length; the payload follows and always holds whole records.
+struct StreamRow {
+	typedef uint32_t LengthType;
+	static const size_t m_headerSize = sizeof(LengthType);
+	static size_t Length(const char* row_)
+	{
+		LengthType length;
+		memcpy(&length, row_, sizeof(length));
+		return length;
+	}
+	static void Length(char* row_, size_t length_)
+	{
+		const auto length = LengthType(length_);
+		memcpy(row_, &length, sizeof(length));
+	}
+	static const char* Payload(const char* row_) { return row_ + m_headerSize; }
+	static char* Payload(char* row_) { return row_ + m_headerSize; }
+};
+
+//! Source producer: reads a pipe (by default stdin) directly into row memory.
+
+//! Each read() goes straight into the payload area of a claimed row, so
+// bytes are never staged in a separate buffer. A row is published with
+// the records that are complete in it; the partial record at its end,
+// if any, is carried to the start of the next row, so records never
+// straddle rows. A record larger than a row payload is an error.
+// splice() cannot target user memory, so the input side uses plain reads
+// of up to a whole row; StreamSink uses vmsplice on the output side.
+template<typename TBuffer>
+class StreamSource {
+	//! input file descriptor
+	int			m_fd;
+	//! record framing
+	Framing		m_framing;
+	//! record size, prefix size or delimiter; see Framing
+	size_t		m_frameSize;
+	//! rows published
+	std::atomic<size_t>	m_numRows;
+	//! first error (negative errno) or 0
+	int			m_error;
+	//! if 'true', Run stops reading.
+	std::atomic<bool>	m_stop;
+public:
+	//! ctor
+	/*!
+	    \param framing_    record framing
+		\param frameSize_  record size, prefix size or delimiter; see Framing
+		\param fd_         input file descriptor
+	*/
+	StreamSource(Framing framing_, size_t frameSize_, int fd_ = STDIN_FILENO) :
+		m_fd(fd_),
+		m_framing(framing_),
+		m_frameSize(frameSize_),
+		m_error(0)
+	{
+		CheckFraming(framing_, frameSize_);
+		m_numRows.store(0);
+		m_stop.store(false);
+		// larger pipe buffer: fewer, larger reads
+		fcntl(m_fd, F_SETPIPE_SZ, 1024*1024);
+	}
+	//! read until end of input and publish rows into buffer_
+	/*! \return number of rows published */
+	size_t Run(TBuffer& buffer_)
+	{
+		const auto capacity = buffer_.BufElemSize() - StreamRow::m_headerSize;
+		std::vector<char> carry;
+		auto eof = false;
+		while (!eof && !m_stop)
+		{
+			size_t absLoc;
+			auto loc = buffer_.GetNextLocForProd(absLoc);
+			if (loc >= buffer_.BufSize()) break; // stopped
+			auto* row = buffer_[loc];
+			auto* payload = StreamRow::Payload(row);
+			memcpy(payload, carry.data(), carry.size());
+			auto length = carry.size();
+			size_t end = 0;
+			// read until the row holds at least one complete record
+			while (!end && !eof && !m_stop)
+			{
+				if (length == capacity)
+				{
+					m_error = -EMSGSIZE; // record larger than a row
+					break;
+				}
+				const auto n = ::read(m_fd, payload + length, capacity - length);
+				if (n < 0 && errno == EINTR) continue;
+				if (n < 0) m_error = -errno;
+				if (n <= 0) eof = true;
+				else length += (size_t) n;
+				end = CompleteRecords(payload, length, eof);
+			}
+			carry.assign(payload + end, payload + length);
+			StreamRow::Length(row, end);
+			buffer_.SetLocReadyForCons(absLoc);
+			++m_numRows;
+			if (m_error) break;
+		}
+		return m_numRows;
+	}
+	//! call f_(RecordView) for each record in row_; return their number
+	template<typename TFunc>
+	size_t ForEachRecord(const char* row_, TFunc&& f_) const
+	{
+		const auto* payload = StreamRow::Payload(row_);
+		const auto length = StreamRow::Length(row_);
+		size_t pos = 0, n = 0;
+		RecordView view;
+		while (FrameRecord(payload, length, pos, m_framing, m_frameSize, true, view))
+		{
+			f_(view);
+			++n;
+		}
+		return n;
+	}
+	//! stop Run: called from some other thread. Takes effect after the current read.
+	void Stop() { m_stop = true; }
+	//! rows published so far
+	size_t NumRows() const { return m_numRows.load(); }
+	//! first read error as negative errno, or 0
+	int Error() const { return m_error; }
+private:
+	//! length of the complete records at the start of payload_[0, length_)
+	size_t CompleteRecords(const char* payload_, size_t length_, bool eof_) const
+	{
+		if (m_framing == Framing::DELIMITED)
+		{
+			if (eof_) return length_;
+			const auto* last = (const char*) memrchr(payload_, (int) m_frameSize, length_);
+			return last ? (size_t) (last - payload_) + 1 : 0;
+		}
+		size_t pos = 0;
+		RecordView view;
+		while (FrameRecord(payload_, length_, pos, m_framing, m_frameSize, eof_, view))
+			;
+		return pos;
+	}
+};
+
+//! Sink consumer: writes row payloads to a file descriptor, by default stdout.
+
+//! When the output is a pipe the payload is passed with vmsplice, which
+// maps the row pages into the pipe instead of copying them. The pipe then
+// still refers to row memory, so a row is released to producers only once
+// the reader has drained its bytes from the pipe (FIONREAD).
+// Other outputs are written with write() and released at once.
+template<typename TBuffer>
+class StreamSink {
+	//! a row handed to the pipe and not yet released
+	struct PendingRow {
+		size_t		m_absLoc;
+		//! total bytes written up to and including this row
+		uint64_t	m_end;
+	};
+	TBuffer&	m_buffer;
+	//! output file descriptor
+	int			m_fd;
+	//! true if m_fd is a pipe and vmsplice is used
+	bool		m_splice;
+	//! bytes written so far
+	uint64_t	m_written;
+	//! rows in the pipe, oldest first
+	std::deque<PendingRow>	m_pending;
+	//! rows written
+	std::atomic<size_t>	m_numRows;
+	//! first write error (negative errno) or 0
+	int			m_error;
+	//! if 'true', Run stops consuming.
+	std::atomic<bool>	m_stop;
+public:
+	//! ctor
+	/*!
+	    \param buffer_   buffer to consume from
+		\param fd_       output file descriptor
+		\param splice_   false forces write() even for pipes
+	*/
+	StreamSink(TBuffer& buffer_, int fd_ = STDOUT_FILENO, bool splice_ = true) :
+		m_buffer(buffer_),
+		m_fd(fd_),
+		m_splice(false),
+		m_written(0),
+		m_error(0)
+	{
+		m_numRows.store(0);
+		m_stop.store(false);
+		if (splice_ && fcntl(m_fd, F_GETPIPE_SZ) > 0)
+		{
+			m_splice = true;
+			fcntl(m_fd, F_SETPIPE_SZ, 1024*1024);
+		}
+	}
+	//! consume and write rows until stopped.
+	/*! Returns once the reader has drained all spliced rows, or has gone away.
+	    \return number of rows written */
+	size_t Run()
+	{
+		while (!m_stop && !m_error)
+		{
+			size_t absLoc;
+			// wait for a row only when no spliced row is left to release
+			auto loc = m_pending.empty() ? m_buffer.GetNextLocForCons(absLoc)
+				: m_buffer.TryGetNextLocForCons(absLoc);
+			if (loc >= m_buffer.BufSize())
+			{
+				if (m_buffer.Stopped()) break;
+				ReleaseDrained();
+				std::this_thread::sleep_for(std::chrono::microseconds(1));
+				continue;
+			}
+			const auto* row = m_buffer[loc];
+			const auto res = WriteRow(StreamRow::Payload(row), StreamRow::Length(row));
+			if (res < 0) m_error = res;
+			else ++m_numRows;
+			if (m_splice && res >= 0)
+				m_pending.push_back(PendingRow{ absLoc, m_written });
+			else
+				m_buffer.SetLocReadyForProd(absLoc);
+			ReleaseDrained();
+		}
+		// the reader may still need spliced rows: wait for it to drain them,
+		// unless it has gone away
+		while (!m_pending.empty() && !m_error)
+		{
+			pollfd p{ m_fd, 0, 0 };
+			if (poll(&p, 1, 0) > 0 && (p.revents & POLLERR)) break;
+			ReleaseDrained();
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+		for (auto& p : m_pending)
+			m_buffer.SetLocReadyForProd(p.m_absLoc);
+		m_pending.clear();
+		return m_numRows;
+	}
+	//! stop Run: called from some other thread
+	void Stop()
+	{
+		m_stop = true;
+		m_buffer.Stop();
+	}
+	//! rows written so far
+	size_t NumRows() const { return m_numRows.load(); }
+	//! payload bytes written so far; read after Run has returned
+	uint64_t BytesWritten() const { return m_written; }
+	//! true if rows are passed to a pipe with vmsplice
+	bool Splices() const { return m_splice; }
+	//! first write error as negative errno, or 0
+	int Error() const { return m_error; }
+private:
+	//! write or splice length_ bytes; return 0 or negative errno
+	int WriteRow(const char* data_, size_t length_)
+	{
+		size_t done = 0;
+		while (done < length_)
+		{
+			ssize_t n;
+			if (m_splice)
+			{
+				iovec iov{ (void*) (data_ + done), length_ - done };
+				n = ::vmsplice(m_fd, &iov, 1, 0);
+			}
+			else
+				n = ::write(m_fd, data_ + done, length_ - done);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return n < 0 ? -errno : -EIO;
+			done += (size_t) n;
+		}
+		m_written += length_;
+		return 0;
+	}
+	//! release spliced rows whose bytes the reader has taken out of the pipe
+	void ReleaseDrained()
+	{
+		if (m_pending.empty()) return;
+		int unread = 0;
+		if (ioctl(m_fd, FIONREAD, &unread) != 0)
+		{
+			m_error = -errno;
+			return;
+		}
+		const auto drained = m_written - (uint64_t) unread;
+		while (!m_pending.empty() && m_pending.front().m_end <= drained)
+		{
+			m_buffer.SetLocReadyForProd(m_pending.front().m_absLoc);
+			m_pending.pop_front();
+		}
+	}
+};
+
+}
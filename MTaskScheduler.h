@@ -0,0 +1,254 @@
+/*! \file MTaskScheduler.h
+    \brief  Work-stealing task scheduler fed by an MBuffer injection queue.
+
+	External threads submit tasks in row batches to a global MBuffer.
+	Worker threads keep Chase-Lev deques, refill them a row at a time from
+	the injection queue and steal from each other when idle.
+*/
+#pragma once
+
+#include "MBuffer.h"
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace Messenger {
+
+//! A unit of work: function and its argument.
+
+//! Kept as two words rather than std::function so that tasks copy
+// cheaply in and out of MBuffer rows and deque slots without allocation.
+// A default constructed task is empty and is skipped by the workers;
+// it pads partially filled injection rows.
+struct Task {
+	void	(*m_func)(void*);
+	void*	m_arg;
+	Task(void (*func_)(void*) = nullptr, void* arg_ = nullptr) :
+		m_func(func_), m_arg(arg_) {}
+	explicit operator bool() const { return m_func != nullptr; }
+	void operator()() const { m_func(m_arg); }
+};
+
+//! Fixed capacity Chase-Lev work-stealing deque of tasks.
+
+//! The owner pushes and takes at the bottom, thieves steal from the top.
+// Capacity is fixed at TSize; Push fails instead of growing, so a slot
+// is never overwritten while a thief may still be reading it.
+// A slot is two atomics: a thief reads both and then validates the read
+// with the CAS on m_top; the owner cannot reuse slot t before m_top moves past t.
+template<size_t TSize>
+class TaskDeque {
+	std::atomic<long>	m_top;
+	std::atomic<long>	m_bottom;
+	std::atomic<void (*)(void*)>	m_funcs[TSize];
+	std::atomic<void*>	m_args[TSize];
+public:
+	TaskDeque()
+	{
+		m_top.store(0);
+		m_bottom.store(0);
+	}
+	//! owner only: push task at bottom. Return false when full.
+	bool Push(const Task& task_)
+	{
+		const auto b = m_bottom.load(std::memory_order_relaxed);
+		const auto t = m_top.load(std::memory_order_acquire);
+		if (b - t >= (long) TSize) return false;
+		m_funcs[b % TSize].store(task_.m_func, std::memory_order_relaxed);
+		m_args[b % TSize].store(task_.m_arg, std::memory_order_relaxed);
+		m_bottom.store(b + 1, std::memory_order_release);
+		return true;
+	}
+	//! owner only: take task from bottom. Return false when empty.
+	bool Take(Task& task_)
+	{
+		const auto b = m_bottom.load(std::memory_order_relaxed) - 1;
+		m_bottom.store(b);
+		auto t = m_top.load();
+		if (t > b)
+		{
+			// empty
+			m_bottom.store(b + 1, std::memory_order_relaxed);
+			return false;
+		}
+		task_.m_func = m_funcs[b % TSize].load(std::memory_order_relaxed);
+		task_.m_arg = m_args[b % TSize].load(std::memory_order_relaxed);
+		if (t == b)
+		{
+			// last task: race against thieves for it
+			const auto won = m_top.compare_exchange_strong(t, t + 1);
+			m_bottom.store(b + 1, std::memory_order_relaxed);
+			return won;
+		}
+		return true;
+	}
+	//! any thread: steal task from top. Return false when empty or lost a race.
+	bool Steal(Task& task_)
+	{
+		auto t = m_top.load();
+		const auto b = m_bottom.load();
+		if (t >= b) return false;
+		task_.m_func = m_funcs[t % TSize].load(std::memory_order_relaxed);
+		task_.m_arg = m_args[t % TSize].load(std::memory_order_relaxed);
+		return m_top.compare_exchange_strong(t, t + 1);
+	}
+	//! approximate number of tasks
+	size_t Size() const
+	{
+		const auto n = m_bottom.load(std::memory_order_relaxed) - m_top.load(std::memory_order_relaxed);
+		return n > 0 ? (size_t) n : 0;
+	}
+};
+
+//! Task executor with an MBuffer injection queue and work-stealing workers.
+
+//! The injection queue is an MBuffer of TRows x TColumns tasks.
+// Submitters claim a whole row per batch of up to TColumns tasks, so
+// high rate submission from I/O threads pays one claim per row.
+// A worker runs its local tasks first; when out of work it takes one
+// injection row into its deque, and only then tries to steal.
+// TDequeSize must be at least TColumns, so that a row always fits a
+// drained deque.
+template<size_t TRows, size_t TColumns, size_t TDequeSize = 1024>
+class TaskScheduler {
+	static_assert(TDequeSize >= TColumns, "a row of tasks must fit in a worker deque");
+	typedef MBuffer<TRows, TColumns, Task> InjectionQueueType;
+	typedef TaskDeque<TDequeSize> DequeType;
+
+	//! global injection queue
+	std::unique_ptr<InjectionQueueType>	m_injection;
+	//! per-worker local deques
+	std::vector<std::unique_ptr<DequeType>>	m_deques;
+	//! if 'true', workers are expected to stop.
+	std::atomic<bool>	m_stop;
+	//! worker threads
+	std::vector<std::thread>	m_threads;
+
+	//! deque of the worker running on this thread, nullptr on other threads
+	static DequeType*& LocalDeque()
+	{
+		static thread_local DequeType* deque = nullptr;
+		return deque;
+	}
+public:
+	//! ctor: starts numWorkers_ worker threads.
+	TaskScheduler(size_t numWorkers_) :
+		m_injection(std::make_unique<InjectionQueueType>())
+	{
+		m_stop.store(false);
+		for (auto i = 0u; i < numWorkers_; ++i)
+			m_deques.push_back(std::make_unique<DequeType>());
+		for (auto i = 0u; i < numWorkers_; ++i)
+			m_threads.push_back(std::thread(ThreadFuncForWorker, this, i));
+	}
+	~TaskScheduler()
+	{
+		Stop();
+	}
+	//! submit tasks [first_, last_) from any thread, one row per TColumns tasks.
+	/*!
+	    The last row is padded with empty tasks.
+		\return false if the scheduler has been stopped.
+	*/
+	template<typename TIter>
+	bool SubmitBatch(TIter first_, TIter last_)
+	{
+		while (first_ != last_)
+		{
+			size_t absLoc;
+			auto loc = m_injection->GetNextLocForProd(absLoc);
+			if (loc >= m_injection->BufSize()) return false;
+			auto* row = (*m_injection)[loc];
+			auto col = 0u;
+			for (; (col < m_injection->BufElemSize()) && (first_ != last_); ++col, ++first_)
+				row[col] = *first_;
+			for (; col < m_injection->BufElemSize(); ++col)
+				row[col] = Task();
+			m_injection->SetLocReadyForCons(absLoc);
+		}
+		return true;
+	}
+	//! submit a single task. It takes a whole injection row.
+	bool Submit(const Task& task_)
+	{
+		return SubmitBatch(&task_, &task_ + 1);
+	}
+	//! spawn a task from a task running on a worker; it goes to the local deque.
+	/*! Called from other threads, or with a full deque, it is submitted instead. */
+	bool Spawn(const Task& task_)
+	{
+		auto* deque = LocalDeque();
+		if (deque && deque->Push(task_)) return true;
+		return Submit(task_);
+	}
+	//! stop and join workers. Tasks not yet run are dropped.
+	void Stop()
+	{
+		if (m_stop.exchange(true)) return;
+		m_injection->Stop();
+		for (auto& t : m_threads)
+			t.join();
+	}
+	// worker thread: local deque, then injection queue, then steal
+	void Run(size_t self_)
+	{
+		auto& deque = *m_deques[self_];
+		LocalDeque() = &deque;
+		std::minstd_rand rand((unsigned) self_ + 1);
+		Task task;
+		while (!m_stop)
+		{
+			if (deque.Take(task) || Refill(deque, task) || Steal(self_, rand, task))
+			{
+				task();
+				continue;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(1));
+		}
+		LocalDeque() = nullptr;
+	}
+
+	// thread function: transfers control back to TaskScheduler by calling Run method
+	static void ThreadFuncForWorker(TaskScheduler* s, size_t self_)
+	{
+		s->Run(self_);
+	}
+private:
+	//! move one injection row into empty deque_; return its first task in task_.
+	bool Refill(DequeType& deque_, Task& task_)
+	{
+		size_t absLoc;
+		auto loc = m_injection->TryGetNextLocForCons(absLoc);
+		if (loc >= m_injection->BufSize()) return false;
+		const auto* row = (*m_injection)[loc];
+		auto found = false;
+		for (auto col = 0u; col < m_injection->BufElemSize(); ++col)
+		{
+			if (!row[col]) continue;
+			if (!found)
+			{
+				task_ = row[col];
+				found = true;
+			}
+			else
+				deque_.Push(row[col]);
+		}
+		m_injection->SetLocReadyForProd(absLoc);
+		return found;
+	}
+	//! try to steal one task from every other worker, starting at a random one.
+	bool Steal(size_t self_, std::minstd_rand& rand_, Task& task_)
+	{
+		const auto n = m_deques.size();
+		const auto start = rand_() % n;
+		for (auto i = 0u; i < n; ++i)
+		{
+			const auto victim = (start + i) % n;
+			if (victim != self_ && m_deques[victim]->Steal(task_))
+				return true;
+		}
+		return false;
+	}
+};
+
+}
@@ -0,0 +1,116 @@
+/*! \file MThreading.h
+    \brief  Threading policies of MBuffer.
+
+	MultiThreaded, the default, synchronises producers and consumers on
+	any threads with atomics. SingleThreaded is for a buffer only ever used
+	by one thread at a time, e.g. producer and consumer logic run inline on
+	one thread in tests or single core deployments: cursors and slots are
+	plain integers, claims are compares and stores, and a claim that would
+	wait for another thread fails at once instead, as no other thread can
+	free or publish a row meanwhile.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include "MSlots.h"
+
+namespace Messenger {
+
+//! A value with the interface of std::atomic used by MBuffer, without synchronisation.
+template<typename V>
+class Unsynced {
+	V	m_value;
+public:
+	Unsynced() = default;
+	Unsynced(const Unsynced&) = delete;
+	Unsynced& operator=(const Unsynced&) = delete;
+	V load(std::memory_order = std::memory_order_seq_cst) const { return m_value; }
+	void store(V value_, std::memory_order = std::memory_order_seq_cst) { m_value = value_; }
+	V exchange(V value_, std::memory_order = std::memory_order_seq_cst)
+	{
+		const auto old = m_value;
+		m_value = value_;
+		return old;
+	}
+	bool compare_exchange_strong(V& expected_, V desired_, std::memory_order = std::memory_order_seq_cst)
+	{
+		if (m_value != expected_)
+		{
+			expected_ = m_value;
+			return false;
+		}
+		m_value = desired_;
+		return true;
+	}
+	bool compare_exchange_weak(V& expected_, V desired_, std::memory_order order_ = std::memory_order_seq_cst)
+	{
+		return compare_exchange_strong(expected_, desired_, order_);
+	}
+};
+
+//! Status and absolute location in two plain arrays, for SingleThreaded buffers.
+template<size_t TSize>
+class PlainSlots {
+	SlotStatus	m_status[TSize];
+	int64_t		m_absLoc[TSize];
+public:
+	void Store(size_t loc_, int64_t absLoc_, SlotStatus status_)
+	{
+		m_absLoc[loc_] = absLoc_;
+		m_status[loc_] = status_;
+	}
+	SlotStatus GetStatus(size_t loc_) const { return m_status[loc_]; }
+	void Prefetch(size_t loc_) const { PrefetchLine(&m_status[loc_], true); }
+	void SetStatus(size_t loc_, SlotStatus status_) { m_status[loc_] = status_; }
+	bool ClaimForWrite(size_t loc_, int64_t absLoc_)
+	{
+		if (m_status[loc_] != SlotStatus::READY_FOR_WRITE)
+			return false;
+		m_status[loc_] = SlotStatus::WRITING;
+		m_absLoc[loc_] = absLoc_;
+		return true;
+	}
+	void Bind(size_t, int64_t) {}
+	bool ClaimForWriteOnce(size_t loc_, int64_t absLoc_)
+	{
+		return m_absLoc[loc_] < absLoc_ && ClaimForWrite(loc_, absLoc_);
+	}
+	void Load(size_t loc_, int64_t& absLoc_, SlotStatus& status_) const
+	{
+		absLoc_ = m_absLoc[loc_];
+		status_ = m_status[loc_];
+	}
+	bool ClaimForRead(size_t loc_, int64_t absLoc_)
+	{
+		if (m_status[loc_] != SlotStatus::READY_FOR_READ || m_absLoc[loc_] != absLoc_)
+			return false;
+		m_status[loc_] = SlotStatus::READING;
+		return true;
+	}
+	bool PassConsumed(size_t loc_, int64_t absLoc_)
+	{
+		if (m_status[loc_] != SlotStatus::CONSUMED || m_absLoc[loc_] != absLoc_)
+			return false;
+		m_status[loc_] = SlotStatus::READY_FOR_WRITE;
+		return true;
+	}
+};
+
+//! producers and consumers on any threads (default)
+struct MultiThreaded {
+	static const bool m_concurrent = true;
+	template<typename V> using Atomic = std::atomic<V>;
+	//! the slot layout chosen for the buffer
+	template<template<size_t> class TSlots, size_t TSize> using Slots = TSlots<TSize>;
+};
+
+//! producers and consumers on one thread at a time
+struct SingleThreaded {
+	static const bool m_concurrent = false;
+	template<typename V> using Atomic = Unsynced<V>;
+	//! plain slots whatever the layout chosen: without CAS they are all alike
+	template<template<size_t> class, size_t TSize> using Slots = PlainSlots<TSize>;
+};
+
+}
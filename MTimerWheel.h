@@ -0,0 +1,233 @@
+/*! \file MTimerWheel.h
+    \brief  Scheduled delivery into an MBuffer through a hierarchical timer wheel.
+
+	Producers schedule a message with a due time; a ticker thread moves
+	messages that are due into the MBuffer in row batches.
+*/
+#pragma once
+
+#include "MBuffer.h"
+#include <cstdint>
+#include <vector>
+
+namespace Messenger {
+
+//! Delivers messages into a buffer no earlier than their due time.
+
+//! Producers call Schedule from any thread. Insertion is a single CAS push
+// on a lock-free stack of incoming timers, so it is O(1) and never waits
+// for the ticker. The ticker thread owns the wheel itself: each tick it
+// moves incoming timers into the wheel, advances the wheel and writes the
+// messages due in that tick into TBuffer, TBuffer::BufElemSize() per row.
+// A partially filled last row is padded with the filler value given to the ctor,
+// which consumers are expected to skip.
+//
+// The wheel has TLevels levels of 256 slots. Level 0 slots are one tick
+// wide; each slot of level l spans 256^l ticks and is cascaded into the
+// lower levels when the wheel reaches it, as in classic hierarchical wheels.
+// A message is delivered at most one tick after its due time, plus
+// the time to obtain a free row in TBuffer. A rate limiter of TBuffer
+// delays delivery like a full buffer.
+template<typename TBuffer, size_t TLevels = 4>
+class TimerWheel {
+public:
+	typedef typename TBuffer::ValueType ValueType;
+	typedef std::chrono::steady_clock ClockType;
+private:
+	static const size_t m_slotBits = 8;
+	static const size_t m_numSlots = size_t(1) << m_slotBits;
+	static const size_t m_slotMask = m_numSlots - 1;
+
+	//! a scheduled message
+	struct Node {
+		ValueType	m_msg;
+		uint64_t	m_dueTick;
+		Node*		m_next;
+	};
+
+	//! buffer due messages are delivered to
+	TBuffer&	m_buffer;
+	//! value used to pad partially filled rows
+	ValueType	m_filler;
+	//! wheel resolution
+	ClockType::duration	m_tickDuration;
+	//! time of tick 0
+	ClockType::time_point	m_start;
+	//! lock-free stack of timers scheduled since the last tick
+	std::atomic<Node*>	m_incoming;
+	//! current tick: all slots up to and including it have been processed.
+	// Written by ticker only.
+	uint64_t	m_tick;
+	//! wheel slots: singly linked lists of nodes. Accessed by ticker only.
+	Node*		m_slots[TLevels][m_numSlots];
+	//! if 'true', the ticker is expected to stop.
+	std::atomic<bool>	m_stop;
+	//! ticker thread
+	std::thread	m_thread;
+
+public:
+	//! ctor: starts the ticker thread.
+	/*!
+	    \param buffer_        buffer due messages are written to
+		\param tickDuration_  wheel resolution, i.e. the delivery jitter bound
+		\param filler_        value padding partially filled rows
+	*/
+	TimerWheel(TBuffer& buffer_, ClockType::duration tickDuration_ = std::chrono::microseconds(100),
+		const ValueType& filler_ = ValueType()) :
+		m_buffer(buffer_),
+		m_filler(filler_),
+		m_tickDuration(tickDuration_),
+		m_start(ClockType::now()),
+		m_tick(0)
+	{
+		m_incoming.store(nullptr);
+		m_stop.store(false);
+		for (auto& level : m_slots)
+			for (auto& slot : level)
+				slot = nullptr;
+		m_thread = std::thread(ThreadFuncForTicker, this);
+	}
+	~TimerWheel()
+	{
+		Stop();
+		FreeList(m_incoming.exchange(nullptr));
+		for (auto& level : m_slots)
+			for (auto& slot : level)
+				FreeList(slot);
+	}
+	//! deliver msg_ into the buffer no earlier than due_. Any thread.
+	void Schedule(const ValueType& msg_, ClockType::time_point due_)
+	{
+		auto* node = new Node{ msg_, ToTick(due_), nullptr };
+		auto* head = m_incoming.load();
+		do {
+			node->m_next = head;
+		} while (!m_incoming.compare_exchange_weak(head, node));
+	}
+	//! deliver msg_ into the buffer no earlier than delay_ from now. Any thread.
+	void ScheduleAfter(const ValueType& msg_, ClockType::duration delay_)
+	{
+		Schedule(msg_, ClockType::now() + delay_);
+	}
+	//! stop and join the ticker. Messages not yet due are dropped, and so
+	//! are messages due but waiting for a free row of the buffer.
+	void Stop()
+	{
+		if (m_stop.exchange(true)) return;
+		m_thread.join();
+	}
+	// ticker thread: advance the wheel to the current time once every tick
+	void Run()
+	{
+		std::vector<ValueType> due;
+		while (!m_stop)
+		{
+			const auto nowTick = (uint64_t) ((ClockType::now() - m_start) / m_tickDuration);
+			Insert(m_incoming.exchange(nullptr), due);
+			while (m_tick < nowTick)
+				Advance(due);
+			if (!due.empty())
+			{
+				Deliver(due);
+				due.clear();
+			}
+			std::this_thread::sleep_until(m_start + (m_tick + 1)*m_tickDuration);
+		}
+	}
+
+	// thread function: transfers control back to TimerWheel by calling Run method
+	static void ThreadFuncForTicker(TimerWheel* w)
+	{
+		w->Run();
+	}
+private:
+	//! first tick at or after t_, so that delivery is never early
+	uint64_t ToTick(ClockType::time_point t_) const
+	{
+		if (t_ <= m_start) return 0;
+		const auto d = t_ - m_start;
+		return (uint64_t) ((d + m_tickDuration - ClockType::duration(1)) / m_tickDuration);
+	}
+	//! place each node of list_ in the wheel, or in due_ if already due
+	void Insert(Node* list_, std::vector<ValueType>& due_)
+	{
+		while (list_)
+		{
+			auto* node = list_;
+			list_ = list_->m_next;
+			if (node->m_dueTick <= m_tick)
+			{
+				due_.push_back(node->m_msg);
+				delete node;
+				continue;
+			}
+			// lowest level whose rotation covers the distance to the due tick;
+			// timers beyond the top level wait in its furthest slot and
+			// are re-inserted when it is cascaded.
+			const auto delta = node->m_dueTick - m_tick;
+			auto level = 0u;
+			while ((level + 1 < TLevels) && (delta >> (m_slotBits*(level + 1))))
+				++level;
+			auto slotTick = node->m_dueTick;
+			if (delta >> (m_slotBits*TLevels))
+				slotTick = m_tick + (uint64_t(m_slotMask) << (m_slotBits*(TLevels - 1)));
+			auto& slot = m_slots[level][(slotTick >> (m_slotBits*level)) & m_slotMask];
+			node->m_next = slot;
+			slot = node;
+		}
+	}
+	//! move to next tick: cascade upper levels on wrap around, then fire level 0 slot
+	void Advance(std::vector<ValueType>& due_)
+	{
+		++m_tick;
+		for (auto level = 1u; level < TLevels; ++level)
+		{
+			if (m_tick & ((uint64_t(1) << (m_slotBits*level)) - 1))
+				break;
+			auto& slot = m_slots[level][(m_tick >> (m_slotBits*level)) & m_slotMask];
+			auto* list = slot;
+			slot = nullptr;
+			Insert(list, due_);
+		}
+		auto& slot = m_slots[0][m_tick & m_slotMask];
+		auto* list = slot;
+		slot = nullptr;
+		Insert(list, due_);
+	}
+	//! write due_ messages into buffer rows
+	void Deliver(const std::vector<ValueType>& due_)
+	{
+		auto next = due_.begin();
+		while (next != due_.end())
+		{
+			size_t absLoc;
+			// a full buffer is waited for here, not in GetNextLocForProd,
+			// so that Stop is not held up by consumers that stopped first
+			auto loc = m_buffer.TryGetNextLocForProd(absLoc);
+			if (loc >= m_buffer.BufSize())
+			{
+				if (m_stop || m_buffer.Stopped()) return;
+				std::this_thread::sleep_for(std::chrono::microseconds(1));
+				continue;
+			}
+			auto* row = m_buffer[loc];
+			auto col = 0u;
+			for (; (col < m_buffer.BufElemSize()) && (next != due_.end()); ++col, ++next)
+				row[col] = *next;
+			for (; col < m_buffer.BufElemSize(); ++col)
+				row[col] = m_filler;
+			m_buffer.SetLocReadyForCons(absLoc);
+		}
+	}
+	static void FreeList(Node* list_)
+	{
+		while (list_)
+		{
+			auto* next = list_->m_next;
+			delete list_;
+			list_ = next;
+		}
+	}
+};
+
+}
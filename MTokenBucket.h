@@ -0,0 +1,169 @@
+/*! \file MTokenBucket.h
+    \brief  Token bucket rate limiter for MBuffer producers.
+
+	Refilled from the CPU time stamp counter, lock-free and cheap enough
+	to be checked on every claim of a row.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace Messenger {
+
+//! Cheap monotonic clock based on the time stamp counter.
+
+//! Falls back to steady_clock where there is no TSC.
+// The TSC frequency is calibrated once against steady_clock.
+class TscClock {
+public:
+	//! current time in ticks
+	static uint64_t Now()
+	{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return (uint64_t) std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+	}
+	//! number of ticks per second
+	static double TicksPerSec()
+	{
+		static const double ticksPerSec = Calibrate();
+		return ticksPerSec;
+	}
+	//! pause briefly inside a spin loop
+	static void Pause()
+	{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+		_mm_pause();
+#else
+		std::this_thread::yield();
+#endif
+	}
+private:
+	static double Calibrate()
+	{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+		using namespace std::chrono;
+		const auto start = steady_clock::now();
+		const auto startTicks = Now();
+		std::this_thread::sleep_for(milliseconds(10));
+		const auto ticks = Now() - startTicks;
+		const duration<double> secs = steady_clock::now() - start;
+		return ticks/secs.count();
+#else
+		return double(std::chrono::steady_clock::period::den)/std::chrono::steady_clock::period::num;
+#endif
+	}
+};
+
+/*! \enum what a producer does when the rate limiter has no tokens
+
+    BLOCK:		sleep until enough tokens have accumulated
+    SPIN:		busy wait until enough tokens have accumulated
+    FAIL_FAST:	return at once; GetNextLocForProd returns size_t(-1)
+*/
+enum class WaitPolicy { BLOCK = 0, SPIN = 1, FAIL_FAST = 2 };
+
+//! Token bucket with a sustained rate and a burst capacity.
+
+//! Implemented as the equivalent virtual scheduling algorithm (GCRA):
+// the only state is m_tat, the theoretical arrival time in TSC ticks at
+// which the bucket would be full again. Taking n tokens moves m_tat
+// forward by n token intervals and is allowed while m_tat stays within
+// the burst window from now. So acquisition is one clock read and one CAS,
+// and refill needs no timer thread.
+// One bucket can be shared by all producers of a buffer (global limit)
+// or owned by a producer (per-producer limit).
+class TokenBucket {
+	//! theoretical arrival time in ticks
+	std::atomic<uint64_t>	m_tat;
+	//! ticks per token
+	uint64_t	m_interval;
+	//! ticks of burst capacity: burst x m_interval
+	uint64_t	m_burstTicks;
+	//! what to do when tokens run out
+	WaitPolicy	m_policy;
+public:
+	//! ctor
+	/*!
+	    \param tokensPerSec_  sustained rate
+		\param burst_         bucket capacity in tokens. Must be at least the
+		                      number of tokens taken at once, i.e. columns per row
+		\param policy_        wait policy when tokens run out
+	*/
+	TokenBucket(double tokensPerSec_, uint64_t burst_, WaitPolicy policy_ = WaitPolicy::BLOCK) :
+		m_policy(policy_)
+	{
+		Set(tokensPerSec_, burst_);
+		m_tat.store(TscClock::Now());
+	}
+	//! change rate and burst capacity
+	void Set(double tokensPerSec_, uint64_t burst_)
+	{
+		m_interval = (uint64_t) (TscClock::TicksPerSec()/tokensPerSec_);
+		if (m_interval == 0) m_interval = 1;
+		m_burstTicks = burst_*m_interval;
+	}
+	WaitPolicy Policy() const { return m_policy; }
+	void Policy(WaitPolicy policy_) { m_policy = policy_; }
+
+	//! take n_ tokens if available, without waiting.
+	/*!
+	    \param [out] waitTicks_  when false is returned, ticks until n_ tokens are available
+		\return      true if tokens were taken
+	*/
+	bool TryAcquire(uint64_t n_, uint64_t& waitTicks_)
+	{
+		const auto now = TscClock::Now();
+		auto tat = m_tat.load(std::memory_order_relaxed);
+		uint64_t newTat;
+		do {
+			newTat = (tat > now ? tat : now) + n_*m_interval;
+			if (newTat - now > m_burstTicks)
+			{
+				waitTicks_ = newTat - now - m_burstTicks;
+				return false;
+			}
+		} while (!m_tat.compare_exchange_weak(tat, newTat, std::memory_order_relaxed));
+		return true;
+	}
+	//! give back n_ tokens taken for a claim that then failed.
+	void Release(uint64_t n_)
+	{
+		m_tat.fetch_sub(n_*m_interval, std::memory_order_relaxed);
+	}
+	//! take n_ tokens, waiting according to the wait policy.
+	/*!
+	    \param stop_  waiting is abandoned when *stop_ becomes true
+		\return       true if tokens were taken
+	*/
+	template<typename TStop>
+	bool Acquire(uint64_t n_, const TStop& stop_)
+	{
+		uint64_t waitTicks;
+		while (!TryAcquire(n_, waitTicks))
+		{
+			if (m_policy == WaitPolicy::FAIL_FAST || stop_)
+				return false;
+			if (m_policy == WaitPolicy::SPIN)
+			{
+				TscClock::Pause();
+				continue;
+			}
+			const auto nsec = 1e9*waitTicks/TscClock::TicksPerSec();
+			std::this_thread::sleep_for(std::chrono::nanoseconds((long long) nsec));
+		}
+		return true;
+	}
+};
+
+}
@@ -0,0 +1,131 @@
+/*! \file MTopology.h
+    \brief  CPU topology: which NUMA node each CPU belongs to and which
+	        CPUs share an L2 or L3 cache.
+
+	Read once from /sys on Linux. Where the topology is not available,
+	all CPUs are taken to be on node 0, and CPUs of a node to share caches.
+*/
+#pragma once
+
+#include <cstddef>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+namespace Messenger {
+
+//! CPU to NUMA node and cache domain maps.
+
+//! A cache domain is the set of CPUs sharing a cache of a given level,
+// identified by its lowest CPU.
+class Topology {
+	//! node of each CPU
+	std::vector<size_t>	m_nodeOfCpu;
+	size_t	m_numNodes;
+	//! L2 and L3 domain of each CPU
+	std::vector<size_t>	m_l2OfCpu;
+	std::vector<size_t>	m_l3OfCpu;
+
+	Topology() : m_numNodes(1)
+	{
+		for (size_t node = 0; ; ++node)
+		{
+			std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			if (!file) break;
+			std::string list;
+			std::getline(file, list);
+			for (auto cpu : ParseCpuList(list))
+			{
+				if (cpu >= m_nodeOfCpu.size()) m_nodeOfCpu.resize(cpu + 1, 0);
+				m_nodeOfCpu[cpu] = node;
+			}
+			m_numNodes = node + 1;
+		}
+		for (size_t cpu = 0; ; ++cpu)
+		{
+			const auto dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/cache/index";
+			if (!std::ifstream(dir + "0/level")) break;
+			m_l2OfCpu.resize(cpu + 1, cpu);
+			m_l3OfCpu.resize(cpu + 1, cpu);
+			for (size_t index = 0; ; ++index)
+			{
+				std::ifstream levelFile(dir + std::to_string(index) + "/level");
+				std::ifstream sharedFile(dir + std::to_string(index) + "/shared_cpu_list");
+				if (!levelFile || !sharedFile) break;
+				size_t level = 0;
+				std::string shared;
+				levelFile >> level;
+				std::getline(sharedFile, shared);
+				const auto cpus = ParseCpuList(shared);
+				if (cpus.empty() || (level != 2 && level != 3)) continue;
+				(level == 2 ? m_l2OfCpu : m_l3OfCpu)[cpu] = cpus.front();
+			}
+		}
+	}
+public:
+	//! the topology of this host
+	static const Topology& Get()
+	{
+		static const Topology topology;
+		return topology;
+	}
+	//! parse a CPU list such as "0-3,8,10-11"
+	static std::vector<size_t> ParseCpuList(const std::string& list_)
+	{
+		std::vector<size_t> cpus;
+		std::stringstream ranges(list_);
+		std::string range;
+		while (std::getline(ranges, range, ','))
+		{
+			size_t first = 0, last = 0;
+			const auto dash = range.find('-');
+			try
+			{
+				first = last = std::stoul(range);
+				if (dash != std::string::npos) last = std::stoul(range.substr(dash + 1));
+			}
+			catch (const std::exception&)
+			{
+				continue;
+			}
+			for (auto cpu = first; cpu <= last; ++cpu)
+				cpus.push_back(cpu);
+		}
+		return cpus;
+	}
+	//! CPU the calling thread runs on; 0 if unknown
+	static size_t CurrentCpu()
+	{
+#if defined(__linux__)
+		const auto cpu = sched_getcpu();
+		return cpu < 0 ? 0 : (size_t) cpu;
+#else
+		return 0;
+#endif
+	}
+	size_t NumNodes() const { return m_numNodes; }
+	//! NUMA node of cpu_
+	size_t NodeOf(size_t cpu_) const { return cpu_ < m_nodeOfCpu.size() ? m_nodeOfCpu[cpu_] : 0; }
+	//! NUMA node the calling thread runs on
+	size_t CurrentNode() const { return NodeOf(CurrentCpu()); }
+	//! cache domain of cpu_ for level_ 2 or 3: the lowest CPU sharing that cache
+	//! with cpu_. Without cache information, the lowest CPU of the node.
+	size_t CacheDomainOf(size_t cpu_, size_t level_ = 3) const
+	{
+		const auto& domains = level_ == 2 ? m_l2OfCpu : m_l3OfCpu;
+		if (cpu_ < domains.size())
+			return domains[cpu_];
+		const auto node = NodeOf(cpu_);
+		for (size_t cpu = 0; cpu < m_nodeOfCpu.size(); ++cpu)
+		{
+			if (m_nodeOfCpu[cpu] == node) return cpu;
+		}
+		return 0;
+	}
+};
+
+}
@@ -0,0 +1,315 @@
+/*! \file MTrace.h
+    \brief  Record and replay of MBuffer traffic traces.
+
+	A TraceRecorder captures when each message was published, in which row,
+	by which producer and how large it was; a TraceReplayer publishes the
+	same traffic into a buffer again, at the original or a scaled timing,
+	so that buffer tuning can be measured on real load shapes.
+*/
+#pragma once
+
+#include "MBuffer.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Messenger {
+
+//! One traced message.
+struct TraceEvent {
+	//! publish time in nanoseconds since the start of the trace
+	int64_t		m_timeNsec;
+	//! row the message was published in; the messages of a row form a burst.
+	// -1 marks padding in the recorder's event rows.
+	int64_t		m_absLoc;
+	uint32_t	m_producer;
+	//! message size in bytes
+	uint32_t	m_size;
+};
+
+//! Trace file: a header word followed by TraceEvent records.
+struct TraceFile {
+	static const uint64_t m_magic = 0x314543415254424dull; // "MBTRACE1"
+	//! read all events of trace path_, ordered by time. Throws if path_ is not a trace.
+	static std::vector<TraceEvent> Load(const std::string& path_)
+	{
+		auto* file = std::fopen(path_.c_str(), "rb");
+		if (!file)
+		{
+			throw std::runtime_error("cannot open " + path_);
+		}
+		uint64_t magic = 0;
+		std::vector<TraceEvent> events;
+		const auto ok = std::fread(&magic, sizeof(magic), 1, file) == 1 && magic == m_magic;
+		TraceEvent chunk[1024];
+		size_t n;
+		while (ok && (n = std::fread(chunk, sizeof(TraceEvent), 1024, file)) > 0)
+			events.insert(events.end(), chunk, chunk + n);
+		std::fclose(file);
+		if (!ok)
+		{
+			throw std::runtime_error("not a trace: " + path_);
+		}
+		std::stable_sort(events.begin(), events.end(),
+			[](const TraceEvent& a_, const TraceEvent& b_) { return a_.m_timeNsec < b_.m_timeNsec; });
+		return events;
+	}
+};
+
+//! Sidecar recording the traffic of a buffer into a trace file.
+
+//! Producers call Record after publishing a row. Record only reads the TSC
+// and copies one event per message into a row of the recorder's own
+// MBuffer; the recorder thread, a consumer of that buffer, converts the
+// time stamps and writes the events to the file. If the recorder falls
+// behind and its buffer is full, events are dropped and counted rather
+// than making producers wait.
+template<size_t TRows = 4096, size_t TColumns = 64>
+class TraceRecorder {
+	typedef MBuffer<TRows, TColumns, TraceEvent> EventBuffer;
+	std::unique_ptr<EventBuffer>	m_events;
+	std::FILE*	m_file;
+	//! TSC at construction: time 0 of the trace
+	uint64_t	m_startTick;
+	double		m_nsecPerTick;
+	//! events written and dropped
+	std::atomic<size_t>	m_numEvents;
+	std::atomic<size_t>	m_dropped;
+	//! if 'true', the recorder thread drains its buffer and stops
+	std::atomic<bool>	m_stop;
+	std::thread	m_thread;
+public:
+	//! ctor: creates trace path_ and starts the recorder thread
+	TraceRecorder(const std::string& path_) :
+		m_events(std::make_unique<EventBuffer>()),
+		m_file(std::fopen(path_.c_str(), "wb")),
+		m_startTick(TscClock::Now()),
+		m_nsecPerTick(1e9/TscClock::TicksPerSec())
+	{
+		if (!m_file)
+		{
+			throw std::runtime_error("cannot create " + path_);
+		}
+		const auto magic = TraceFile::m_magic;
+		std::fwrite(&magic, sizeof(magic), 1, m_file);
+		m_numEvents.store(0);
+		m_dropped.store(0);
+		m_stop.store(false);
+		m_thread = std::thread(ThreadFuncForRecorder, this);
+	}
+	~TraceRecorder()
+	{
+		Stop();
+	}
+	TraceRecorder(const TraceRecorder&) = delete;
+	TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+	//! record row absLoc_ of numMessages_ messages, just published by producer_.
+	/*! size_(i) returns the size in bytes of message i of the row. Any thread. */
+	template<typename TSizeFunc>
+	void Record(uint32_t producer_, size_t absLoc_, size_t numMessages_, TSizeFunc&& size_)
+	{
+		const auto now = (int64_t) TscClock::Now();
+		for (size_t i = 0; i < numMessages_; )
+		{
+			// never wait for the recorder thread: drop the events if no row is free
+			size_t eventLoc;
+			auto loc = m_events->TryGetNextLocForProd(eventLoc);
+			if (loc >= m_events->BufSize())
+			{
+				if (!m_events->Stopped()) m_dropped += numMessages_ - i;
+				return;
+			}
+			auto* row = (*m_events)[loc];
+			auto col = 0u;
+			for (; col < m_events->BufElemSize() && i < numMessages_; ++col, ++i)
+				row[col] = TraceEvent{ now, (int64_t) absLoc_, producer_, (uint32_t) size_(i) };
+			for (; col < m_events->BufElemSize(); ++col)
+				row[col] = TraceEvent{ 0, -1, 0, 0 };
+			m_events->SetLocReadyForCons(eventLoc);
+		}
+	}
+	//! write the events recorded so far, stop the recorder thread and close the trace
+	void Stop()
+	{
+		if (m_stop.exchange(true)) return;
+		m_thread.join();
+		std::fclose(m_file);
+	}
+	//! events written so far
+	size_t NumEvents() const { return m_numEvents.load(); }
+	//! events dropped because the recorder fell behind
+	size_t Dropped() const { return m_dropped.load(); }
+
+	// recorder thread: write event rows until stopped and drained
+	void Run()
+	{
+		std::vector<TraceEvent> events;
+		while (true)
+		{
+			size_t absLoc;
+			auto loc = m_events->TryGetNextLocForCons(absLoc);
+			if (loc >= m_events->BufSize())
+			{
+				if (m_stop && m_events->Empty()) break;
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+				continue;
+			}
+			const auto* row = (*m_events)[loc];
+			for (auto col = 0u; col < m_events->BufElemSize(); ++col)
+			{
+				if (row[col].m_absLoc < 0) continue;
+				events.push_back(row[col]);
+				auto& e = events.back();
+				e.m_timeNsec = (int64_t) (double((uint64_t) e.m_timeNsec - m_startTick)*m_nsecPerTick);
+			}
+			m_events->SetLocReadyForProd(absLoc);
+			std::fwrite(events.data(), sizeof(TraceEvent), events.size(), m_file);
+			m_numEvents += events.size();
+			events.clear();
+		}
+		m_events->Stop();
+	}
+
+	// thread function: transfers control back to TraceRecorder by calling Run method
+	static void ThreadFuncForRecorder(TraceRecorder* r)
+	{
+		r->Run();
+	}
+};
+
+//! Replay statistics.
+struct ReplayStats {
+	size_t		m_rows;
+	size_t		m_messages;
+	double		m_secs;
+	//! how late rows were published against the scaled trace time, in nanoseconds
+	int64_t		m_p50LateNsec;
+	int64_t		m_p99LateNsec;
+	int64_t		m_maxLateNsec;
+};
+
+//! Publishes the traffic of a trace into a buffer.
+
+//! Each traced producer gets a replay thread which publishes the rows of
+// that producer, each with its traced messages, at the traced time
+// multiplied by a scale. So bursts, inter-arrival gaps and the skew
+// between producers are reproduced; message contents are not traced and
+// are made by the caller from each event.
+template<typename TBuffer>
+class TraceReplayer {
+	typedef typename TBuffer::ValueType ValueType;
+	//! a traced row: events [m_first, m_first + m_count) of m_events
+	struct Row {
+		int64_t		m_timeNsec;
+		size_t		m_first;
+		size_t		m_count;
+	};
+	std::vector<TraceEvent>	m_events;
+	//! rows of each producer, in time order
+	std::vector<std::vector<Row>>	m_producers;
+public:
+	//! ctor: load trace path_
+	TraceReplayer(const std::string& path_) :
+		m_events(TraceFile::Load(path_))
+	{
+		// group each producer's events by row, keeping time order
+		std::stable_sort(m_events.begin(), m_events.end(), [](const TraceEvent& a_, const TraceEvent& b_) {
+			return a_.m_producer < b_.m_producer;
+		});
+		for (size_t i = 0; i < m_events.size(); )
+		{
+			if (!i || m_events[i].m_producer != m_events[i - 1].m_producer)
+				m_producers.emplace_back();
+			auto j = i + 1;
+			while (j < m_events.size() && m_events[j].m_producer == m_events[i].m_producer &&
+				m_events[j].m_absLoc == m_events[i].m_absLoc)
+			{
+				++j;
+			}
+			m_producers.back().push_back(Row{ m_events[i].m_timeNsec, i, j - i });
+			i = j;
+		}
+	}
+	//! traced messages
+	size_t NumEvents() const { return m_events.size(); }
+	//! traced producers, i.e. replay threads
+	size_t NumProducers() const { return m_producers.size(); }
+
+	//! publish the trace into buffer_.
+	/*!
+	    A traced row with more messages than a buffer row is spread over
+		several rows; unused columns are padded.
+		\param scale_  factor on trace times: 1 original timing, 0.5 twice as fast, 0 as fast as possible
+		\param make_   make_(const TraceEvent* event, size_t absLoc, size_t col) returns the value
+		               for column col of row absLoc; event is nullptr for padding
+	*/
+	template<typename TMake>
+	ReplayStats Replay(TBuffer& buffer_, double scale_, TMake&& make_)
+	{
+		std::vector<std::vector<int64_t>> late(m_producers.size());
+		std::vector<size_t> rows(m_producers.size(), 0);
+		std::vector<std::thread> threads;
+		const auto start = std::chrono::steady_clock::now();
+		for (size_t p = 0; p < m_producers.size(); ++p)
+		{
+			threads.emplace_back([&, p]() {
+				for (const auto& row : m_producers[p])
+				{
+					const auto due = start + std::chrono::nanoseconds((int64_t) (row.m_timeNsec*scale_));
+					WaitUntil(due);
+					for (size_t i = 0; i < row.m_count; )
+					{
+						size_t absLoc;
+						auto loc = buffer_.GetNextLocForProd(absLoc);
+						if (loc >= buffer_.BufSize()) return; // stopped
+						auto* values = buffer_[loc];
+						for (size_t col = 0; col < buffer_.BufElemSize(); ++col)
+						{
+							const auto* event = i < row.m_count ? &m_events[row.m_first + i] : nullptr;
+							values[col] = make_(event, absLoc, col);
+							if (event) ++i;
+						}
+						buffer_.SetLocReadyForCons(absLoc);
+						++rows[p];
+					}
+					late[p].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+						std::chrono::steady_clock::now() - due).count());
+				}
+			});
+		}
+		for (auto& t : threads)
+			t.join();
+		std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+		std::vector<int64_t> all;
+		for (auto& l : late)
+			all.insert(all.end(), l.begin(), l.end());
+		std::sort(all.begin(), all.end());
+		ReplayStats stats{ 0, m_events.size(), secs.count(), 0, 0, 0 };
+		for (auto r : rows)
+			stats.m_rows += r;
+		if (!all.empty())
+		{
+			stats.m_p50LateNsec = all[(all.size() - 1)/2];
+			stats.m_p99LateNsec = all[(size_t) ((all.size() - 1)*0.99)];
+			stats.m_maxLateNsec = all.back();
+		}
+		return stats;
+	}
+private:
+	//! sleep until shortly before due_, then spin
+	static void WaitUntil(std::chrono::steady_clock::time_point due_)
+	{
+		const auto spin = std::chrono::microseconds(100);
+		auto now = std::chrono::steady_clock::now();
+		if (due_ - now > spin)
+			std::this_thread::sleep_until(due_ - spin);
+		while (std::chrono::steady_clock::now() < due_)
+			TscClock::Pause();
+	}
+};
+
+}
@@ -0,0 +1,280 @@
+/*! \file MultiQueueStats.cpp
+\brief  Performance stats for MultiQueue.
+
+Throughput of threads alternating push and pop-min on a MultiQueue
+against a std::priority_queue behind a mutex; rank error of the pops;
+and moving entries between MBuffers and the queue a row at a time
+against one entry at a time.
+*/
+#include "MMultiQueue.h"
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <vector>
+
+// default maximum number of threads
+static const auto g_MaxThreads = 8;
+// heaps per thread
+static const size_t g_HeapsPerThread = 2;
+// entries in the queue before the timed runs and the rank error runs
+static const size_t g_Prefill = 1'000'000;
+// seconds per timed run
+static const auto g_RunSecs = 1;
+// rows x columns of the buffers of the row moves
+static const size_t g_Rows = 1024;
+static const size_t g_Columns = 64;
+
+typedef Messenger::MultiQueue<uint64_t> QueueType;
+typedef QueueType::Entry EntryType;
+
+//! Baseline: std::priority_queue guarded by a mutex.
+class MutexPriorityQueue
+{
+	std::mutex	m_mutex;
+	std::priority_queue<EntryType, std::vector<EntryType>, std::greater<EntryType>>	m_queue;
+public:
+	void Push(uint64_t priority_, const uint64_t& value_)
+	{
+		EntryType entry;
+		entry.m_priority = priority_;
+		entry.m_value = value_;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_queue.push(entry);
+	}
+	bool TryPopMin(uint64_t& priority_, uint64_t& value_)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_queue.empty()) return false;
+		priority_ = m_queue.top().m_priority;
+		value_ = m_queue.top().m_value;
+		m_queue.pop();
+		return true;
+	}
+};
+
+//! xorshift64 priority source, one per thread
+inline uint64_t NextPriority(uint64_t& state_)
+{
+	state_ ^= state_ << 13;
+	state_ ^= state_ >> 7;
+	state_ ^= state_ << 17;
+	return state_ >> 1;
+}
+
+//! push/pop-min pairs per second with numThreads_ threads on queue_
+template<typename TQueue>
+double RunPushPop(size_t numThreads_, TQueue& queue_)
+{
+	uint64_t state = 88172645463325252ull;
+	for (size_t i = 0; i < g_Prefill; ++i)
+		queue_.Push(NextPriority(state), i);
+	std::atomic<bool> stop{ false };
+	std::atomic<size_t> ops{ 0 };
+	std::vector<std::thread> threads;
+	for (auto t = 0u; t < numThreads_; ++t)
+	{
+		threads.emplace_back([&, t]() {
+			uint64_t state = 0x9e3779b97f4a7c15ull*(t + 1), priority, value;
+			size_t n = 0;
+			while (!stop)
+			{
+				queue_.Push(NextPriority(state), n);
+				queue_.TryPopMin(priority, value);
+				++n;
+			}
+			ops += n;
+		});
+	}
+	const auto start = std::chrono::steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::seconds(g_RunSecs));
+	stop = true;
+	for (auto& t : threads)
+		t.join();
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	return ops/secs.count();
+}
+
+//! Fenwick tree counting the entries left, by priority rank
+class RankCounter
+{
+	std::vector<size_t>	m_tree;
+public:
+	RankCounter(size_t size_) : m_tree(size_ + 1, 0) {}
+	void Add(size_t rank_, long delta_)
+	{
+		for (auto i = rank_ + 1; i < m_tree.size(); i += i & (~i + 1))
+			m_tree[i] += delta_;
+	}
+	//! number of entries left with rank below rank_
+	size_t Below(size_t rank_) const
+	{
+		size_t n = 0;
+		for (auto i = rank_; i > 0; i -= i & (~i + 1))
+			n += m_tree[i];
+		return n;
+	}
+};
+
+//! rank error of pops of batchSize_ entries from a queue of numHeaps_ heaps:
+//! g_Prefill entries pushed by numThreads_ threads, then popped by one, each
+//! pop ranked among the entries left. Prints mean and max rank.
+void RunRankError(size_t numThreads_, size_t batchSize_)
+{
+	QueueType queue(numThreads_, g_HeapsPerThread);
+	// priorities 0..g_Prefill-1 in a random order, so that a priority is its rank
+	std::vector<uint64_t> priorities(g_Prefill);
+	for (size_t i = 0; i < g_Prefill; ++i)
+		priorities[i] = i;
+	std::shuffle(priorities.begin(), priorities.end(), std::minstd_rand(1));
+	std::vector<std::thread> threads;
+	for (auto t = 0u; t < numThreads_; ++t)
+	{
+		threads.emplace_back([&, t]() {
+			for (auto i = t; i < g_Prefill; i += numThreads_)
+				queue.Push(priorities[i], i);
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+	RankCounter left(g_Prefill);
+	for (size_t i = 0; i < g_Prefill; ++i)
+		left.Add(i, 1);
+	std::vector<EntryType> batch(batchSize_);
+	double sum = 0;
+	size_t max = 0, popped = 0;
+	for (size_t n; (n = queue.PopBatch(batch.data(), batchSize_)) != 0; )
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			const auto rank = left.Below(batch[i].m_priority);
+			sum += rank;
+			if (rank > max) max = rank;
+			left.Add(batch[i].m_priority, -1);
+		}
+		popped += n;
+	}
+	std::cout << "------" << queue.NumHeaps() << " heaps, batch " << batchSize_ << " : rank error mean "
+		<< sum/std::max<size_t>(popped, 1) << ", max " << max << " (" << popped << " popped)" << std::endl;
+}
+
+typedef Messenger::MBuffer<g_Rows, g_Columns, EntryType> EntryBufType;
+
+//! entries/s through input buffer -> queue -> output buffer, with one producer,
+//! one consumer and numMovers_ threads moving rows (or single entries if !rows_)
+void RunRowMoves(size_t numMovers_, bool rows_)
+{
+	auto input = std::make_unique<EntryBufType>();
+	auto output = std::make_unique<EntryBufType>();
+	QueueType queue(numMovers_, g_HeapsPerThread);
+	std::atomic<bool> stop{ false };
+	std::atomic<size_t> consumed{ 0 };
+	std::vector<std::thread> threads;
+	threads.emplace_back([&]() {
+		uint64_t state = 88172645463325252ull;
+		size_t absLoc;
+		for (auto loc = input->GetNextLocForProd(absLoc); loc < input->BufSize(); loc = input->GetNextLocForProd(absLoc))
+		{
+			auto* row = (*input)[loc];
+			for (auto col = 0u; col < input->BufElemSize(); ++col)
+			{
+				row[col].m_priority = NextPriority(state);
+				row[col].m_value = absLoc;
+			}
+			input->SetLocReadyForCons(absLoc);
+		}
+	});
+	for (auto m = 0u; m < numMovers_; ++m)
+	{
+		threads.emplace_back([&]() {
+			std::vector<EntryType> row(g_Columns);
+			while (!stop)
+			{
+				if (rows_)
+				{
+					queue.PushFrom(*input);
+					queue.PopTo(*output);
+					continue;
+				}
+				size_t absLoc;
+				const auto loc = input->TryGetNextLocForCons(absLoc);
+				if (loc < input->BufSize())
+				{
+					for (auto col = 0u; col < input->BufElemSize(); ++col)
+						queue.Push((*input)[loc][col].m_priority, (*input)[loc][col].m_value);
+					input->SetLocReadyForProd(absLoc);
+				}
+				size_t n = 0;
+				while (n < row.size() && queue.TryPopMin(row[n].m_priority, row[n].m_value))
+					++n;
+				if (!n) continue;
+				const auto outLoc = output->GetNextLocForProd(absLoc);
+				if (outLoc >= output->BufSize()) break;
+				std::fill(row.begin() + n, row.end(), EntryType());
+				std::copy(row.begin(), row.end(), (*output)[outLoc]);
+				output->SetLocReadyForCons(absLoc);
+			}
+		});
+	}
+	threads.emplace_back([&]() {
+		size_t absLoc, n = 0;
+		for (auto loc = output->GetNextLocForCons(absLoc); loc < output->BufSize(); loc = output->GetNextLocForCons(absLoc))
+		{
+			for (auto col = 0u; col < output->BufElemSize(); ++col)
+				n += (*output)[loc][col].m_priority != EntryType::m_empty;
+			output->SetLocReadyForProd(absLoc);
+		}
+		consumed += n;
+	});
+	const auto start = std::chrono::steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::seconds(g_RunSecs));
+	stop = true;
+	input->Stop();
+	output->Stop();
+	for (auto& t : threads)
+		t.join();
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	std::cout << "------" << numMovers_ << " movers, " << (rows_ ? "rows" : "single entries") << " : "
+		<< consumed/secs.count() << " entries/s" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	int maxThreads = g_MaxThreads;
+	if (argc == 2)
+	{
+		sscanf(argv[1], "%d", &maxThreads);
+	}
+	else
+	{
+		std::cout << "Usage: MultiQueueStats <max num threads>\n";
+		std::cout << "No args provided. Taking defaults: " << maxThreads << " thread(s)\n" << std::endl;
+	}
+	std::cout << "Push/pop-min pairs, " << g_Prefill << " entries prefilled\n";
+	std::cout << "------------------------------------------------------\n";
+	for (size_t n = 1; n <= (size_t) maxThreads; n *= 2)
+	{
+		QueueType multi(n, g_HeapsPerThread);
+		const auto multiRate = RunPushPop(n, multi);
+		MutexPriorityQueue locked;
+		const auto lockedRate = RunPushPop(n, locked);
+		std::cout << "------" << n << " threads : MultiQueue " << multiRate << " pairs/s, mutex heap "
+			<< lockedRate << " pairs/s" << std::endl;
+	}
+	std::cout << "Rank error\n";
+	std::cout << "------------------------------------------------------\n";
+	for (size_t n = 1; n <= (size_t) maxThreads; n *= 2)
+	{
+		RunRankError(n, 1);
+		RunRankError(n, g_Columns);
+	}
+	std::cout << "Rows moved through the queue, " << g_Rows << "x" << g_Columns << " buffers\n";
+	std::cout << "------------------------------------------------------\n";
+	for (size_t n = 1; n <= (size_t) maxThreads; n *= 2)
+	{
+		RunRowMoves(n, true);
+		RunRowMoves(n, false);
+	}
+}
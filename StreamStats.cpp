@@ -0,0 +1,145 @@
+/*! \file StreamStats.cpp
+\brief  Performance stats for StreamSource and StreamSink.
+
+Usage in a pipeline:
+   StreamStats gen <MB> | StreamStats mbuf        - stdin into MBuffer rows, count records
+   StreamStats gen <MB> | StreamStats iostream    - std::getline from std::cin, count records
+   StreamStats gen <MB> | StreamStats relay | ... - stdin into MBuffer, rows out to stdout
+Stats are printed to stderr.
+*/
+#include "MStream.h"
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+
+// default MB generated
+static const auto g_GenMB = 512;
+// rows x columns (bytes) of the buffer
+static const size_t g_Rows = 256;
+static const size_t g_Columns = 64*1024;
+
+typedef Messenger::MBuffer<g_Rows, g_Columns, char> BufType;
+
+//! timer printing throughput on destruction
+class StreamTimer
+{
+	std::string	m_name;
+	std::string	m_unit;
+	std::chrono::steady_clock::time_point m_start;
+public:
+	size_t		m_count;
+	uint64_t	m_bytes;
+	StreamTimer(const std::string& name_, const std::string& unit_) :
+		m_name(name_), m_unit(unit_), m_start(std::chrono::steady_clock::now()),
+		m_count(0), m_bytes(0) {}
+	~StreamTimer()
+	{
+		std::chrono::duration<double> secs = std::chrono::steady_clock::now() - m_start;
+		std::cerr << "------" << m_name << " : " << m_count << " " << m_unit << "s, "
+			<< m_bytes << " bytes, " << secs.count() << "s ("
+			<< m_bytes/secs.count()/(1024*1024) << " MB/s, "
+			<< 1e9*secs.count()/m_count << " nsec/" << m_unit << ")" << std::endl;
+	}
+};
+
+//! write newline delimited records to stdout
+void Generate(size_t mb_)
+{
+	std::string rec;
+	std::vector<char> chunk;
+	const auto total = mb_*1024*1024;
+	size_t written = 0;
+	for (size_t i = 0; written < total; ++i)
+	{
+		rec = "record " + std::to_string(i) + " " + std::string(16 + i % 48, 'x') + "\n";
+		chunk.insert(chunk.end(), rec.begin(), rec.end());
+		if (chunk.size() >= 64*1024)
+		{
+			fwrite(chunk.data(), 1, chunk.size(), stdout);
+			written += chunk.size();
+			chunk.clear();
+		}
+	}
+	fflush(stdout);
+}
+
+//! stdin into MBuffer rows; one consumer counts records
+void IngestMBuffer()
+{
+	auto buffer = std::make_unique<BufType>();
+	Messenger::StreamSource<BufType> source(Messenger::Framing::DELIMITED, '\n');
+	StreamTimer timer("StreamSource into MBuffer", "record");
+	std::atomic<size_t> rows;
+	rows.store(0);
+	std::thread consumer([&]() {
+		while (true)
+		{
+			size_t absLoc;
+			auto loc = buffer->GetNextLocForCons(absLoc);
+			if (loc >= buffer->BufSize()) break; // stopped
+			timer.m_count += source.ForEachRecord((*buffer)[loc],
+				[&timer](const Messenger::RecordView& r_) { timer.m_bytes += r_.m_length + 1; });
+			buffer->SetLocReadyForProd(absLoc);
+			++rows;
+		}
+	});
+	const auto published = source.Run(*buffer);
+	while (rows.load() < published)
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	buffer->Stop();
+	consumer.join();
+}
+
+//! std::getline from std::cin
+void IngestIostream()
+{
+	std::ios::sync_with_stdio(false);
+	StreamTimer timer("iostream getline", "record");
+	std::string line;
+	while (std::getline(std::cin, line))
+	{
+		++timer.m_count;
+		timer.m_bytes += line.size() + 1;
+	}
+}
+
+//! stdin into MBuffer rows, rows out to stdout
+void Relay()
+{
+	auto buffer = std::make_unique<BufType>();
+	Messenger::StreamSource<BufType> source(Messenger::Framing::DELIMITED, '\n');
+	Messenger::StreamSink<BufType> sink(*buffer);
+	StreamTimer timer(std::string("StreamSource -> MBuffer -> StreamSink")
+		+ (sink.Splices() ? " (vmsplice)" : " (write)"), "row");
+	std::thread consumer([&sink]() { sink.Run(); });
+	const auto published = source.Run(*buffer);
+	while (sink.NumRows() < published)
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	sink.Stop();
+	consumer.join();
+	timer.m_count = published;
+	timer.m_bytes = sink.BytesWritten();
+}
+
+int main(int argc, char** argv)
+{
+	const std::string mode = argc > 1 ? argv[1] : "";
+	if (mode == "gen")
+	{
+		int mb = g_GenMB;
+		if (argc > 2) sscanf(argv[2], "%d", &mb);
+		Generate(mb);
+	}
+	else if (mode == "mbuf")
+		IngestMBuffer();
+	else if (mode == "iostream")
+		IngestIostream();
+	else if (mode == "relay")
+		Relay();
+	else
+	{
+		std::cerr << "Usage: StreamStats gen <MB> | StreamStats mbuf|iostream|relay\n";
+		return 1;
+	}
+}
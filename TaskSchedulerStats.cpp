@@ -0,0 +1,149 @@
+/*! \file TaskSchedulerStats.cpp
+\brief  Performance stats for TaskScheduler.
+
+Compares task submission through the MBuffer injection queue against
+a mutex-protected submission queue drained by the same number of workers.
+*/
+#include "MTaskScheduler.h"
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// default number of submitters, workers
+static const auto g_NumSubmitters = 2;
+static const auto g_NumWorkers = 2;
+// tasks submitted by each submitter
+static const size_t g_TasksPerSubmitter = 2'000'000;
+// tasks submitted per SubmitBatch call: one injection row
+static const size_t g_BatchSize = 64;
+
+//! number of tasks run so far
+static std::atomic<size_t> g_numRun;
+
+static void CountTask(void*)
+{
+	g_numRun.fetch_add(1, std::memory_order_relaxed);
+}
+
+//! Baseline executor: std::deque of tasks guarded by a mutex.
+class MutexTaskQueue
+{
+	std::mutex	m_mutex;
+	std::deque<Messenger::Task>	m_tasks;
+	std::atomic<bool>	m_stop;
+	std::vector<std::thread>	m_threads;
+public:
+	MutexTaskQueue(size_t numWorkers_)
+	{
+		m_stop.store(false);
+		for (auto i = 0u; i < numWorkers_; ++i)
+			m_threads.push_back(std::thread(ThreadFuncForWorker, this));
+	}
+	~MutexTaskQueue()
+	{
+		Stop();
+	}
+	template<typename TIter>
+	bool SubmitBatch(TIter first_, TIter last_)
+	{
+		// one lock per batch, as for the MBuffer injection queue
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_tasks.insert(m_tasks.end(), first_, last_);
+		return true;
+	}
+	void Stop()
+	{
+		if (m_stop.exchange(true)) return;
+		for (auto& t : m_threads)
+			t.join();
+	}
+	void Run()
+	{
+		Messenger::Task task;
+		while (!m_stop)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (!m_tasks.empty())
+				{
+					task = m_tasks.front();
+					m_tasks.pop_front();
+				}
+			}
+			if (task)
+			{
+				task();
+				task = Messenger::Task();
+				continue;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(1));
+		}
+	}
+	static void ThreadFuncForWorker(MutexTaskQueue* q)
+	{
+		q->Run();
+	}
+};
+
+//! submit g_TasksPerSubmitter tasks from each of numSubmitters_ threads
+//! and wait until all have run. Print time per task.
+template<typename TExecutor>
+void RunSubmitters(const std::string& name_, size_t numSubmitters_, TExecutor& executor_)
+{
+	const auto total = numSubmitters_*g_TasksPerSubmitter;
+	g_numRun.store(0);
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> submitters;
+	for (auto i = 0u; i < numSubmitters_; ++i)
+	{
+		submitters.push_back(std::thread([&executor_]() {
+			std::vector<Messenger::Task> batch(g_BatchSize, Messenger::Task(CountTask));
+			for (size_t n = 0; n < g_TasksPerSubmitter; n += g_BatchSize)
+				executor_.SubmitBatch(batch.begin(), batch.end());
+		}));
+	}
+	for (auto& t : submitters)
+		t.join();
+	auto submitted = std::chrono::steady_clock::now();
+	while (g_numRun.load() < total)
+		std::this_thread::sleep_for(std::chrono::microseconds(10));
+	auto end = std::chrono::steady_clock::now();
+	executor_.Stop();
+
+	std::chrono::duration<double> submitSecs = submitted - start;
+	std::chrono::duration<double> totalSecs = end - start;
+	std::cout << "------" << name_ << " : " << total << " tasks, submit "
+		<< submitSecs.count() << "s (" << 1e6*submitSecs.count()/total
+		<< " usec/task), run " << totalSecs.count() << "s ("
+		<< 1e6*totalSecs.count()/total << " usec/task)" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	int numSubmitters = g_NumSubmitters, numWorkers = g_NumWorkers;
+	if (argc == 3)
+	{
+		sscanf(argv[1], "%d", &numSubmitters);
+		sscanf(argv[2], "%d", &numWorkers);
+	}
+	else
+	{
+		std::cout << "Usage: TaskSchedulerStats <num submitters> <num workers>\n";
+		std::cout << "No args provided. Taking defaults: "
+			<< numSubmitters << " submitter(s), "
+			<< numWorkers << " worker(s)\n" << std::endl;
+	}
+	// injection queue: 16384 rows of g_BatchSize tasks
+	typedef Messenger::TaskScheduler<16384, g_BatchSize> SchedulerType;
+	{
+		auto scheduler = std::make_unique<SchedulerType>(numWorkers);
+		RunSubmitters("MBuffer injection queue", numSubmitters, *scheduler);
+	}
+	{
+		MutexTaskQueue queue(numWorkers);
+		RunSubmitters("mutex submission queue", numSubmitters, queue);
+	}
+}
@@ -0,0 +1,168 @@
+/*! \file TimerWheelStats.cpp
+\brief  Delivery checks and lateness stats for TimerWheel.
+
+Producer threads schedule messages with delays spread over the first
+three wheel levels, so that many are cascaded from level 2 to 1 to 0
+before delivery. A consumer checks that no message arrives before its due
+time and that every message arrives, and reports lateness per level.
+Last, the wheel is stopped while the buffer it delivers to is full.
+*/
+#include "MTimerWheel.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+// default number of messages and producers
+static const auto g_NumMsgs = 200'000;
+static const auto g_NumProducers = 2;
+// wheel resolution: level 0 spans 512 usec, level 1 131 msec
+static const auto g_Tick = std::chrono::microseconds(2);
+// longest delay, in level 2
+static const auto g_MaxDelay = std::chrono::milliseconds(1000);
+static const size_t g_NumLevels = 3;
+
+typedef std::chrono::steady_clock ClockType;
+
+//! a message: its due time and id; m_id of the filler is UINT64_MAX
+struct TimedMsg {
+	ClockType::rep	m_due = 0;
+	uint64_t		m_id = UINT64_MAX;
+};
+
+typedef Messenger::MBuffer<1024, 16, TimedMsg> BufType;
+typedef Messenger::TimerWheel<BufType> WheelType;
+
+//! wheel level a delay is first inserted in
+size_t LevelOf(ClockType::duration delay_)
+{
+	const auto ticks = (uint64_t) (delay_/g_Tick);
+	size_t level = 0;
+	while (level + 1 < g_NumLevels && (ticks >> (8*(level + 1))))
+		++level;
+	return level;
+}
+
+//! per level counts and lateness
+struct LevelStats {
+	size_t	m_scheduled = 0;
+	size_t	m_delivered = 0;
+	size_t	m_early = 0;
+	double	m_lateSum = 0;
+	double	m_lateMax = 0;
+};
+
+void RunDelivery(size_t numMsgs_, size_t numProducers_)
+{
+	auto buffer = std::make_unique<BufType>();
+	WheelType wheel(*buffer, g_Tick);
+	std::vector<ClockType::duration> delays(numMsgs_);
+	std::minstd_rand rand(1);
+	// log-uniform delays, so that each level gets its share
+	std::uniform_real_distribution<double> exponent(0, std::log(std::chrono::duration<double>(g_MaxDelay)/g_Tick));
+	std::vector<LevelStats> levels(g_NumLevels);
+	for (auto& delay : delays)
+	{
+		delay = std::chrono::duration_cast<ClockType::duration>(g_Tick*std::exp(exponent(rand)));
+		++levels[LevelOf(delay)].m_scheduled;
+	}
+	std::vector<unsigned char> seen(numMsgs_, 0);
+	size_t duplicates = 0;
+	std::thread consumer([&]() {
+		size_t absLoc;
+		for (auto loc = buffer->GetNextLocForCons(absLoc); loc < buffer->BufSize(); loc = buffer->GetNextLocForCons(absLoc))
+		{
+			const auto now = ClockType::now().time_since_epoch().count();
+			for (auto col = 0u; col < buffer->BufElemSize(); ++col)
+			{
+				const auto& msg = (*buffer)[loc][col];
+				if (msg.m_id == UINT64_MAX) continue;
+				duplicates += seen[msg.m_id]++ != 0;
+				auto& level = levels[LevelOf(delays[msg.m_id])];
+				++level.m_delivered;
+				if (now < msg.m_due) ++level.m_early;
+				const auto late = 1e-3*(now - msg.m_due);
+				level.m_lateSum += late;
+				level.m_lateMax = std::max(level.m_lateMax, late);
+			}
+			buffer->SetLocReadyForProd(absLoc);
+		}
+	});
+	std::vector<std::thread> producers;
+	for (auto p = 0u; p < numProducers_; ++p)
+	{
+		producers.emplace_back([&, p]() {
+			for (auto i = p; i < numMsgs_; i += numProducers_)
+			{
+				TimedMsg msg;
+				const auto due = ClockType::now() + delays[i];
+				msg.m_due = due.time_since_epoch().count();
+				msg.m_id = i;
+				wheel.Schedule(msg, due);
+			}
+		});
+	}
+	for (auto& t : producers)
+		t.join();
+	std::this_thread::sleep_for(g_MaxDelay + std::chrono::milliseconds(100));
+	wheel.Stop();
+	buffer->Stop();
+	consumer.join();
+	size_t delivered = 0, early = 0;
+	std::cout << "Delivery of " << numMsgs_ << " messages, tick " << g_Tick.count() << " usec\n";
+	std::cout << "------------------------------------------------------\n";
+	for (auto l = 0u; l < g_NumLevels; ++l)
+	{
+		const auto& level = levels[l];
+		std::cout << "------level " << l << " : " << level.m_delivered << " of " << level.m_scheduled
+			<< " delivered, " << level.m_early << " early, late by "
+			<< level.m_lateSum/std::max<size_t>(level.m_delivered, 1) << " usec mean, "
+			<< level.m_lateMax << " usec max" << std::endl;
+		delivered += level.m_delivered;
+		early += level.m_early;
+	}
+	if (delivered != numMsgs_ || duplicates)
+		std::cout << "ERROR: " << delivered << " of " << numMsgs_ << " messages delivered, "
+			<< duplicates << " twice\n";
+	if (early)
+		std::cout << "ERROR: " << early << " messages delivered early\n";
+}
+
+//! Stop of a wheel whose buffer is full and not consumed
+void RunStopWhenFull()
+{
+	typedef Messenger::MBuffer<4, 1, TimedMsg> SmallBufType;
+	auto buffer = std::make_unique<SmallBufType>();
+	Messenger::TimerWheel<SmallBufType> wheel(*buffer, g_Tick);
+	for (auto i = 0u; i < 100; ++i)
+		wheel.ScheduleAfter(TimedMsg(), std::chrono::microseconds(0));
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	const auto start = ClockType::now();
+	wheel.Stop();
+	std::chrono::duration<double> secs = ClockType::now() - start;
+	std::cout << "------stop with a full buffer : " << 1e3*secs.count() << " msec, "
+		<< buffer->Occupancy() << " of " << buffer->BufSize() << " rows delivered" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	int numMsgs = g_NumMsgs, numProducers = g_NumProducers;
+	if (argc == 3)
+	{
+		sscanf(argv[1], "%d", &numMsgs);
+		sscanf(argv[2], "%d", &numProducers);
+	}
+	else
+	{
+		std::cout << "Usage: TimerWheelStats <num messages> <num producers>\n";
+		std::cout << "No args provided. Taking defaults: " << numMsgs << " message(s), "
+			<< numProducers << " producer(s)\n" << std::endl;
+	}
+	RunDelivery((size_t) numMsgs, (size_t) std::max(numProducers, 1));
+	RunStopWhenFull();
+}